@@ -1,314 +1,1169 @@
 static struct tm_temp_allocator_api *tm_temp_allocator_api;
 static struct tm_allocator_api *tm_allocator_api;
+static struct tm_error_api *tm_error_api;
+static struct tm_logger_api *tm_logger_api;
 static struct tm_os_api *tm_os_api;
+static struct tm_profiler_api *tm_profiler_api;
+static struct tm_statistics_source_api *tm_statistics_source_api;
 
 #include <foundation/allocator.h>
 #include <foundation/api_registry.h>
 #include <foundation/atomics.inl>
 #include <foundation/carray.inl>
+#include <foundation/carray_print.inl>
+#include <foundation/error.h>
+#include <foundation/log.h>
 #include <foundation/os.h>
+#include <foundation/profiler.h>
+#include <foundation/unit_test.h>
 
 #include <plugins/renderer/render_backend.h>
+#include <plugins/statistics/statistics_source.h>
 
 #include "plugins/mag_async_gpu_queue/mag_async_gpu_queue.h"
 
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
 #define THREAD_STACK_SIZE (256 * 1024)
 
-#define task_t mag_async_gpu_queue_task_params_t
+// How long a worker thread waits for fences before it checks for new requests, in nanoseconds.
+// Split between the lanes of the worker that have executing tasks.
+#define FENCE_WAIT_TIMEOUT 500000ULL
+
+#define MAX_LANE_NAME_LENGTH 64
+
+// GPU time per dispatch that a lane assumes until it has measured its own tasks, in nanoseconds.
+#define DEFAULT_NS_PER_DISPATCH 20000.0
+// Weight of the latest measurement in the moving average of the GPU time per dispatch.
+#define DISPATCH_TIME_SMOOTHING 0.125
+
+// Task slots are allocated in pages that are never moved or freed, so any thread can read a slot
+// without a lock. This limits the number of tasks alive at a time to 4M.
+#define TASK_SLOT_PAGE_SIZE 1024
+#define MAX_TASK_SLOT_PAGES 4096
+
+// Dependencies between tasks are allocated in pages too, which limits them to 4M at a time.
+#define DEPENDENCY_PAGE_SIZE 1024
+#define MAX_DEPENDENCY_PAGES 4096
+
+// Close the dependents list of a task once it's done, telling whether it was completed or
+// canceled, so that tasks submitted later with it as a prerequisite know what to do.
+#define DEPENDENTS_COMPLETED 0xffffffffu
+#define DEPENDENTS_CANCELED 0xfffffffeu
+
+// Capacity of the ring that completed task ids are reported through. Must be a power of two.
+// Completions that don't fit wait on the worker threads until drain_completed() makes room.
+#define COMPLETION_RING_SIZE 4096
+
+// Children per heap node. A wider heap is shallower, and the children of a node share a cache line.
+#define HEAP_ARITY 4
+#define NOT_IN_HEAP UINT32_MAX
+
+// Latencies are counted in buckets a quarter of an octave wide, starting at 1 µs.
+#define LATENCY_HISTOGRAM_SIZE 96
+// How much of the latency counts of a frame is left in the next frame's percentiles.
+#define LATENCY_HISTOGRAM_DECAY 0.95
+
+// Low 32 bits of a task slot's state word. The high 32 bits hold the generation of the slot, which
+// is also the high half of the task id, so a stale id never matches a reused slot.
+enum task_state {
+    TASK_STATE_FREE,
+    // Submitted with prerequisites that aren't done yet. The task isn't in the heap of its lane, and
+    // is queued by the last prerequisite that completes.
+    TASK_STATE_WAITING,
+    TASK_STATE_QUEUED,
+    TASK_STATE_EXECUTING,
+    // Completed, but not yet confirmed by is_task_done() or cancel_task().
+    TASK_STATE_COMPLETED,
+    // Canceled while queued or executing. The worker thread frees the slot when it's done with the
+    // task.
+    TASK_STATE_CANCELED,
+};
 
-typedef struct executing_task_t
+typedef struct task_slot_t
 {
-    uint64_t task_id;
-    uint32_t *fences;
+    atomic_uint_least64_t state;
+    // Tasks that have this task as a prerequisite: the generation of the slot in the high 32 bits,
+    // like `state`, and the first dependency of the list plus one in the low 32 bits, or one of the
+    // `DEPENDENTS_*` markers once the task is done.
+    atomic_uint_least64_t dependents;
+    // Bit `generation % 64` is set when the task of that generation completes, so that tasks that
+    // have it as a prerequisite know how it went after the slot is reused. Only written by the
+    // thread that owns the slot.
+    atomic_uint_least64_t completed_generations;
+    // Next slot in the free list, plus one.
+    atomic_uint_least32_t next_free;
+    // Prerequisites of a waiting task that aren't done yet, plus one while they're being added.
+    atomic_uint_least32_t num_waiting_prerequisites;
+    // Fences of the executing task that haven't signaled yet. Only touched by the worker thread.
+    uint32_t num_pending_fences;
+    // Set on submit, so that the heap only needs to move ids and priorities, and cancel_task() can
+    // call the callback from any thread.
+    uint32_t lane;
+    uint32_t num_dispatches;
+    TM_PAD(4);
+    uint64_t readback_bytes;
+    // Priority that the task is queued with. Set on submit, and by the worker thread for priority
+    // updates that reach it before the task does.
+    uint64_t priority;
+    tm_clock_o submit_time;
+    // When the task was launched. Only touched by the worker thread.
+    tm_clock_o launch_time;
+    void (*f)(mag_async_gpu_queue_task_args_t *args);
+    void (*cancel_callback)(void *data);
     void (*completion_callback)(void *data);
     void *data;
-} executing_task_t;
+} task_slot_t;
 
-typedef struct mag_async_gpu_queue_o
+// Entry in the dependents list of a task.
+typedef struct dependency_t
 {
-    tm_allocator_i allocator;
-    tm_renderer_backend_i *backend;
+    // Task that waits for the prerequisite.
+    uint64_t task_id;
+    // Next dependency in the dependents list or in the free list, plus one.
+    atomic_uint_least32_t next;
+    TM_PAD(4);
+} dependency_t;
+
+enum inbox_op {
+    INBOX_OP_SUBMIT,
+    INBOX_OP_UPDATE_PRIORITY,
+    INBOX_OP_CANCEL,
+};
+
+typedef struct inbox_request_t
+{
+    uint64_t task_id;
+    // Only used by `INBOX_OP_UPDATE_PRIORITY`. Submitted tasks are queued with the priority in their
+    // slot.
+    uint64_t priority;
+} inbox_request_t;
+
+// Batch of requests of the same kind to the worker thread of a lane, which owns the lane's heap.
+typedef struct inbox_item_t
+{
+    struct inbox_item_t *next;
+    enum inbox_op op;
+    uint32_t num_requests;
+    inbox_request_t requests[];
+} inbox_item_t;
+
+// Cell of the completion ring. `sequence` equals the ring position when the cell is free to write
+// and the position plus one when it holds a completion to read.
+typedef struct completion_cell_t
+{
+    atomic_uint_least64_t sequence;
+    uint64_t task_id;
+} completion_cell_t;
+
+// Statistics published for each lane by begin_frame().
+enum lane_stat {
+    LANE_STAT_QUEUED,
+    LANE_STAT_EXECUTING,
+    LANE_STAT_COMPLETED,
+    LANE_STAT_CANCELED,
+    LANE_STAT_QUEUE_LATENCY_P50,
+    LANE_STAT_QUEUE_LATENCY_P99,
+    LANE_STAT_EXECUTION_LATENCY_P50,
+    LANE_STAT_EXECUTION_LATENCY_P99,
+    LANE_STAT_FENCE_WAIT,
+    NUM_LANE_STATS,
+};
+
+static const struct
+{
+    const char *path;
+    const char *display_name;
+} LANE_STATS[NUM_LANE_STATS] = {
+    [LANE_STAT_QUEUED] = { "queued", "Queued" },
+    [LANE_STAT_EXECUTING] = { "executing", "Executing" },
+    [LANE_STAT_COMPLETED] = { "completed", "Completed per Frame" },
+    [LANE_STAT_CANCELED] = { "canceled", "Canceled per Frame" },
+    [LANE_STAT_QUEUE_LATENCY_P50] = { "queue_latency_p50_ms", "Queue Latency p50 (ms)" },
+    [LANE_STAT_QUEUE_LATENCY_P99] = { "queue_latency_p99_ms", "Queue Latency p99 (ms)" },
+    [LANE_STAT_EXECUTION_LATENCY_P50] = { "execution_latency_p50_ms", "Execution Latency p50 (ms)" },
+    [LANE_STAT_EXECUTION_LATENCY_P99] = { "execution_latency_p99_ms", "Execution Latency p99 (ms)" },
+    [LANE_STAT_FENCE_WAIT] = { "fence_wait_ms", "Fence Wait per Frame (ms)" },
+};
+
+// Task that the worker thread is done with, recorded for write_trace().
+typedef struct trace_event_t
+{
+    // Set once the rest of the event is written.
+    atomic_uint_least32_t written;
+    uint32_t lane;
+    uint64_t task_id;
+    uint32_t num_dispatches;
+    bool canceled;
+    TM_PAD(3);
+    tm_clock_o submit_time;
+    // Zero for tasks that were canceled while queued.
+    tm_clock_o launch_time;
+    tm_clock_o end_time;
+} trace_event_t;
+
+typedef struct heap_entry_t
+{
+    uint64_t priority;
+    uint64_t task_id;
+} heap_entry_t;
+
+typedef struct worker_t worker_t;
+
+typedef struct lane_t
+{
+    char name[MAX_LANE_NAME_LENGTH];
     uint32_t max_simultaneous_tasks;
     uint32_t device_affinity_mask;
-
+    bool can_borrow;
+    TM_PAD(7);
+    worker_t *worker;
+
+    // Read by the other workers to decide whether capacity can be borrowed from this lane.
+    atomic_uint_least32_t num_queued;
+    atomic_uint_least32_t num_executing;
+
+    // Lock-free stack of `inbox_item_t *`, newest first.
+    atomic_uint_least64_t inbox;
+
+    // Only touched by the worker thread of the lane.
+    heap_entry_t *task_heap;
+    // Index in `task_heap` of the task in each slot, `NOT_IN_HEAP` if none.
+    uint32_t *heap_positions;
+    // Fences of all the executing tasks that haven't signaled yet, and the ID of the task that owns
+    // each fence. Fences are added when a task is launched and swap-removed when they signal, so the
+    // arrays can be passed to `wait_for_reads()` as is.
+    uint32_t *pending_fences;
+    uint64_t *pending_fence_tasks;
+    bool *pending_fences_signaled;
+
+    // Moving average of the measured GPU time per dispatch of the lane's tasks, and when the last
+    // task with fences completed. Only touched by the worker thread of the lane.
+    double ns_per_dispatch;
+    tm_clock_o last_completion;
+
+    // Counted by the worker thread of the lane and by cancel_task() since the last begin_frame().
+    atomic_uint_least32_t num_completed;
+    atomic_uint_least32_t num_canceled;
+    atomic_uint_least64_t fence_wait_ns;
+    atomic_uint_least32_t queue_latency_counts[LATENCY_HISTOGRAM_SIZE];
+    atomic_uint_least32_t execution_latency_counts[LATENCY_HISTOGRAM_SIZE];
+
+    // Only touched by begin_frame(). The latency counts of recent frames, decayed, so that the
+    // percentiles aren't computed from the few tasks of a single frame.
+    double queue_latency_histogram[LATENCY_HISTOGRAM_SIZE];
+    double execution_latency_histogram[LATENCY_HISTOGRAM_SIZE];
+    // NULL if the queue has no name.
+    double *stats[NUM_LANE_STATS];
+} lane_t;
+
+// Thread that runs one or more lanes.
+struct worker_t
+{
+    struct mag_async_gpu_queue_o *q;
     tm_thread_o thread;
-    atomic_uint_least32_t shutdown;
+    // Signaled when items are pushed to the inbox of one of the lanes, or when capacity is released
+    // that the lanes may be waiting for.
+    tm_semaphore_o sem;
+    // Completed tasks that didn't fit in the completion ring, oldest first.
+    uint64_t *unreported_completions;
+};
 
-    atomic_uint_least64_t next_id;
+typedef struct mag_async_gpu_queue_o
+{
+    tm_allocator_i allocator;
+    tm_renderer_backend_i *backend;
 
-    tm_critical_section_o tasks_cs;
-    tm_semaphore_o sem;
-    task_t *task_heap;
-    // IDs match the heap order but are stored separately to make the
-    // linear search faster by not polluting the CPU cache.
-    uint64_t *task_ids;
-
-    tm_critical_section_o executing_tasks_cs;
-    executing_task_t *executing_tasks;
-
-    tm_critical_section_o completed_tasks_cs;
-    // completed but not yet confirmed (by is_task_done()) tasks
-    uint64_t *completed_tasks;
-    // canceled but currently executing tasks
-    uint64_t *canceled_tasks;
+    atomic_uint_least32_t shutdown;
+    uint32_t num_lanes;
+    lane_t *lanes;
+    uint32_t num_workers;
+    // Sum of `max_simultaneous_tasks` of all the lanes.
+    uint32_t max_simultaneous_tasks;
+    worker_t *workers;
+    // Executing tasks of all the lanes.
+    atomic_uint_least32_t num_executing;
+    uint32_t padding;
+
+    // Per-frame budgets, 0 if unlimited, and how much of them the tasks launched since the last
+    // begin_frame() have used.
+    uint64_t gpu_time_budget_per_frame_ns;
+    uint64_t readback_bytes_budget_per_frame;
+    atomic_uint_least64_t frame_gpu_time_ns;
+    atomic_uint_least64_t frame_readback_bytes;
+
+    // Buffer of `max_trace_events` events, NULL if tracing is off. Events are appended until the
+    // buffer is full.
+    tm_clock_o create_time;
+    trace_event_t *trace_events;
+    uint32_t max_trace_events;
+    atomic_uint_least32_t num_trace_events;
+
+    // `task_slot_t *` pages, allocated on demand.
+    atomic_uint_least64_t slot_pages[MAX_TASK_SLOT_PAGES];
+    atomic_uint_least32_t num_slots;
+    // Head of the free slot list: slot plus one in the low 32 bits, and a counter in the high 32
+    // bits that changes with each push and pop, so that a concurrent pop can't succeed with a stale
+    // `next_free`.
+    atomic_uint_least64_t free_slots;
+
+    // `dependency_t *` pages and free list, managed the same way as the task slots.
+    atomic_uint_least64_t dependency_pages[MAX_DEPENDENCY_PAGES];
+    atomic_uint_least32_t num_dependencies;
+    TM_PAD(4);
+    atomic_uint_least64_t free_dependencies;
+
+    // Bounded lock-free ring of completed task ids. Written by the worker threads, read by
+    // drain_completed().
+    completion_cell_t completions[COMPLETION_RING_SIZE];
+    atomic_uint_least64_t completions_write_pos;
+    uint64_t completions_read_pos;
+    // Set by a worker thread when the ring was full, so that drain_completed() wakes the workers up
+    // once there's room again.
+    atomic_uint_least32_t completions_overflowed;
 } mag_async_gpu_queue_o;
 
 // Returns the index of parent item of the heap item at index `i`.
 static inline uint32_t heap__parent(uint32_t i)
 {
-    return i > 0 ? (i - 1) / 2 : UINT32_MAX;
+    return (i - 1) / HEAP_ARITY;
 }
 
 // Returns the index of the first child of the heap item at index `i`.
 static inline uint32_t heap__first_child(uint32_t i)
 {
-    return i * 2 + 1;
+    return i * HEAP_ARITY + 1;
 }
 
-// Swaps the heap items at indices `a` and `b`.
-static void heap__swap(task_t *heap, uint64_t *task_ids, uint32_t a, uint32_t b)
+// Stores `entry` at index `i` and records its position.
+static inline void heap__set(lane_t *lane, uint32_t i, heap_entry_t entry)
 {
-    const struct task_t tmp = heap[a];
-    heap[a] = heap[b];
-    heap[b] = tmp;
-
-    const uint64_t tmp_id = task_ids[a];
-    task_ids[a] = task_ids[b];
-    task_ids[b] = tmp_id;
+    lane->task_heap[i] = entry;
+    lane->heap_positions[(uint32_t)entry.task_id - 1] = i;
 }
 
-// Updates the heap so that the heap invariant is maintained after the heap value at index `i` has
-// changed.
-static void heap__update(struct task_t *heap, uint64_t *task_ids, uint32_t i)
+// As long as the item at index `i` has a child that is smaller than the item, moves the smallest
+// child up. The item is moved with a hole instead of swaps.
+static void heap__sift_down(lane_t *lane, uint32_t i)
 {
+    heap_entry_t *heap = lane->task_heap;
     const uint32_t n = (uint32_t)tm_carray_size(heap);
+    const heap_entry_t entry = heap[i];
 
-    // As long as item has a parent and is smaller than its parent, swap.
-    while (i) {
-        const uint32_t p = heap__parent(i);
-        if (i < n && heap[i].priority < heap[p].priority) {
-            heap__swap(heap, task_ids, i, p);
-            i = p;
-        } else
-            break;
-    }
-
-    // As long as item has a child that is smaller than the item, swap the item with its smallest
-    // child.
     while (true) {
-        const uint32_t l = heap__first_child(i);
-        if (l >= n)
+        const uint32_t first = heap__first_child(i);
+        if (first >= n)
             break;
-        const uint32_t r = l + 1;
-        const uint32_t smallest = r >= n || heap[l].priority < heap[r].priority ? l : r;
-        if (heap[smallest].priority < heap[i].priority) {
-            heap__swap(heap, task_ids, i, smallest);
-            i = smallest;
-        } else
+        const uint32_t end = tm_min(first + HEAP_ARITY, n);
+        uint32_t smallest = first;
+        for (uint32_t c = first + 1; c < end; ++c) {
+            if (heap[c].priority < heap[smallest].priority)
+                smallest = c;
+        }
+        if (heap[smallest].priority >= entry.priority)
             break;
+        heap__set(lane, i, heap[smallest]);
+        i = smallest;
     }
+
+    heap__set(lane, i, entry);
+}
+
+// Updates the heap so that the heap invariant is maintained after the heap value at index `i` has
+// changed.
+static void heap__update(lane_t *lane, uint32_t i)
+{
+    heap_entry_t *heap = lane->task_heap;
+    const heap_entry_t entry = heap[i];
+
+    // As long as item has a parent and is smaller than its parent, move the parent down.
+    const uint32_t start = i;
+    while (i && entry.priority < heap[heap__parent(i)].priority) {
+        heap__set(lane, i, heap[heap__parent(i)]);
+        i = heap__parent(i);
+    }
+
+    if (i == start)
+        heap__sift_down(lane, i);
+    else
+        heap__set(lane, i, entry);
+}
+
+// Restores the heap invariant for the whole heap in O(n), which is cheaper than updating the items
+// one by one when a large part of the heap has changed.
+static void heap__rebuild(lane_t *lane)
+{
+    const uint32_t n = (uint32_t)tm_carray_size(lane->task_heap);
+    if (n < 2)
+        return;
+    for (uint32_t i = heap__parent(n - 1) + 1; i-- > 0;)
+        heap__sift_down(lane, i);
 }
 
 // Pops the top item from the heap and returns it.
-static task_t heap__pop(task_t *heap, uint64_t *task_ids, uint64_t *out_id)
-{
-    task_t res = heap[0];
-    *out_id = task_ids[0];
-    heap__swap(heap, task_ids, 0, (uint32_t)tm_carray_size(heap) - 1);
-    tm_carray_pop(heap);
-    tm_carray_pop(task_ids);
-    heap__update(heap, task_ids, 0);
+static heap_entry_t heap__pop(lane_t *lane)
+{
+    const heap_entry_t res = lane->task_heap[0];
+    lane->heap_positions[(uint32_t)res.task_id - 1] = NOT_IN_HEAP;
+    const heap_entry_t last = tm_carray_pop(lane->task_heap);
+    if (tm_carray_size(lane->task_heap)) {
+        lane->task_heap[0] = last;
+        heap__update(lane, 0);
+    }
     return res;
 }
 
-// Pushes the item `h` to the heap.
-static void heap__push(task_t **heap, uint64_t **task_ids, task_t task, uint64_t id, tm_allocator_i *a)
+// Adds the task to the end of the heap without restoring the heap invariant.
+static void heap__append(lane_t *lane, uint64_t task_id, uint64_t priority, tm_allocator_i *a)
 {
-    tm_carray_push(*heap, task, a);
-    tm_carray_push(*task_ids, id, a);
-    heap__update(*heap, *task_ids, (uint32_t)tm_carray_size(*heap) - 1);
+    const uint32_t slot_i = (uint32_t)task_id - 1;
+    if (slot_i >= tm_carray_size(lane->heap_positions)) {
+        const uint64_t old_size = tm_carray_size(lane->heap_positions);
+        tm_carray_resize(lane->heap_positions, slot_i + 1, a);
+        memset(lane->heap_positions + old_size, 0xff, (slot_i + 1 - old_size) * sizeof(uint32_t));
+    }
+
+    const heap_entry_t entry = { .priority = priority, .task_id = task_id };
+    tm_carray_push(lane->task_heap, entry, a);
+    lane->heap_positions[slot_i] = (uint32_t)tm_carray_size(lane->task_heap) - 1;
 }
 
 // Deletes element at index i from the heap
-static void heap__remove(task_t *heap, uint64_t *task_ids, uint32_t i)
+static void heap__remove(lane_t *lane, uint32_t i)
 {
-    uint64_t task_count = tm_carray_size(task_ids);
-    task_ids[i] = tm_carray_pop(task_ids);
-    heap[i] = tm_carray_pop(heap);
-    if (i < task_count - 1) {
-        heap__update(heap, task_ids, i);
+    lane->heap_positions[(uint32_t)lane->task_heap[i].task_id - 1] = NOT_IN_HEAP;
+    const heap_entry_t last = tm_carray_pop(lane->task_heap);
+    if (i < tm_carray_size(lane->task_heap)) {
+        lane->task_heap[i] = last;
+        heap__update(lane, i);
     }
 }
 
-static void wait_for_fences(tm_renderer_backend_i *backend, uint32_t *fences, bool *signaled, uint32_t n, uint32_t device_affinity_mask)
+static inline uint64_t task_state_word(uint64_t task_id, enum task_state state)
 {
-    while (!backend->wait_for_reads(backend->inst, fences, signaled, n, UINT64_MAX, device_affinity_mask))
-        ;
+    return (task_id & 0xffffffff00000000ULL) | state;
 }
 
-// Waits until at least one of the tasks is fully completed.
-static uint64_t *wait_for_task(mag_async_gpu_queue_o *q, executing_task_t *wait_tasks, tm_allocator_i *a)
+static inline enum task_state task_state_of(uint64_t word)
 {
-    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, taa);
+    return (enum task_state)(uint32_t)word;
+}
 
-    uint64_t *completed_ids = NULL;
-    uint32_t *fences = NULL;
-    struct fence_index
-    {
-        uint32_t task_i;
-        uint32_t fence_i;
-    } *fence_indexes = NULL;
-    bool *signaled = NULL;
+static inline bool task_state_matches(uint64_t word, uint64_t task_id)
+{
+    return word >> 32 == task_id >> 32;
+}
 
-    while (!tm_carray_size(completed_ids)) {
-        tm_carray_shrink(fences, 0);
-        tm_carray_shrink(fence_indexes, 0);
-        for (uint32_t i = 0; i < tm_carray_size(wait_tasks); ++i) {
-            tm_carray_push_array(fences, wait_tasks[i].fences, tm_carray_size(wait_tasks[i].fences), taa);
-            for (uint32_t fi = 0; fi < tm_carray_size(wait_tasks[i].fences); ++fi) {
-                struct fence_index index = { i, fi };
-                tm_carray_temp_push(fence_indexes, index, ta);
-            }
-        }
+static inline task_slot_t *task_slot(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    const uint32_t slot_i = (uint32_t)task_id - 1;
+    task_slot_t *page = (task_slot_t *)(uintptr_t)atomic_fetch_add_uint64_t(&q->slot_pages[slot_i / TASK_SLOT_PAGE_SIZE], 0);
+    return page + slot_i % TASK_SLOT_PAGE_SIZE;
+}
 
-        tm_carray_temp_resize(signaled, tm_carray_size(fences), ta);
-        memset(signaled, 0, sizeof(*signaled) * tm_carray_size(signaled));
-        wait_for_fences(q->backend, fences, signaled, (uint32_t)tm_carray_size(fences), q->device_affinity_mask);
+// Returns the slot of a task id passed to the API, or NULL if the id can't belong to this queue.
+static inline task_slot_t *find_task_slot(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    const uint32_t slot_i = (uint32_t)task_id - 1;
+    if (slot_i >= TASK_SLOT_PAGE_SIZE * MAX_TASK_SLOT_PAGES)
+        return 0;
+    task_slot_t *page = (task_slot_t *)(uintptr_t)atomic_fetch_add_uint64_t(&q->slot_pages[slot_i / TASK_SLOT_PAGE_SIZE], 0);
+    return page ? page + slot_i % TASK_SLOT_PAGE_SIZE : 0;
+}
 
-        for (uint64_t i = 0; i < tm_carray_size(fences); ++i) {
-            if (signaled[i]) {
-                executing_task_t *task = wait_tasks + fence_indexes[i].task_i;
-                // Cannot swap-remove yet, as it will invalidate the indexes.
-                // Just mark the fence so that we can remove it later.
-                task->fences[fence_indexes[i].fence_i] = 0;
-            }
+// Returns the id of a new task in a free slot, or 0 if all the slots are taken.
+static uint64_t alloc_task_slot(mag_async_gpu_queue_o *q)
+{
+    uint64_t head = atomic_fetch_add_uint64_t(&q->free_slots, 0);
+    while ((uint32_t)head) {
+        task_slot_t *slot = task_slot(q, (uint32_t)head);
+        const uint32_t next = atomic_fetch_add_uint32_t(&slot->next_free, 0);
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_strong_uint64_t(&q->free_slots, &head, new_head)) {
+            const uint64_t generation = atomic_fetch_add_uint64_t(&slot->state, 0) >> 32;
+            return (generation << 32) | (uint32_t)head;
         }
+    }
 
-        uint64_t task_i = 0;
-        while (task_i < tm_carray_size(wait_tasks)) {
-            executing_task_t *task = wait_tasks + task_i;
-            uint64_t ri = 0;
-            while (ri < tm_carray_size(task->fences)) {
-                if (!task->fences[ri])
-                    task->fences[ri] = tm_carray_pop(task->fences);
-                else
-                    ++ri;
-            }
-            if (!ri) {
-                tm_carray_free(task->fences, &q->allocator);
-                tm_carray_push(completed_ids, task->task_id, a);
-                task->completion_callback(task->data);
-                wait_tasks[task_i] = tm_carray_pop(wait_tasks);
-            } else {
-                ++task_i;
-            }
-        }
+    const uint32_t slot_i = atomic_fetch_add_uint32_t(&q->num_slots, 1);
+    if (slot_i >= TASK_SLOT_PAGE_SIZE * MAX_TASK_SLOT_PAGES) {
+        atomic_fetch_sub_uint32_t(&q->num_slots, 1);
+        return 0;
+    }
+    atomic_uint_least64_t *page = q->slot_pages + slot_i / TASK_SLOT_PAGE_SIZE;
+    if (!atomic_fetch_add_uint64_t(page, 0)) {
+        task_slot_t *new_page = tm_alloc(&q->allocator, TASK_SLOT_PAGE_SIZE * sizeof(task_slot_t));
+        memset(new_page, 0, TASK_SLOT_PAGE_SIZE * sizeof(task_slot_t));
+        uint64_t expected = 0;
+        if (!atomic_compare_exchange_strong_uint64_t(page, &expected, (uint64_t)(uintptr_t)new_page))
+            tm_free(&q->allocator, new_page, TASK_SLOT_PAGE_SIZE * sizeof(task_slot_t));
     }
+    return slot_i + 1;
+}
 
-    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+// Pushes the slot of `task_id` to the free list. The caller must have set the state of the slot to
+// free, with the next generation.
+static void free_task_slot(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    task_slot_t *slot = task_slot(q, task_id);
+    uint64_t head = atomic_fetch_add_uint64_t(&q->free_slots, 0);
+    uint64_t new_head;
+    do {
+        atomic_exchange_uint32_t(&slot->next_free, (uint32_t)head);
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)task_id;
+    } while (!atomic_compare_exchange_strong_uint64_t(&q->free_slots, &head, new_head));
+}
+
+// Frees the slot of a task that the worker thread is done with.
+static void release_task_slot(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    atomic_exchange_uint64_t(&task_slot(q, task_id)->state, task_state_word(task_id + (1ULL << 32), TASK_STATE_FREE));
+    free_task_slot(q, task_id);
+}
+
+static inline dependency_t *dependency(mag_async_gpu_queue_o *q, uint32_t dependency_i)
+{
+    const uint32_t i = dependency_i - 1;
+    dependency_t *page = (dependency_t *)(uintptr_t)atomic_fetch_add_uint64_t(&q->dependency_pages[i / DEPENDENCY_PAGE_SIZE], 0);
+    return page + i % DEPENDENCY_PAGE_SIZE;
+}
+
+// Returns the index plus one of a new dependency, or 0 if all the dependencies are taken.
+static uint32_t alloc_dependency(mag_async_gpu_queue_o *q)
+{
+    uint64_t head = atomic_fetch_add_uint64_t(&q->free_dependencies, 0);
+    while ((uint32_t)head) {
+        const uint32_t next = atomic_fetch_add_uint32_t(&dependency(q, (uint32_t)head)->next, 0);
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_strong_uint64_t(&q->free_dependencies, &head, new_head))
+            return (uint32_t)head;
+    }
 
-    return completed_ids;
+    const uint32_t i = atomic_fetch_add_uint32_t(&q->num_dependencies, 1);
+    if (i >= DEPENDENCY_PAGE_SIZE * MAX_DEPENDENCY_PAGES) {
+        atomic_fetch_sub_uint32_t(&q->num_dependencies, 1);
+        return 0;
+    }
+    atomic_uint_least64_t *page = q->dependency_pages + i / DEPENDENCY_PAGE_SIZE;
+    if (!atomic_fetch_add_uint64_t(page, 0)) {
+        dependency_t *new_page = tm_alloc(&q->allocator, DEPENDENCY_PAGE_SIZE * sizeof(dependency_t));
+        memset(new_page, 0, DEPENDENCY_PAGE_SIZE * sizeof(dependency_t));
+        uint64_t expected = 0;
+        if (!atomic_compare_exchange_strong_uint64_t(page, &expected, (uint64_t)(uintptr_t)new_page))
+            tm_free(&q->allocator, new_page, DEPENDENCY_PAGE_SIZE * sizeof(dependency_t));
+    }
+    return i + 1;
+}
+
+static void free_dependency(mag_async_gpu_queue_o *q, uint32_t dependency_i)
+{
+    dependency_t *d = dependency(q, dependency_i);
+    uint64_t head = atomic_fetch_add_uint64_t(&q->free_dependencies, 0);
+    uint64_t new_head;
+    do {
+        atomic_exchange_uint32_t(&d->next, (uint32_t)head);
+        new_head = (((head >> 32) + 1) << 32) | dependency_i;
+    } while (!atomic_compare_exchange_strong_uint64_t(&q->free_dependencies, &head, new_head));
+}
+
+// Tries to move the task from state `from` to `to`. Fails if the task is in another state or the id
+// is stale.
+static bool transition_task(mag_async_gpu_queue_o *q, uint64_t task_id, enum task_state from, enum task_state to)
+{
+    uint64_t expected = task_state_word(task_id, from);
+    return atomic_compare_exchange_strong_uint64_t(&task_slot(q, task_id)->state, &expected, task_state_word(task_id, to));
+}
+
+// Starts recording the task for write_trace(), or returns NULL if tracing is off or the trace
+// buffer is full. Reads the slot, so it must be called before the slot can be freed. The event is
+// published by end_trace_event().
+static trace_event_t *begin_trace_event(mag_async_gpu_queue_o *q, uint64_t task_id, tm_clock_o launch_time, tm_clock_o end_time)
+{
+    if (atomic_fetch_add_uint32_t(&q->num_trace_events, 0) >= q->max_trace_events)
+        return 0;
+    const uint32_t i = atomic_fetch_add_uint32_t(&q->num_trace_events, 1);
+    if (i >= q->max_trace_events)
+        return 0;
+
+    const task_slot_t *slot = task_slot(q, task_id);
+    trace_event_t *e = q->trace_events + i;
+    e->lane = slot->lane;
+    e->task_id = task_id;
+    e->num_dispatches = slot->num_dispatches;
+    e->submit_time = slot->submit_time;
+    e->launch_time = launch_time;
+    e->end_time = end_time;
+    return e;
+}
+
+static void end_trace_event(trace_event_t *e, bool canceled)
+{
+    e->canceled = canceled;
+    atomic_exchange_uint32_t(&e->written, 1);
+}
+
+// Frees the slot of a task that was canceled while queued.
+static void release_canceled_task(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    trace_event_t *trace_event = begin_trace_event(q, task_id, (tm_clock_o) { 0 }, tm_os_api->time->now());
+    if (trace_event)
+        end_trace_event(trace_event, true);
+    release_task_slot(q, task_id);
+}
+
+static void inbox_push(lane_t *lane, inbox_item_t *item)
+{
+    uint64_t head = atomic_fetch_add_uint64_t(&lane->inbox, 0);
+    do {
+        item->next = (inbox_item_t *)(uintptr_t)head;
+    } while (!atomic_compare_exchange_strong_uint64_t(&lane->inbox, &head, (uint64_t)(uintptr_t)item));
+}
+
+static inline uint64_t inbox_item_size(uint32_t num_requests)
+{
+    return sizeof(inbox_item_t) + num_requests * sizeof(inbox_request_t);
 }
 
-static void process_one_task(mag_async_gpu_queue_o *q)
+// Allocates a batch of `num_requests` requests. It is filled in by the caller and passed to
+// inbox_push().
+static inbox_item_t *alloc_requests(mag_async_gpu_queue_o *q, enum inbox_op op, uint32_t num_requests)
 {
-    task_t task = { 0 };
-    uint64_t task_id = 0;
-    {
-        TM_OS_ENTER_CRITICAL_SECTION(&q->tasks_cs);
-        if (tm_carray_size(q->task_ids)) {
-            task = heap__pop(q->task_heap, q->task_ids, &task_id);
+    inbox_item_t *item = tm_alloc(&q->allocator, inbox_item_size(num_requests));
+    *item = (inbox_item_t) { .op = op, .num_requests = num_requests };
+    return item;
+}
+
+static void push_request(mag_async_gpu_queue_o *q, lane_t *lane, enum inbox_op op, uint64_t task_id, uint64_t priority)
+{
+    inbox_item_t *item = alloc_requests(q, op, 1);
+    item->requests[0] = (inbox_request_t) { .task_id = task_id, .priority = priority };
+    inbox_push(lane, item);
+}
+
+static void set_generation_completed(task_slot_t *slot, uint64_t task_id, bool completed)
+{
+    const uint64_t bit = 1ULL << ((task_id >> 32) % 64);
+    const uint64_t generations = atomic_fetch_add_uint64_t(&slot->completed_generations, 0);
+    atomic_exchange_uint64_t(&slot->completed_generations, completed ? generations | bit : generations & ~bit);
+}
+
+// Closes the dependents list of the task with `marker` and returns its first dependency, or 0 if the
+// list is empty or was closed already. Only the thread that closes the list walks it, so each
+// dependency is handled once, either as completed or as canceled.
+static uint32_t take_dependents(task_slot_t *slot, uint64_t task_id, uint32_t marker)
+{
+    uint64_t word = atomic_fetch_add_uint64_t(&slot->dependents, 0);
+    while (task_state_matches(word, task_id) && (uint32_t)word < DEPENDENTS_CANCELED) {
+        if (atomic_compare_exchange_strong_uint64_t(&slot->dependents, &word, task_state_word(task_id, 0) | marker)) {
+            if (marker == DEPENDENTS_COMPLETED)
+                set_generation_completed(slot, task_id, true);
+            return (uint32_t)word;
         }
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->tasks_cs);
     }
+    return 0;
+}
 
-    if (!task_id)
+// Returns true if the task completed, for a task whose slot has been reused since. The bit of its
+// generation is cleared again when the generation 64 after it is submitted, which only happens once
+// the state of the slot has reached that generation, so the bits are read before the state. Tasks
+// older than that count as canceled.
+static bool completed_before_reuse(task_slot_t *slot, uint64_t task_id)
+{
+    const uint64_t completed = atomic_fetch_add_uint64_t(&slot->completed_generations, 0);
+    const uint32_t generation = (uint32_t)(task_id >> 32);
+    const uint32_t age = (uint32_t)(atomic_fetch_add_uint64_t(&slot->state, 0) >> 32) - generation;
+    return age < 64 && (completed >> (generation % 64) & 1);
+}
+
+// Adds `task_id` to the dependents of `prerequisite_id`. Returns false if the prerequisite is done
+// already, in which case `canceled` tells whether it was canceled. Prerequisites that the queue
+// doesn't know, such as the 0 of a failed submit, count as canceled.
+static bool add_dependent(mag_async_gpu_queue_o *q, uint64_t prerequisite_id, uint64_t task_id, bool *canceled)
+{
+    *canceled = true;
+    task_slot_t *slot = find_task_slot(q, prerequisite_id);
+    if (!slot)
+        return false;
+
+    // A task that can't wait for its prerequisite is canceled.
+    const uint32_t dependency_i = alloc_dependency(q);
+    if (!TM_ASSERT(dependency_i, "Too many task dependencies in the async GPU queue"))
+        return false;
+    dependency_t *d = dependency(q, dependency_i);
+    d->task_id = task_id;
+    uint64_t word = atomic_fetch_add_uint64_t(&slot->dependents, 0);
+    while (task_state_matches(word, prerequisite_id) && (uint32_t)word < DEPENDENTS_CANCELED) {
+        atomic_exchange_uint32_t(&d->next, (uint32_t)word);
+        if (atomic_compare_exchange_strong_uint64_t(&slot->dependents, &word, task_state_word(prerequisite_id, 0) | dependency_i))
+            return true;
+    }
+
+    free_dependency(q, dependency_i);
+    if (task_state_matches(word, prerequisite_id))
+        *canceled = (uint32_t)word == DEPENDENTS_CANCELED;
+    else
+        *canceled = !completed_before_reuse(slot, prerequisite_id);
+    return false;
+}
+
+// Counts down the prerequisites that the task waits for. The last one queues the task, or frees it
+// if it was canceled while waiting.
+static void finish_prerequisite(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    task_slot_t *slot = task_slot(q, task_id);
+    if (atomic_fetch_sub_uint32_t(&slot->num_waiting_prerequisites, 1) != 1)
         return;
 
-    mag_async_gpu_queue_task_args_t args = {
-        .data = task.data,
-        .fences_allocator = &q->allocator,
-        .task_id = task_id,
-    };
-    task.f(&args);
-    executing_task_t active_task = { .task_id = task_id, .fences = args.out_fences, .completion_callback = task.completion_callback, .data = task.data };
+    // The queue latency of the task counts from here.
+    slot->submit_time = tm_os_api->time->now();
+    if (!transition_task(q, task_id, TASK_STATE_WAITING, TASK_STATE_QUEUED)) {
+        release_canceled_task(q, task_id);
+        return;
+    }
 
-    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
+    // The slot isn't freed before the lane has seen the request.
+    lane_t *lane = q->lanes + slot->lane;
+    push_request(q, lane, INBOX_OP_SUBMIT, task_id, 0);
+    tm_os_api->thread->semaphore_add(lane->worker->sem, 1);
+}
 
-    executing_task_t *wait_tasks = NULL;
-    {
-        TM_OS_ENTER_CRITICAL_SECTION(&q->executing_tasks_cs);
-        tm_carray_push(q->executing_tasks, active_task, &q->allocator);
-        if (tm_carray_size(q->executing_tasks) >= q->max_simultaneous_tasks) {
-            wait_tasks = tm_carray_from(q->executing_tasks, tm_carray_size(q->executing_tasks), a);
-            tm_carray_shrink(q->executing_tasks, 0);
-        }
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->executing_tasks_cs);
-    }
-
-    if (wait_tasks) {
-        // Reached simultaneous task limit. Time to block until something completes.
-        uint64_t *completed_ids = wait_for_task(q, wait_tasks, a);
-
-        {
-            TM_OS_ENTER_CRITICAL_SECTION(&q->completed_tasks_cs);
-            for (uint64_t ir = 0; ir < tm_carray_size(completed_ids); ++ir) {
-                uint64_t completed_id = completed_ids[ir];
-                bool is_canceled = false;
-                for (uint64_t ic = 0; ic < tm_carray_size(q->canceled_tasks); ++ic) {
-                    if (q->canceled_tasks[ic] == completed_id) {
-                        is_canceled = true;
-                        q->canceled_tasks[ic] = tm_carray_pop(q->canceled_tasks);
-                        break;
+// Frees the dependents list that starts at `dependency_i`, queueing the dependents that wait for
+// nothing else.
+static void release_dependents(mag_async_gpu_queue_o *q, uint32_t dependency_i)
+{
+    while (dependency_i) {
+        dependency_t *d = dependency(q, dependency_i);
+        const uint64_t task_id = d->task_id;
+        const uint32_t next = atomic_fetch_add_uint32_t(&d->next, 0);
+        free_dependency(q, dependency_i);
+        finish_prerequisite(q, task_id);
+        dependency_i = next;
+    }
+}
+
+// Returns the heap index of the task, or `NOT_IN_HEAP`.
+static uint32_t find_queued_task(const lane_t *lane, uint64_t task_id)
+{
+    const uint32_t slot_i = (uint32_t)task_id - 1;
+    if (slot_i >= tm_carray_size(lane->heap_positions))
+        return NOT_IN_HEAP;
+    const uint32_t i = lane->heap_positions[slot_i];
+    return i != NOT_IN_HEAP && lane->task_heap[i].task_id == task_id ? i : NOT_IN_HEAP;
+}
+
+// Applies the requests in the inbox of the lane to its heap, in the order they were pushed.
+static void drain_inbox(mag_async_gpu_queue_o *q, lane_t *lane)
+{
+    inbox_item_t *reversed = (inbox_item_t *)(uintptr_t)atomic_exchange_uint64_t(&lane->inbox, 0);
+    if (!reversed)
+        return;
+
+    const uint64_t profiler_scope = tm_profiler_api->begin(__func__, "mag_async_gpu_queue", lane->name);
+    inbox_item_t *items = 0;
+    while (reversed) {
+        inbox_item_t *next = reversed->next;
+        reversed->next = items;
+        items = reversed;
+        reversed = next;
+    }
+
+    while (items) {
+        inbox_item_t *item = items;
+        items = item->next;
+
+        // Large batches are applied without maintaining the heap invariant and the heap is rebuilt
+        // once at the end.
+        const uint32_t heap_size = (uint32_t)tm_carray_size(lane->task_heap);
+        const bool rebuild = item->op != INBOX_OP_CANCEL && item->num_requests > heap_size / 2 && item->num_requests > 1;
+
+        for (const inbox_request_t *r = item->requests; r != item->requests + item->num_requests; ++r) {
+            switch (item->op) {
+            case INBOX_OP_SUBMIT:
+                // The task may have been canceled before it got here.
+                if (task_state_of(atomic_fetch_add_uint64_t(&task_slot(q, r->task_id)->state, 0)) == TASK_STATE_CANCELED) {
+                    release_canceled_task(q, r->task_id);
+                } else {
+                    heap__append(lane, r->task_id, task_slot(q, r->task_id)->priority, &q->allocator);
+                    if (!rebuild)
+                        heap__update(lane, (uint32_t)tm_carray_size(lane->task_heap) - 1);
+                }
+                break;
+            case INBOX_OP_UPDATE_PRIORITY: {
+                const uint32_t i = find_queued_task(lane, r->task_id);
+                if (i != NOT_IN_HEAP) {
+                    if (lane->task_heap[i].priority != r->priority) {
+                        lane->task_heap[i].priority = r->priority;
+                        if (!rebuild)
+                            heap__update(lane, i);
                     }
+                } else {
+                    // A queued task that isn't in the heap yet has a submit request behind this one,
+                    // as it became queued before its submit was pushed. The slot can't be reused
+                    // before the submit is applied, so it's safe to write.
+                    task_slot_t *slot = task_slot(q, r->task_id);
+                    const uint64_t state = atomic_fetch_add_uint64_t(&slot->state, 0);
+                    if (task_state_matches(state, r->task_id) && task_state_of(state) == TASK_STATE_QUEUED)
+                        slot->priority = r->priority;
+                }
+            } break;
+            case INBOX_OP_CANCEL: {
+                const uint32_t i = find_queued_task(lane, r->task_id);
+                if (i != NOT_IN_HEAP) {
+                    heap__remove(lane, i);
+                    release_canceled_task(q, r->task_id);
                 }
+            } break;
+            }
+        }
+
+        if (rebuild)
+            heap__rebuild(lane);
+
+        tm_free(&q->allocator, item, inbox_item_size(item->num_requests));
+    }
 
-                if (!is_canceled)
-                    tm_carray_push(q->completed_tasks, completed_id, &q->allocator);
+    atomic_exchange_uint32_t(&lane->num_queued, (uint32_t)tm_carray_size(lane->task_heap));
+    tm_profiler_api->end(profiler_scope);
+}
+
+// Pushes the task id to the completion ring. Returns false if the ring is full. Safe to call from
+// several threads at once.
+static bool push_completion(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    uint64_t pos = atomic_fetch_add_uint64_t(&q->completions_write_pos, 0);
+    while (true) {
+        completion_cell_t *cell = q->completions + (pos & (COMPLETION_RING_SIZE - 1));
+        const uint64_t sequence = atomic_fetch_add_uint64_t(&cell->sequence, 0);
+        if (sequence == pos) {
+            if (atomic_compare_exchange_strong_uint64_t(&q->completions_write_pos, &pos, pos + 1)) {
+                cell->task_id = task_id;
+                atomic_exchange_uint64_t(&cell->sequence, pos + 1);
+                return true;
+            }
+        } else if (sequence < pos) {
+            // The reader hasn't consumed this cell yet.
+            return false;
+        } else {
+            pos = atomic_fetch_add_uint64_t(&q->completions_write_pos, 0);
+        }
+    }
+}
+
+// Pops the oldest task id from the completion ring. Returns false if the ring is empty.
+static bool pop_completion(mag_async_gpu_queue_o *q, uint64_t *task_id)
+{
+    const uint64_t pos = q->completions_read_pos;
+    completion_cell_t *cell = q->completions + (pos & (COMPLETION_RING_SIZE - 1));
+    if (atomic_fetch_add_uint64_t(&cell->sequence, 0) != pos + 1)
+        return false;
+
+    *task_id = cell->task_id;
+    atomic_exchange_uint64_t(&cell->sequence, pos + COMPLETION_RING_SIZE);
+    q->completions_read_pos = pos + 1;
+    return true;
+}
+
+// Moves the completions that didn't fit in the ring earlier to the ring.
+static void flush_unreported_completions(mag_async_gpu_queue_o *q, worker_t *w)
+{
+    const uint64_t n = tm_carray_size(w->unreported_completions);
+    uint64_t i = 0;
+    while (i < n && push_completion(q, w->unreported_completions[i]))
+        ++i;
+    if (i) {
+        memmove(w->unreported_completions, w->unreported_completions + i, (n - i) * sizeof(uint64_t));
+        tm_carray_shrink(w->unreported_completions, n - i);
+    }
+    if (i < n)
+        atomic_exchange_uint32_t(&q->completions_overflowed, 1);
+}
+
+// Wakes up the workers other than `w` that have queued tasks, which may have been waiting for
+// capacity or budget.
+static void wake_waiting_workers(mag_async_gpu_queue_o *q, const worker_t *w)
+{
+    for (uint32_t i = 0; i < q->num_workers; ++i) {
+        if (q->workers + i == w)
+            continue;
+        for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+            if (lane->worker == q->workers + i && atomic_fetch_add_uint32_t(&lane->num_queued, 0)) {
+                tm_os_api->thread->semaphore_add(q->workers[i].sem, 1);
+                break;
             }
-            TM_OS_LEAVE_CRITICAL_SECTION(&q->completed_tasks_cs);
         }
+    }
+}
 
-        if (tm_carray_size(wait_tasks)) {
-            TM_OS_ENTER_CRITICAL_SECTION(&q->executing_tasks_cs);
-            tm_carray_push_array(q->executing_tasks, wait_tasks, tm_carray_size(wait_tasks), &q->allocator);
-            TM_OS_LEAVE_CRITICAL_SECTION(&q->executing_tasks_cs);
+// Reserves capacity for one more executing task in the lane. Within its own limit a lane only
+// needs the total to be below the sum of the limits. Past it, the lane can borrow the capacity of
+// lanes that have nothing queued, but never the capacity that a lane with queued tasks is waiting
+// for, so borrowed capacity goes back to its lane as soon as the borrowing tasks complete.
+static bool acquire_capacity(mag_async_gpu_queue_o *q, lane_t *lane, bool borrow)
+{
+    uint32_t reserved = 0;
+    if (borrow) {
+        for (lane_t *other = q->lanes; other != q->lanes + q->num_lanes; ++other) {
+            if (other == lane || !atomic_fetch_add_uint32_t(&other->num_queued, 0))
+                continue;
+            const uint32_t num_executing = atomic_fetch_add_uint32_t(&other->num_executing, 0);
+            if (num_executing < other->max_simultaneous_tasks)
+                reserved += other->max_simultaneous_tasks - num_executing;
         }
+    } else if (atomic_fetch_add_uint32_t(&lane->num_executing, 0) >= lane->max_simultaneous_tasks) {
+        return false;
     }
 
-    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    uint32_t total = atomic_fetch_add_uint32_t(&q->num_executing, 0);
+    do {
+        if (total + reserved >= q->max_simultaneous_tasks)
+            return false;
+    } while (!atomic_compare_exchange_strong_uint32_t(&q->num_executing, &total, total + 1));
+
+    atomic_fetch_add_uint32_t(&lane->num_executing, 1);
+    return true;
 }
 
-static void wait_for_all_executing_tasks(mag_async_gpu_queue_o *q)
+// Returns true if a task with the given costs fits in what is left of the per-frame budgets.
+static bool fits_frame_budget(mag_async_gpu_queue_o *q, uint64_t gpu_time_ns, uint64_t readback_bytes)
 {
-    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
-    executing_task_t *wait_tasks = NULL;
+    const uint64_t frame_gpu_time_ns = atomic_fetch_add_uint64_t(&q->frame_gpu_time_ns, 0);
+    const uint64_t frame_readback_bytes = atomic_fetch_add_uint64_t(&q->frame_readback_bytes, 0);
+    // The first task of a frame always fits, however expensive.
+    if (!frame_gpu_time_ns && !frame_readback_bytes)
+        return true;
+    if (q->gpu_time_budget_per_frame_ns && frame_gpu_time_ns + gpu_time_ns > q->gpu_time_budget_per_frame_ns)
+        return false;
+    if (q->readback_bytes_budget_per_frame && frame_readback_bytes + readback_bytes > q->readback_bytes_budget_per_frame)
+        return false;
+    return true;
+}
+
+// Charges a launched task to the per-frame budgets. Workers that check the budget at the same time
+// may both launch a task, so a frame can exceed its budget by a task per worker.
+static void charge_frame_budget(mag_async_gpu_queue_o *q, uint64_t gpu_time_ns, uint64_t readback_bytes)
+{
+    atomic_fetch_add_uint64_t(&q->frame_gpu_time_ns, gpu_time_ns);
+    atomic_fetch_add_uint64_t(&q->frame_readback_bytes, readback_bytes);
+}
 
-    TM_OS_ENTER_CRITICAL_SECTION(&q->executing_tasks_cs);
-    if (tm_carray_size(q->executing_tasks)) {
-        wait_tasks = tm_carray_from(q->executing_tasks, tm_carray_size(q->executing_tasks), a);
-        tm_carray_shrink(q->executing_tasks, 0);
+// Updates the GPU time per dispatch of the lane with the time the task took. Tasks overlap on the
+// GPU, so a task is only measured from when the previous task of the lane completed, if that is
+// later than its launch.
+static void measure_task(lane_t *lane, const task_slot_t *slot, tm_clock_o now)
+{
+    if (!slot->num_dispatches)
+        return;
+    const double since_launch = tm_os_api->time->delta(now, slot->launch_time);
+    const double since_last_completion = tm_os_api->time->delta(now, lane->last_completion);
+    const double ns = tm_min(since_launch, since_last_completion) * 1e9;
+    lane->ns_per_dispatch += (ns / slot->num_dispatches - lane->ns_per_dispatch) * DISPATCH_TIME_SMOOTHING;
+}
+
+static inline uint32_t latency_bucket(double seconds)
+{
+    const double us = seconds * 1e6;
+    return us > 1.0 ? tm_min((uint32_t)(log2(us) * 4.0), LATENCY_HISTOGRAM_SIZE - 1) : 0;
+}
+
+// Returns the upper bound of the latency bucket in milliseconds.
+static inline double latency_bucket_ms(uint32_t i)
+{
+    return pow(2.0, (i + 1) / 4.0) / 1000.0;
+}
+
+static double latency_percentile(const double *histogram, double p)
+{
+    double total = 0;
+    for (uint32_t i = 0; i < LATENCY_HISTOGRAM_SIZE; ++i)
+        total += histogram[i];
+    if (!total)
+        return 0;
+
+    double count = 0;
+    for (uint32_t i = 0; i < LATENCY_HISTOGRAM_SIZE; ++i) {
+        count += histogram[i];
+        if (count >= p * total)
+            return latency_bucket_ms(i);
     }
-    TM_OS_LEAVE_CRITICAL_SECTION(&q->executing_tasks_cs);
+    return latency_bucket_ms(LATENCY_HISTOGRAM_SIZE - 1);
+}
 
-    while (tm_carray_size(wait_tasks)) {
-        wait_for_task(q, wait_tasks, a);
+static void complete_task(mag_async_gpu_queue_o *q, lane_t *lane, uint64_t task_id, tm_clock_o now)
+{
+    task_slot_t *slot = task_slot(q, task_id);
+    slot->completion_callback(slot->data);
+    atomic_fetch_sub_uint32_t(&lane->num_executing, 1);
+    atomic_fetch_sub_uint32_t(&q->num_executing, 1);
+    atomic_fetch_add_uint32_t(&lane->execution_latency_counts[latency_bucket(tm_os_api->time->delta(now, slot->launch_time))], 1);
+
+    // The dependents and the trace event are taken before the task can be confirmed, which frees
+    // its slot. If the task was canceled, cancel_task() has taken the dependents already.
+    release_dependents(q, take_dependents(slot, task_id, DEPENDENTS_COMPLETED));
+    trace_event_t *trace_event = begin_trace_event(q, task_id, slot->launch_time, now);
+
+    const bool canceled = !transition_task(q, task_id, TASK_STATE_EXECUTING, TASK_STATE_COMPLETED);
+    if (trace_event)
+        end_trace_event(trace_event, canceled);
+
+    worker_t *w = lane->worker;
+    if (canceled) {
+        // canceled while executing
+        release_task_slot(q, task_id);
+        return;
     }
 
-    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    atomic_fetch_add_uint32_t(&lane->num_completed, 1);
+    if (tm_carray_size(w->unreported_completions) || !push_completion(q, task_id)) {
+        tm_carray_push(w->unreported_completions, task_id, &q->allocator);
+        atomic_exchange_uint32_t(&q->completions_overflowed, 1);
+    }
+}
+
+// Starts queued tasks of the lane until it runs out of capacity or the frame runs out of budget.
+static void launch_tasks(mag_async_gpu_queue_o *q, lane_t *lane, bool borrow)
+{
+    const uint64_t profiler_scope = tm_profiler_api->begin(__func__, "mag_async_gpu_queue", lane->name);
+
+    while (tm_carray_size(lane->task_heap)) {
+        const uint64_t task_id = lane->task_heap[0].task_id;
+        task_slot_t *slot = task_slot(q, task_id);
+        const uint64_t gpu_time_ns = (uint64_t)(slot->num_dispatches * lane->ns_per_dispatch);
+        if (!fits_frame_budget(q, gpu_time_ns, slot->readback_bytes) || !acquire_capacity(q, lane, borrow))
+            break;
+
+        heap__pop(lane);
+        if (!transition_task(q, task_id, TASK_STATE_QUEUED, TASK_STATE_EXECUTING)) {
+            // canceled
+            atomic_fetch_sub_uint32_t(&lane->num_executing, 1);
+            atomic_fetch_sub_uint32_t(&q->num_executing, 1);
+            release_canceled_task(q, task_id);
+            continue;
+        }
+
+        charge_frame_budget(q, gpu_time_ns, slot->readback_bytes);
+        slot->launch_time = tm_os_api->time->now();
+        atomic_fetch_add_uint32_t(&lane->queue_latency_counts[latency_bucket(tm_os_api->time->delta(slot->launch_time, slot->submit_time))], 1);
+        mag_async_gpu_queue_task_args_t args = {
+            .data = slot->data,
+            .fences_allocator = &q->allocator,
+            .task_id = task_id,
+        };
+        slot->f(&args);
+
+        const uint32_t num_fences = (uint32_t)tm_carray_size(args.out_fences);
+        slot->num_pending_fences = num_fences;
+        tm_carray_push_array(lane->pending_fences, args.out_fences, num_fences, &q->allocator);
+        for (uint32_t i = 0; i < num_fences; ++i)
+            tm_carray_push(lane->pending_fence_tasks, task_id, &q->allocator);
+        tm_carray_free(args.out_fences, &q->allocator);
+
+        if (!num_fences)
+            complete_task(q, lane, task_id, slot->launch_time);
+    }
+
+    atomic_exchange_uint32_t(&lane->num_queued, (uint32_t)tm_carray_size(lane->task_heap));
+    tm_profiler_api->end(profiler_scope);
 }
 
-static void thread_entry(void *user_data)
+// Waits up to `timeout` nanoseconds for any of the pending fences of the lane to signal and
+// completes the tasks whose fences have all signaled. Returns the number of completed tasks.
+static uint32_t wait_for_fences(mag_async_gpu_queue_o *q, lane_t *lane, uint64_t timeout)
 {
-    mag_async_gpu_queue_o *q = (mag_async_gpu_queue_o *)user_data;
+    const uint32_t n = (uint32_t)tm_carray_size(lane->pending_fences);
+    if (!n)
+        return 0;
+
+    const uint64_t profiler_scope = tm_profiler_api->begin(__func__, "mag_async_gpu_queue", lane->name);
+
+    tm_carray_resize(lane->pending_fences_signaled, n, &q->allocator);
+    memset(lane->pending_fences_signaled, 0, n * sizeof(bool));
+    const tm_clock_o wait_start = tm_os_api->time->now();
+    const bool signaled = q->backend->wait_for_reads(q->backend->inst, lane->pending_fences, lane->pending_fences_signaled, n, timeout, lane->device_affinity_mask);
+    const tm_clock_o now = tm_os_api->time->now();
+    atomic_fetch_add_uint64_t(&lane->fence_wait_ns, (uint64_t)(tm_os_api->time->delta(now, wait_start) * 1e9));
+
+    // Iterates backwards, so that the swap-removed fences have already been checked.
+    uint32_t num_completed = 0;
+    for (uint32_t i = signaled ? n : 0; i-- > 0;) {
+        if (!lane->pending_fences_signaled[i])
+            continue;
+
+        const uint64_t task_id = lane->pending_fence_tasks[i];
+        lane->pending_fences[i] = tm_carray_pop(lane->pending_fences);
+        lane->pending_fence_tasks[i] = tm_carray_pop(lane->pending_fence_tasks);
+        task_slot_t *slot = task_slot(q, task_id);
+        if (!--slot->num_pending_fences) {
+            measure_task(lane, slot, now);
+            complete_task(q, lane, task_id, now);
+            ++num_completed;
+        }
+    }
+    if (num_completed)
+        lane->last_completion = now;
+
+    tm_profiler_api->end(profiler_scope);
+    return num_completed;
+}
+
+// Waits for the fences of all the lanes of the worker that have executing tasks, splitting
+// `FENCE_WAIT_TIMEOUT` between them. Returns false if none of the lanes has executing tasks.
+static bool wait_for_worker_fences(mag_async_gpu_queue_o *q, worker_t *w)
+{
+    uint32_t num_waiting_lanes = 0;
+    for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+        if (lane->worker == w && tm_carray_size(lane->pending_fences))
+            ++num_waiting_lanes;
+    }
+    if (!num_waiting_lanes)
+        return false;
+
+    uint32_t num_completed = 0;
+    for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+        if (lane->worker == w)
+            num_completed += wait_for_fences(q, lane, FENCE_WAIT_TIMEOUT / num_waiting_lanes);
+    }
+    if (num_completed && q->num_workers > 1)
+        wake_waiting_workers(q, w);
+    return true;
+}
+
+static void worker_thread_entry(void *user_data)
+{
+    worker_t *w = (worker_t *)user_data;
+    mag_async_gpu_queue_o *q = w->q;
     while (true) {
-        tm_os_api->thread->semaphore_wait(q->sem);
-        if (q->shutdown) {
+        // Don't block on the semaphore while tasks are executing, so that completed tasks are
+        // replaced by queued ones right away. New requests are picked up once the wait times out.
+        if (wait_for_worker_fences(q, w)) {
+            while (tm_os_api->thread->semaphore_poll(w->sem))
+                ;
+        } else {
+            tm_os_api->thread->semaphore_wait(w->sem);
+        }
+
+        flush_unreported_completions(q, w);
+        for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+            if (lane->worker == w)
+                drain_inbox(q, lane);
+        }
+
+        if (atomic_fetch_add_uint32_t(&q->shutdown, 0)) {
             // need to wait for in-flight tasks so that the fences are not leaked
-            wait_for_all_executing_tasks(q);
+            while (wait_for_worker_fences(q, w))
+                ;
             break;
         }
-        process_one_task(q);
+
+        // Lanes use their own capacity first and only then borrow, so that a lane with a large
+        // backlog doesn't take the capacity of a lane that comes later in the same worker.
+        for (uint32_t borrow = 0; borrow < 2; ++borrow) {
+            for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+                if (lane->worker == w && (!borrow || lane->can_borrow))
+                    launch_tasks(q, lane, borrow);
+            }
+        }
     }
 }
 
@@ -316,21 +1171,77 @@ static mag_async_gpu_queue_o *create(tm_allocator_i *parent, tm_renderer_backend
 {
     tm_os_thread_api *thread_api = tm_os_api->thread;
 
+    // Without lanes, the queue has a single lane that is configured by the queue params.
+    const mag_async_gpu_queue_lane_params_t default_lane = {
+        .name = "default",
+        .max_simultaneous_tasks = params->max_simultaneous_tasks,
+        .device_affinity_mask = params->device_affinity_mask,
+    };
+    const uint32_t num_lanes = params->num_lanes ? params->num_lanes : 1;
+    const mag_async_gpu_queue_lane_params_t *lane_params = params->num_lanes ? params->lanes : &default_lane;
+
+    // The lanes without their own thread share the first worker.
+    uint32_t num_workers = 1;
+    for (uint32_t i = 0; i < num_lanes; ++i)
+        num_workers += lane_params[i].own_thread;
+
     tm_allocator_i a = tm_allocator_api->create_child(parent, "mag_async_gpu_queue");
     mag_async_gpu_queue_o *q;
     q = tm_alloc(&a, sizeof(*q));
     *q = (mag_async_gpu_queue_o) {
         .allocator = a,
         .backend = backend,
-        .next_id = 1,
-        .sem = thread_api->create_semaphore(0),
-        .max_simultaneous_tasks = params->max_simultaneous_tasks,
-        .device_affinity_mask = params->device_affinity_mask,
+        .num_lanes = num_lanes,
+        .lanes = tm_alloc(&a, num_lanes * sizeof(lane_t)),
+        .num_workers = num_workers,
+        .workers = tm_alloc(&a, num_workers * sizeof(worker_t)),
+        .gpu_time_budget_per_frame_ns = params->gpu_time_budget_per_frame_ns,
+        .readback_bytes_budget_per_frame = params->readback_bytes_budget_per_frame,
+        .create_time = tm_os_api->time->now(),
+        .max_trace_events = params->max_trace_tasks,
     };
-    thread_api->create_critical_section(&q->tasks_cs);
-    thread_api->create_critical_section(&q->completed_tasks_cs);
-    thread_api->create_critical_section(&q->executing_tasks_cs);
-    q->thread = thread_api->create_thread(thread_entry, q, THREAD_STACK_SIZE, "mag_async_gpu_queue");
+    for (uint64_t i = 0; i < COMPLETION_RING_SIZE; ++i)
+        atomic_exchange_uint64_t(&q->completions[i].sequence, i);
+    if (q->max_trace_events) {
+        q->trace_events = tm_alloc(&a, q->max_trace_events * sizeof(trace_event_t));
+        memset(q->trace_events, 0, q->max_trace_events * sizeof(trace_event_t));
+    }
+
+    for (uint32_t i = 0; i < num_workers; ++i)
+        q->workers[i] = (worker_t) { .q = q, .sem = thread_api->create_semaphore(0) };
+
+    uint32_t next_worker = 1;
+    for (uint32_t i = 0; i < num_lanes; ++i) {
+        const mag_async_gpu_queue_lane_params_t *lp = lane_params + i;
+        lane_t *lane = q->lanes + i;
+        *lane = (lane_t) {
+            .max_simultaneous_tasks = lp->max_simultaneous_tasks,
+            .device_affinity_mask = lp->device_affinity_mask,
+            .can_borrow = lp->can_borrow,
+            .worker = q->workers + (lp->own_thread ? next_worker++ : 0),
+            .ns_per_dispatch = DEFAULT_NS_PER_DISPATCH,
+        };
+        strncpy(lane->name, lp->name ? lp->name : "", MAX_LANE_NAME_LENGTH - 1);
+        q->max_simultaneous_tasks += lp->max_simultaneous_tasks;
+
+        if (params->name) {
+            for (uint32_t stat = 0; stat < NUM_LANE_STATS; ++stat) {
+                char path[256];
+                char display_name[256];
+                snprintf(path, sizeof(path), "%s/%s/%s", params->name, lane->name, LANE_STATS[stat].path);
+                snprintf(display_name, sizeof(display_name), "%s %s", lane->name, LANE_STATS[stat].display_name);
+                lane->stats[stat] = tm_statistics_source_api->source(path, display_name);
+            }
+        }
+    }
+
+    // Threads are started last, as the workers look at all the lanes.
+    q->workers[0].thread = thread_api->create_thread(worker_thread_entry, q->workers, THREAD_STACK_SIZE, "mag_async_gpu_queue");
+    for (uint32_t i = 0; i < num_lanes; ++i) {
+        worker_t *w = q->lanes[i].worker;
+        if (w != q->workers)
+            w->thread = thread_api->create_thread(worker_thread_entry, w, THREAD_STACK_SIZE, q->lanes[i].name);
+    }
     return q;
 }
 
@@ -339,158 +1250,456 @@ static void destroy(mag_async_gpu_queue_o *q)
     tm_os_thread_api *thread_api = tm_os_api->thread;
 
     atomic_fetch_add_uint32_t(&q->shutdown, 1);
-    thread_api->semaphore_add(q->sem, 1);
+    for (uint32_t i = 0; i < q->num_workers; ++i)
+        thread_api->semaphore_add(q->workers[i].sem, 1);
+
+    for (uint32_t i = 0; i < q->num_workers; ++i) {
+        worker_t *w = q->workers + i;
+        thread_api->wait_for_thread(w->thread);
+        thread_api->destroy_semaphore(w->sem);
+        tm_carray_free(w->unreported_completions, &q->allocator);
+    }
 
-    thread_api->wait_for_thread(q->thread);
+    // Cancels the tasks still in the queue, including the ones waiting for prerequisites, which
+    // aren't in any heap.
+    const uint32_t num_slots = atomic_fetch_add_uint32_t(&q->num_slots, 0);
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        task_slot_t *slot = task_slot(q, i + 1);
+        const uint64_t state = atomic_fetch_add_uint64_t(&slot->state, 0);
+        if (task_state_of(state) == TASK_STATE_QUEUED || task_state_of(state) == TASK_STATE_WAITING) {
+            atomic_exchange_uint64_t(&slot->state, task_state_word(state, TASK_STATE_CANCELED));
+            slot->cancel_callback(slot->data);
+        }
+    }
 
-    thread_api->destroy_semaphore(q->sem);
-    thread_api->destroy_critical_section(&q->tasks_cs);
-    thread_api->destroy_critical_section(&q->executing_tasks_cs);
-    thread_api->destroy_critical_section(&q->completed_tasks_cs);
+    for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+        // Requests that the lane didn't get to. The tasks they submit were canceled above.
+        inbox_item_t *item = (inbox_item_t *)(uintptr_t)atomic_exchange_uint64_t(&lane->inbox, 0);
+        while (item) {
+            inbox_item_t *next = item->next;
+            tm_free(&q->allocator, item, inbox_item_size(item->num_requests));
+            item = next;
+        }
 
-    for (uint64_t i = 0; i < tm_carray_size(q->task_heap); ++i) {
-        q->task_heap[i].cancel_callback(q->task_heap[i].data);
+        tm_carray_free(lane->task_heap, &q->allocator);
+        tm_carray_free(lane->heap_positions, &q->allocator);
+        tm_carray_free(lane->pending_fences, &q->allocator);
+        tm_carray_free(lane->pending_fence_tasks, &q->allocator);
+        tm_carray_free(lane->pending_fences_signaled, &q->allocator);
     }
 
-    tm_carray_free(q->task_heap, &q->allocator);
-    tm_carray_free(q->task_ids, &q->allocator);
-    tm_carray_free(q->executing_tasks, &q->allocator);
-    tm_carray_free(q->completed_tasks, &q->allocator);
-    tm_carray_free(q->canceled_tasks, &q->allocator);
+    if (q->trace_events)
+        tm_free(&q->allocator, q->trace_events, q->max_trace_events * sizeof(trace_event_t));
+
+    for (uint32_t i = 0; i < MAX_TASK_SLOT_PAGES && q->slot_pages[i]; ++i)
+        tm_free(&q->allocator, (void *)(uintptr_t)q->slot_pages[i], TASK_SLOT_PAGE_SIZE * sizeof(task_slot_t));
+    for (uint32_t i = 0; i < MAX_DEPENDENCY_PAGES && q->dependency_pages[i]; ++i)
+        tm_free(&q->allocator, (void *)(uintptr_t)q->dependency_pages[i], DEPENDENCY_PAGE_SIZE * sizeof(dependency_t));
+
+    tm_free(&q->allocator, q->lanes, q->num_lanes * sizeof(lane_t));
+    tm_free(&q->allocator, q->workers, q->num_workers * sizeof(worker_t));
 
     tm_allocator_i a = q->allocator;
     tm_free(&a, q, sizeof(*q));
     tm_allocator_api->destroy_child(&a);
 }
 
-static uint64_t submit_task(mag_async_gpu_queue_o *q, const mag_async_gpu_queue_task_params_t *params)
+// Publishes the statistics of the lane for the frame that ended and resets its counters.
+static void publish_lane_statistics(lane_t *lane)
 {
-    const uint64_t id = atomic_fetch_add_uint64_t(&q->next_id, 1);
+    for (uint32_t i = 0; i < LATENCY_HISTOGRAM_SIZE; ++i) {
+        lane->queue_latency_histogram[i] = lane->queue_latency_histogram[i] * LATENCY_HISTOGRAM_DECAY + atomic_exchange_uint32_t(&lane->queue_latency_counts[i], 0);
+        lane->execution_latency_histogram[i] = lane->execution_latency_histogram[i] * LATENCY_HISTOGRAM_DECAY + atomic_exchange_uint32_t(&lane->execution_latency_counts[i], 0);
+    }
 
-    TM_OS_ENTER_CRITICAL_SECTION(&q->tasks_cs);
-    heap__push(&q->task_heap, &q->task_ids, *params, id, &q->allocator);
-    TM_OS_LEAVE_CRITICAL_SECTION(&q->tasks_cs);
+    double **stats = lane->stats;
+    *stats[LANE_STAT_QUEUED] = atomic_fetch_add_uint32_t(&lane->num_queued, 0);
+    *stats[LANE_STAT_EXECUTING] = atomic_fetch_add_uint32_t(&lane->num_executing, 0);
+    *stats[LANE_STAT_COMPLETED] = atomic_exchange_uint32_t(&lane->num_completed, 0);
+    *stats[LANE_STAT_CANCELED] = atomic_exchange_uint32_t(&lane->num_canceled, 0);
+    *stats[LANE_STAT_QUEUE_LATENCY_P50] = latency_percentile(lane->queue_latency_histogram, 0.5);
+    *stats[LANE_STAT_QUEUE_LATENCY_P99] = latency_percentile(lane->queue_latency_histogram, 0.99);
+    *stats[LANE_STAT_EXECUTION_LATENCY_P50] = latency_percentile(lane->execution_latency_histogram, 0.5);
+    *stats[LANE_STAT_EXECUTION_LATENCY_P99] = latency_percentile(lane->execution_latency_histogram, 0.99);
+    *stats[LANE_STAT_FENCE_WAIT] = atomic_exchange_uint64_t(&lane->fence_wait_ns, 0) / 1e6;
+}
 
-    tm_os_api->thread->semaphore_add(q->sem, 1);
-    return id;
+static void begin_frame(mag_async_gpu_queue_o *q)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    for (lane_t *lane = q->lanes; lane != q->lanes + q->num_lanes; ++lane) {
+        if (lane->stats[0])
+            publish_lane_statistics(lane);
+    }
+
+    if (q->gpu_time_budget_per_frame_ns || q->readback_bytes_budget_per_frame) {
+        atomic_exchange_uint64_t(&q->frame_gpu_time_ns, 0);
+        atomic_exchange_uint64_t(&q->frame_readback_bytes, 0);
+        wake_waiting_workers(q, 0);
+    }
+
+    TM_PROFILER_END_FUNC_SCOPE();
 }
 
-static bool update_task_priority(mag_async_gpu_queue_o *q, uint64_t task_id, uint64_t new_priority)
+static uint32_t find_lane(mag_async_gpu_queue_o *q, const char *name)
+{
+    for (uint32_t i = 0; i < q->num_lanes; ++i) {
+        if (!strcmp(q->lanes[i].name, name))
+            return i;
+    }
+    return UINT32_MAX;
+}
+
+// Pushes the requests for the tasks in `task_ids` to the lanes in `task_lanes` as one batch per
+// lane. `priorities` may be NULL for requests that don't use them. Wakes up the workers of the
+// lanes if `wake` is set.
+static void push_requests_by_lane(mag_async_gpu_queue_o *q, enum inbox_op op, const uint64_t *task_ids, const uint32_t *task_lanes, const uint64_t *priorities, uint32_t n, bool wake)
 {
-    bool found = false;
-    TM_OS_ENTER_CRITICAL_SECTION(&q->tasks_cs);
-    for (uint32_t i = 0; i < tm_carray_size(q->task_ids); ++i) {
-        if (q->task_ids[i] == task_id) {
-            found = true;
-            if (new_priority != q->task_heap[i].priority) {
-                q->task_heap[i].priority = new_priority;
-                heap__update(q->task_heap, q->task_ids, i);
+    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
+
+    uint32_t *lane_counts = tm_alloc(a, q->num_lanes * sizeof(uint32_t));
+    memset(lane_counts, 0, q->num_lanes * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; ++i)
+        ++lane_counts[task_lanes[i]];
+
+    for (uint32_t lane_i = 0; lane_i < q->num_lanes; ++lane_i) {
+        if (!lane_counts[lane_i])
+            continue;
+
+        inbox_item_t *item = alloc_requests(q, op, lane_counts[lane_i]);
+        uint32_t num_requests = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            if (task_lanes[i] == lane_i)
+                item->requests[num_requests++] = (inbox_request_t) { .task_id = task_ids[i], .priority = priorities ? priorities[i] : 0 };
+        }
+
+        lane_t *lane = q->lanes + lane_i;
+        inbox_push(lane, item);
+        if (wake)
+            tm_os_api->thread->semaphore_add(lane->worker->sem, 1);
+    }
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
+
+// Cancels the task and returns the first dependency of its dependents, which the caller cancels in
+// turn.
+static uint32_t cancel_single_task(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    task_slot_t *slot = find_task_slot(q, task_id);
+    if (!slot)
+        return 0;
+
+    // Taken before the task is canceled, as the slot may be freed and reused any time after that. If
+    // the task completes first, its dependents are queued instead.
+    const uint32_t dependents = take_dependents(slot, task_id, DEPENDENTS_CANCELED);
+
+    uint64_t state = atomic_fetch_add_uint64_t(&slot->state, 0);
+    while (task_state_matches(state, task_id)) {
+        // Read before the state changes, as the worker thread frees the slot as soon as it sees the
+        // task canceled. The values are only used if the state didn't change in between.
+        const uint32_t lane = slot->lane;
+        switch (task_state_of(state)) {
+        case TASK_STATE_WAITING: {
+            void (*cancel_callback)(void *data) = slot->cancel_callback;
+            void *data = slot->data;
+            if (atomic_compare_exchange_strong_uint64_t(&slot->state, &state, task_state_word(task_id, TASK_STATE_CANCELED))) {
+                atomic_fetch_add_uint32_t(&q->lanes[lane].num_canceled, 1);
+                cancel_callback(data);
+                // The slot is freed by the last prerequisite that is done.
+                return dependents;
+            }
+        } break;
+        case TASK_STATE_QUEUED: {
+            void (*cancel_callback)(void *data) = slot->cancel_callback;
+            void *data = slot->data;
+            if (atomic_compare_exchange_strong_uint64_t(&slot->state, &state, task_state_word(task_id, TASK_STATE_CANCELED))) {
+                atomic_fetch_add_uint32_t(&q->lanes[lane].num_canceled, 1);
+                cancel_callback(data);
+                // Removes the task from the heap. The slot is freed by the worker thread.
+                push_request(q, q->lanes + lane, INBOX_OP_CANCEL, task_id, 0);
+                return dependents;
+            }
+        } break;
+        case TASK_STATE_EXECUTING:
+            if (atomic_compare_exchange_strong_uint64_t(&slot->state, &state, task_state_word(task_id, TASK_STATE_CANCELED))) {
+                atomic_fetch_add_uint32_t(&q->lanes[lane].num_canceled, 1);
+                return dependents;
             }
             break;
+        case TASK_STATE_COMPLETED:
+            if (atomic_compare_exchange_strong_uint64_t(&slot->state, &state, task_state_word(task_id + (1ULL << 32), TASK_STATE_FREE))) {
+                free_task_slot(q, task_id);
+                return dependents;
+            }
+            break;
+        default:
+            return dependents;
         }
     }
-    TM_OS_LEAVE_CRITICAL_SECTION(&q->tasks_cs);
-    return found;
+    return dependents;
 }
 
-static void cancel_task(mag_async_gpu_queue_o *q, uint64_t task_id)
+// Adds the waiting task to the dependents of its prerequisites. The task is canceled if one of them
+// was, and queued if all of them are done already.
+static void add_prerequisites(mag_async_gpu_queue_o *q, uint64_t task_id, const uint64_t *prerequisites, uint32_t n)
 {
-    bool found = false;
-    {
-        void (*callback)(void *data) = 0;
-        void *data = 0;
-        TM_OS_ENTER_CRITICAL_SECTION(&q->tasks_cs);
-        for (uint32_t i = 0; i < tm_carray_size(q->task_ids); ++i) {
-            if (q->task_ids[i] == task_id) {
-                found = true;
-                callback = q->task_heap[i].cancel_callback;
-                data = q->task_heap[i].data;
-                heap__remove(q->task_heap, q->task_ids, i);
-                break;
-            }
+    bool any_canceled = false;
+    for (uint32_t i = 0; i < n; ++i) {
+        bool canceled;
+        if (!add_dependent(q, prerequisites[i], task_id, &canceled)) {
+            any_canceled |= canceled;
+            finish_prerequisite(q, task_id);
         }
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->tasks_cs);
-        if (callback)
-            callback(data);
     }
 
-    if (!found) {
-        TM_OS_ENTER_CRITICAL_SECTION(&q->completed_tasks_cs);
-        for (uint64_t i = 0; i < tm_carray_size(q->completed_tasks); ++i) {
-            if (q->completed_tasks[i] == task_id) {
-                q->completed_tasks[i] = tm_carray_pop(q->completed_tasks);
-                found = true;
-                break;
-            }
+    // The task can't have dependents yet, so there's nothing to cascade to.
+    if (any_canceled)
+        cancel_single_task(q, task_id);
+    finish_prerequisite(q, task_id);
+}
+
+static void submit_tasks(mag_async_gpu_queue_o *q, const mag_async_gpu_queue_task_params_t *params, uint32_t n, uint64_t *out_ids)
+{
+    if (!n)
+        return;
+
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
+
+    const tm_clock_o now = tm_os_api->time->now();
+    // The lanes are copied, as the slots may be reused as soon as the first batch is pushed.
+    uint64_t *queued_ids = tm_alloc(a, n * sizeof(uint64_t));
+    uint32_t *lanes = tm_alloc(a, n * sizeof(uint32_t));
+    uint32_t num_queued = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint64_t id = alloc_task_slot(q);
+        if (!TM_ASSERT(id, "Too many tasks in the async GPU queue")) {
+            params[i].cancel_callback(params[i].data);
+            out_ids[i] = 0;
+            continue;
         }
-        if (!found)
-            tm_carray_push(q->canceled_tasks, task_id, &q->allocator);
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->completed_tasks_cs);
+        // Tasks for a lane that doesn't exist run in the first one.
+        const bool valid_lane = TM_ASSERT(params[i].lane < q->num_lanes, "Invalid lane %u in the async GPU queue", params[i].lane);
+        const uint32_t lane = valid_lane ? params[i].lane : 0;
+        task_slot_t *slot = task_slot(q, id);
+        slot->lane = lane;
+        slot->num_dispatches = params[i].num_dispatches;
+        slot->readback_bytes = params[i].readback_bytes;
+        slot->priority = params[i].priority;
+        slot->submit_time = now;
+        slot->f = params[i].f;
+        slot->cancel_callback = params[i].cancel_callback;
+        slot->completion_callback = params[i].completion_callback;
+        slot->data = params[i].data;
+        // Cleared before the dependents list is opened for the new generation, which is what tells
+        // add_dependent() that the slot was reused.
+        set_generation_completed(slot, id, false);
+        atomic_exchange_uint64_t(&slot->dependents, task_state_word(id, 0));
+        // A waiting task counts one more prerequisite until all of them are added, so that it isn't
+        // queued in between.
+        const bool waits = params[i].num_prerequisites > 0;
+        atomic_exchange_uint32_t(&slot->num_waiting_prerequisites, waits ? params[i].num_prerequisites + 1 : 0);
+        atomic_exchange_uint64_t(&slot->state, task_state_word(id, waits ? TASK_STATE_WAITING : TASK_STATE_QUEUED));
+        out_ids[i] = id;
+        if (!waits) {
+            queued_ids[num_queued] = id;
+            lanes[num_queued] = lane;
+            ++num_queued;
+        }
+    }
+
+    if (num_queued)
+        push_requests_by_lane(q, INBOX_OP_SUBMIT, queued_ids, lanes, 0, num_queued, true);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (out_ids[i] && params[i].num_prerequisites)
+            add_prerequisites(q, out_ids[i], params[i].prerequisites, params[i].num_prerequisites);
     }
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    TM_PROFILER_END_FUNC_SCOPE();
 }
 
-static bool is_task_done(mag_async_gpu_queue_o *q, uint64_t task_id)
+static uint64_t submit_task(mag_async_gpu_queue_o *q, const mag_async_gpu_queue_task_params_t *params)
 {
-    bool completed = false;
-    {
-        TM_OS_ENTER_CRITICAL_SECTION(&q->completed_tasks_cs);
-        for (uint64_t i = 0; i < tm_carray_size(q->completed_tasks); ++i) {
-            if (q->completed_tasks[i] == task_id) {
-                q->completed_tasks[i] = tm_carray_pop(q->completed_tasks);
-                completed = true;
-                break;
-            }
+    uint64_t id;
+    submit_tasks(q, params, 1, &id);
+    return id;
+}
+
+static bool update_task_priority(mag_async_gpu_queue_o *q, uint64_t task_id, uint64_t new_priority)
+{
+    task_slot_t *slot = find_task_slot(q, task_id);
+    const uint64_t state = slot ? atomic_fetch_add_uint64_t(&slot->state, 0) : 0;
+    if (!task_state_matches(state, task_id) || task_state_of(state) != TASK_STATE_QUEUED)
+        return false;
+
+    // If the slot has been reused since, the lane doesn't find the task and ignores the request.
+    push_request(q, q->lanes + slot->lane, INBOX_OP_UPDATE_PRIORITY, task_id, new_priority);
+    return true;
+}
+
+static uint32_t update_priorities(mag_async_gpu_queue_o *q, const uint64_t *task_ids, const uint64_t *new_priorities, uint32_t n)
+{
+    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
+
+    uint64_t *queued_ids = tm_alloc(a, n * sizeof(uint64_t));
+    uint32_t *queued_lanes = tm_alloc(a, n * sizeof(uint32_t));
+    uint64_t *queued_priorities = tm_alloc(a, n * sizeof(uint64_t));
+    uint32_t num_queued = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        task_slot_t *slot = find_task_slot(q, task_ids[i]);
+        const uint64_t state = slot ? atomic_fetch_add_uint64_t(&slot->state, 0) : 0;
+        if (task_state_matches(state, task_ids[i]) && task_state_of(state) == TASK_STATE_QUEUED) {
+            queued_ids[num_queued] = task_ids[i];
+            queued_lanes[num_queued] = slot->lane;
+            queued_priorities[num_queued] = new_priorities[i];
+            ++num_queued;
         }
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->completed_tasks_cs);
-        if (completed)
-            return true;
     }
 
-    uint64_t completed_id = 0;
-    void (*callback)(void *data) = 0;
-    void *data = 0;
-    {
-        TM_OS_ENTER_CRITICAL_SECTION(&q->executing_tasks_cs);
-        uint64_t executing_task_count = tm_carray_size(q->executing_tasks);
-        for (uint64_t i = 0; i < executing_task_count; ++i) {
-            executing_task_t *task = q->executing_tasks + i;
-            if (task->task_id == task_id || i == executing_task_count - 1) {
-                uint64_t ri = 0;
-                while (ri < tm_carray_size(task->fences)) {
-                    if (q->backend->read_complete(q->backend->inst, task->fences[ri], q->device_affinity_mask))
-                        task->fences[ri] = tm_carray_pop(task->fences);
-                    else
-                        ++ri;
-                }
-                if (!ri) {
-                    // all fences are done
-                    tm_carray_free(task->fences, &q->allocator);
-                    completed = task->task_id == task_id;
-                    completed_id = task->task_id;
-                    callback = task->completion_callback;
-                    data = task->data;
-                    q->executing_tasks[i] = tm_carray_pop(q->executing_tasks);
-                }
-                break;
-            }
+    push_requests_by_lane(q, INBOX_OP_UPDATE_PRIORITY, queued_ids, queued_lanes, queued_priorities, num_queued, false);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return num_queued;
+}
+
+static void cancel_task(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    const uint32_t first_dependency = cancel_single_task(q, task_id);
+    if (!first_dependency)
+        return;
+
+    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
+
+    // Dependencies of the canceled tasks, walked without recursion as chains of tasks can be long.
+    // Each dependent is canceled before its prerequisite is counted as done, so that it is freed
+    // instead of queued.
+    uint32_t *dependencies = 0;
+    tm_carray_push(dependencies, first_dependency, a);
+    while (tm_carray_size(dependencies)) {
+        const uint32_t dependency_i = tm_carray_pop(dependencies);
+        dependency_t *d = dependency(q, dependency_i);
+        const uint64_t dependent_id = d->task_id;
+        const uint32_t next = atomic_fetch_add_uint32_t(&d->next, 0);
+        free_dependency(q, dependency_i);
+        if (next)
+            tm_carray_push(dependencies, next, a);
+
+        const uint32_t dependents = cancel_single_task(q, dependent_id);
+        if (dependents)
+            tm_carray_push(dependencies, dependents, a);
+        finish_prerequisite(q, dependent_id);
+    }
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
+
+static bool is_task_done(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    task_slot_t *slot = find_task_slot(q, task_id);
+    uint64_t expected = task_state_word(task_id, TASK_STATE_COMPLETED);
+    if (!slot || !atomic_compare_exchange_strong_uint64_t(&slot->state, &expected, task_state_word(task_id + (1ULL << 32), TASK_STATE_FREE)))
+        return false;
+
+    free_task_slot(q, task_id);
+    return true;
+}
+
+static uint32_t drain_completed(mag_async_gpu_queue_o *q, uint64_t *out_ids, uint32_t max)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    uint32_t n = 0;
+    bool popped = false;
+    uint64_t task_id;
+    while (n < max && pop_completion(q, &task_id)) {
+        popped = true;
+        // Skips the tasks that were already confirmed with is_task_done() or cancel_task().
+        if (is_task_done(q, task_id))
+            out_ids[n++] = task_id;
+    }
+
+    // The flag is checked after popping, so if it is set later the ring is full again and the next
+    // call gets here.
+    if (popped && atomic_exchange_uint32_t(&q->completions_overflowed, 0)) {
+        for (uint32_t i = 0; i < q->num_workers; ++i)
+            tm_os_api->thread->semaphore_add(q->workers[i].sem, 1);
+    }
+
+    TM_PROFILER_END_FUNC_SCOPE();
+    return n;
+}
+
+// Microseconds since the queue was created, the time unit of the trace.
+static inline double trace_time(const mag_async_gpu_queue_o *q, tm_clock_o t)
+{
+    return tm_os_api->time->delta(t, q->create_time) * 1e6;
+}
+
+// Returns `s` as the contents of a JSON string, with quotes, backslashes and control characters
+// escaped.
+static char *json_escape(const char *s, tm_allocator_i *a)
+{
+    /* carray */ char *res = 0;
+    for (const char *c = s; *c; ++c) {
+        if ((uint8_t)*c < 0x20) {
+            tm_carray_printf(&res, a, "\\u%04x", (uint8_t)*c);
+            continue;
         }
-        TM_OS_LEAVE_CRITICAL_SECTION(&q->executing_tasks_cs);
+        if (*c == '"' || *c == '\\')
+            tm_carray_push(res, '\\', a);
+        tm_carray_push(res, *c, a);
     }
+    tm_carray_push(res, 0, a);
+    return res;
+}
 
-    if (callback)
-        callback(data);
+static bool write_trace(mag_async_gpu_queue_o *q, const char *path)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+    TM_INIT_TEMP_ALLOCATOR_WITH_ADAPTER(ta, a);
 
-    if (completed_id) {
-        // we might've freed resources for a queued task
-        tm_os_api->thread->semaphore_add(q->sem, 1);
-        if (!completed) {
-            TM_OS_ENTER_CRITICAL_SECTION(&q->completed_tasks_cs);
-            tm_carray_push(q->completed_tasks, completed_id, &q->allocator);
-            TM_OS_LEAVE_CRITICAL_SECTION(&q->completed_tasks_cs);
+    // The lane names are escaped once, as every event repeats them.
+    char **lane_names = tm_alloc(a, q->num_lanes * sizeof(char *));
+    for (uint32_t i = 0; i < q->num_lanes; ++i)
+        lane_names[i] = json_escape(q->lanes[i].name, a);
+
+    // Each lane is shown as a thread. Tasks overlap, so their queued and executing phases are async
+    // events, which are grouped by lane through their category.
+    char *json = 0;
+    tm_carray_printf(&json, &q->allocator, "{\"traceEvents\":[\n");
+    for (uint32_t i = 0; i < q->num_lanes; ++i)
+        tm_carray_printf(&json, &q->allocator, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", i ? ",\n" : "", i, lane_names[i]);
+
+    const uint32_t n = tm_min(atomic_fetch_add_uint32_t(&q->num_trace_events, 0), q->max_trace_events);
+    for (const trace_event_t *e = q->trace_events; e != q->trace_events + n; ++e) {
+        if (!atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&e->written, 0))
+            continue;
+
+        const char *lane_name = lane_names[e->lane];
+        const unsigned long long id = e->task_id;
+        const tm_clock_o queue_end = e->launch_time.opaque ? e->launch_time : e->end_time;
+        tm_carray_printf(&json, &q->allocator, ",\n{\"name\":\"queued\",\"cat\":\"%s\",\"ph\":\"b\",\"id\":\"0x%llx\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}", lane_name, id, e->lane, trace_time(q, e->submit_time));
+        tm_carray_printf(&json, &q->allocator, ",\n{\"name\":\"queued\",\"cat\":\"%s\",\"ph\":\"e\",\"id\":\"0x%llx\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"canceled\":%s}}", lane_name, id, e->lane, trace_time(q, queue_end), e->canceled && !e->launch_time.opaque ? "true" : "false");
+        if (e->launch_time.opaque) {
+            tm_carray_printf(&json, &q->allocator, ",\n{\"name\":\"executing\",\"cat\":\"%s\",\"ph\":\"b\",\"id\":\"0x%llx\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}", lane_name, id, e->lane, trace_time(q, e->launch_time));
+            tm_carray_printf(&json, &q->allocator, ",\n{\"name\":\"executing\",\"cat\":\"%s\",\"ph\":\"e\",\"id\":\"0x%llx\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"dispatches\":%u,\"canceled\":%s}}", lane_name, id, e->lane, trace_time(q, e->end_time), e->num_dispatches, e->canceled ? "true" : "false");
         }
     }
+    tm_carray_printf(&json, &q->allocator, "\n]}\n");
 
-    return completed;
+    tm_file_o file = tm_os_api->file_io->open_output(path);
+    const bool res = file.valid && tm_os_api->file_io->write(file, json, tm_carray_size(json));
+    if (file.valid)
+        tm_os_api->file_io->close(file);
+    tm_carray_free(json, &q->allocator);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    TM_PROFILER_END_FUNC_SCOPE();
+    return res;
 }
 
 static struct mag_async_gpu_queue_api queue_api = {
@@ -500,13 +1709,26 @@ static struct mag_async_gpu_queue_api queue_api = {
     .update_task_priority = update_task_priority,
     .cancel_task = cancel_task,
     .is_task_done = is_task_done,
+    .submit_tasks = submit_tasks,
+    .update_priorities = update_priorities,
+    .drain_completed = drain_completed,
+    .find_lane = find_lane,
+    .begin_frame = begin_frame,
+    .write_trace = write_trace,
 };
 
+#include "mag_async_gpu_queue_tests.inl"
+
 TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
 {
     tm_temp_allocator_api = tm_get_api(reg, tm_temp_allocator_api);
     tm_allocator_api = tm_get_api(reg, tm_allocator_api);
+    tm_error_api = tm_get_api(reg, tm_error_api);
+    tm_logger_api = tm_get_api(reg, tm_logger_api);
     tm_os_api = tm_get_api(reg, tm_os_api);
+    tm_profiler_api = tm_get_api(reg, tm_profiler_api);
+    tm_statistics_source_api = tm_get_api(reg, tm_statistics_source_api);
 
     tm_set_or_remove_api(reg, load, mag_async_gpu_queue_api, &queue_api);
-}
\ No newline at end of file
+    tm_add_or_remove_implementation(reg, load, tm_unit_test_i, mag_async_gpu_queue_tests);
+}
@@ -19,25 +19,93 @@ typedef struct mag_async_gpu_queue_task_args_t
     struct tm_allocator_i *fences_allocator;
 } mag_async_gpu_queue_task_args_t;
 
+// A lane has its own queue of tasks and its own limit on simultaneously executing tasks, so that a
+// backlog of tasks in one lane doesn't delay the tasks of another.
+typedef struct mag_async_gpu_queue_lane_params_t
+{
+    // Used to find the lane with find_lane() and to name its thread.
+    const char *name;
+    uint32_t max_simultaneous_tasks;
+    uint32_t device_affinity_mask;
+    // Runs the lane on its own thread. Otherwise the lane runs on the thread shared by all the lanes
+    // that don't have their own.
+    bool own_thread;
+    // Lets the lane exceed its `max_simultaneous_tasks` by using the capacity of the lanes that have
+    // no queued tasks. The capacity is given back when the borrowing tasks complete.
+    bool can_borrow;
+    TM_PAD(6);
+} mag_async_gpu_queue_lane_params_t;
+
 typedef struct mag_async_gpu_queue_params_t
 {
+    // Used when `num_lanes` is 0 to create a single lane.
     uint32_t max_simultaneous_tasks;
     uint32_t device_affinity_mask;
+
+    uint32_t num_lanes;
+    TM_PAD(4);
+    const mag_async_gpu_queue_lane_params_t *lanes;
+
+    // Per-frame budgets that tasks are launched against, see begin_frame(). 0 means no limit.
+    // The GPU time of a task is estimated from its `num_dispatches` and the time per dispatch that
+    // the lane has measured for its recent tasks, so the number of dispatches launched per frame
+    // adapts to how long they actually take.
+    uint64_t gpu_time_budget_per_frame_ns;
+    // Limits the data read back per frame, and so the work done on completed tasks in one frame.
+    uint64_t readback_bytes_budget_per_frame;
+
+    // Path prefix of the statistics sources of the queue, such as "magnum/gpu_queue". The queue
+    // publishes the queued, executing, completed and canceled tasks, the p50 and p99 queue and
+    // execution latencies and the fence wait time of each lane as
+    // "<name>/<lane name>/<statistic>". Statistics are only published if this is set, and are
+    // updated by begin_frame().
+    const char *name;
+
+    // Number of tasks to record for write_trace(). The first `max_trace_tasks` tasks that the queue
+    // is done with are recorded. 0 turns tracing off.
+    uint32_t max_trace_tasks;
+    TM_PAD(4);
 } mag_async_gpu_queue_params_t;
 
 typedef struct mag_async_gpu_queue_task_params_t
 {
+    // Called on the thread of the task's lane.
     void (*f)(mag_async_gpu_queue_task_args_t *args);
     void *data;
+    // Called on the thread that cancels a queued task.
     void (*cancel_callback)(void *data);
+    // Called on the thread of the task's lane once all the fences of the task have signaled,
+    // including for tasks that were canceled while executing.
     void (*completion_callback)(void *data);
     uint64_t priority;
+    // Index of the lane to run the task in.
+    uint32_t lane;
+
+    // Estimated cost of the task, charged to the per-frame budgets of the queue when the task is
+    // launched.
+    uint32_t num_dispatches;
+    uint64_t readback_bytes;
+
+    // Tasks that must complete before this task is launched. The task waits outside of its lane's
+    // queue until the fences of all of them have signaled and their completion callbacks have run,
+    // and is queued right away after that, on the thread of the last one to complete. If any of them
+    // is canceled, the task is canceled too. Prerequisites that were confirmed count as completed,
+    // but the queue only remembers that until their slot has been reused 63 times, after which
+    // they count as canceled, so leave out the ones that are known to be done. A 0 from a failed
+    // submit counts as canceled.
+    const uint64_t *prerequisites;
+    uint32_t num_prerequisites;
+    TM_PAD(4);
 } mag_async_gpu_queue_task_params_t;
 
 // Priority queue for submitting GPU tasks. The tasks execute asynchronously with a limit
 // on the number of simultaneously executing tasks.
-// Notice that either cancel_task() or a positive is_task_done() is expected to be called for every
-// submitted task.
+// Notice that for every submitted task either cancel_task() or a positive is_task_done() is expected
+// to be called, or its ID is expected to be returned by drain_completed(). Tasks canceled along with a
+// prerequisite need neither.
+// All functions except create() and destroy() can be called from any thread and don't lock: requests
+// are passed to the thread of the task's lane through a lock-free inbox, and each task has an atomic
+// state that is_task_done() reads.
 struct mag_async_gpu_queue_api
 {
     mag_async_gpu_queue_o *(*create)(tm_allocator_i *a, struct tm_renderer_backend_i *backend, const mag_async_gpu_queue_params_t *params);
@@ -48,14 +116,46 @@ struct mag_async_gpu_queue_api
 
     // Lower priority values are executed first. 0 - top priority.
     // If the data_allocator is not NULL, it will be used to free the data pointer
+    // Returns 0 if the queue already holds 4M tasks, in which case the task is canceled right away.
     uint64_t (*submit_task)(mag_async_gpu_queue_o *q, const mag_async_gpu_queue_task_params_t *params);
 
-    // Returns false if the task was not in the queue. This usually means the task is executing/done.
+    // Returns false if the task was not in the queue. This usually means the task is executing/done,
+    // or still waiting for its prerequisites, which keeps the priority it was submitted with.
     bool (*update_task_priority)(mag_async_gpu_queue_o *q, uint64_t task_id, uint64_t new_priority);
 
+    // Cancels the task and, in turn, the tasks that have it as a prerequisite. Their cancel callbacks
+    // are called on this thread.
     void (*cancel_task)(mag_async_gpu_queue_o *q, uint64_t task_id);
 
     bool (*is_task_done)(mag_async_gpu_queue_o *q, uint64_t task_id);
+
+    // Submits `n` tasks at once and writes their IDs to `out_ids`. Cheaper than calling submit_task()
+    // `n` times: the thread of each lane is woken up once and adds its part of the batch at once.
+    void (*submit_tasks)(mag_async_gpu_queue_o *q, const mag_async_gpu_queue_task_params_t *params, uint32_t n, uint64_t *out_ids);
+
+    // Batch version of update_task_priority(). Returns the number of tasks that were in the queue.
+    uint32_t (*update_priorities)(mag_async_gpu_queue_o *q, const uint64_t *task_ids, const uint64_t *new_priorities, uint32_t n);
+
+    // Writes up to `max` IDs of completed tasks to `out_ids` and returns their number. The tasks are
+    // confirmed the same way as with a positive is_task_done(), so each completed task is returned
+    // once, and tasks that were already confirmed are skipped. Use it instead of calling
+    // is_task_done() for every task each frame. Must not be called from several threads at once.
+    uint32_t (*drain_completed)(mag_async_gpu_queue_o *q, uint64_t *out_ids, uint32_t max);
+
+    // Returns the index of the lane with the given name, or UINT32_MAX if there's no such lane.
+    uint32_t (*find_lane)(mag_async_gpu_queue_o *q, const char *name);
+
+    // Starts a new frame, publishing the statistics of the last one and resetting the per-frame
+    // budgets. Tasks that don't fit in the budgets of the current frame wait in the queue for the
+    // next one. The first task launched in a frame is never held back, so that a task that costs
+    // more than a whole frame's budget still runs. Only needed if the queue was created with a
+    // budget or a name.
+    void (*begin_frame)(mag_async_gpu_queue_o *q);
+
+    // Writes the recorded tasks to `path` in the Chrome trace event format, which can be opened in
+    // chrome://tracing or Perfetto. Each task shows when it was queued and executing, in the track
+    // of its lane. Returns false if the file couldn't be written.
+    bool (*write_trace)(mag_async_gpu_queue_o *q, const char *path);
 };
 
-#define mag_async_gpu_queue_api_version TM_VERSION(1, 0, 0)
\ No newline at end of file
+#define mag_async_gpu_queue_api_version TM_VERSION(2, 0, 0)
\ No newline at end of file
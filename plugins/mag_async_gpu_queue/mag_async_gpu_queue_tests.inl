@@ -0,0 +1,847 @@
+// Unit and stress tests of the queue. The queue only uses the fences of the renderer backend, so the
+// tests drive it with a CPU stub backend and don't need a GPU.
+
+// Fences that the stub backend can issue in a test.
+#define STUB_MAX_FENCES (1024 * 1024)
+
+// How long the tests wait for something the queue is expected to do before they fail, in seconds.
+#define TEST_TIMEOUT 5.0
+
+#define STRESS_NUM_PRODUCERS 4
+#define STRESS_TASKS_PER_PRODUCER 20000
+#define STRESS_MAX_BATCH 64
+
+// Renderer backend with fences that signal on the CPU. A fence signals once `delay_ns` plus up to
+// `jitter_ns` nanoseconds have passed since it was issued or, if `signal_probability` is set, with
+// that probability each time it is polled.
+typedef struct stub_backend_o
+{
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    double signal_probability;
+
+    // While set, no fence signals.
+    atomic_uint_least32_t hold;
+    atomic_uint_least32_t num_fences;
+    // Fences that the queue has seen signaled, and how many of them it saw signaled more than once.
+    atomic_uint_least32_t num_fences_read;
+    atomic_uint_least32_t num_fences_read_twice;
+    atomic_uint_least64_t random_state;
+
+    tm_clock_o start;
+    // Deadline of each fence, in nanoseconds since `start`, and whether it has been read.
+    uint64_t *deadlines;
+    atomic_uint_least32_t *read;
+} stub_backend_o;
+
+static uint64_t stub_random(stub_backend_o *stub)
+{
+    // splitmix64
+    uint64_t x = atomic_fetch_add_uint64_t(&stub->random_state, 0x9e3779b97f4a7c15ULL) + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t stub_now_ns(const stub_backend_o *stub)
+{
+    return (uint64_t)(tm_os_api->time->delta(tm_os_api->time->now(), stub->start) * 1e9);
+}
+
+// Issues a fence. Returns 0 if the stub is out of fences.
+static uint32_t stub_issue_fence(stub_backend_o *stub)
+{
+    const uint32_t fence = atomic_fetch_add_uint32_t(&stub->num_fences, 1) + 1;
+    if (fence >= STUB_MAX_FENCES)
+        return 0;
+    const uint64_t jitter = stub->jitter_ns ? stub_random(stub) % stub->jitter_ns : 0;
+    stub->deadlines[fence] = stub_now_ns(stub) + stub->delay_ns + jitter;
+    return fence;
+}
+
+static bool stub_is_signaled(stub_backend_o *stub, uint32_t fence)
+{
+    if (atomic_fetch_add_uint32_t(&stub->hold, 0))
+        return false;
+    if (stub->signal_probability > 0)
+        return (double)(stub_random(stub) >> 11) * 0x1.0p-53 < stub->signal_probability;
+    return stub_now_ns(stub) >= stub->deadlines[fence];
+}
+
+static void stub_mark_read(stub_backend_o *stub, uint32_t fence)
+{
+    if (atomic_fetch_add_uint32_t(&stub->read[fence], 1))
+        atomic_fetch_add_uint32_t(&stub->num_fences_read_twice, 1);
+    else
+        atomic_fetch_add_uint32_t(&stub->num_fences_read, 1);
+}
+
+static bool stub_read_complete(tm_renderer_backend_o *inst, uint32_t fence, uint32_t device_affinity_mask)
+{
+    stub_backend_o *stub = (stub_backend_o *)inst;
+    if (!stub_is_signaled(stub, fence))
+        return false;
+    stub_mark_read(stub, fence);
+    return true;
+}
+
+static bool stub_wait_for_reads(tm_renderer_backend_o *inst, const uint32_t *fences, bool *signaled, uint32_t num_fences, uint64_t timeout, uint32_t device_affinity_mask)
+{
+    stub_backend_o *stub = (stub_backend_o *)inst;
+    const uint64_t end = stub_now_ns(stub) + timeout;
+    while (true) {
+        bool any = false;
+        for (uint32_t i = 0; i < num_fences; ++i) {
+            signaled[i] = stub_is_signaled(stub, fences[i]);
+            any |= signaled[i];
+        }
+        if (any) {
+            for (uint32_t i = 0; i < num_fences; ++i) {
+                if (signaled[i])
+                    stub_mark_read(stub, fences[i]);
+            }
+            return true;
+        }
+
+        const uint64_t now = stub_now_ns(stub);
+        if (now >= end)
+            return false;
+        tm_os_api->thread->sleep(tm_min(end - now, 20000) * 1e-9);
+    }
+}
+
+static void stub_backend_init(stub_backend_o *stub, tm_allocator_i *a, tm_renderer_backend_i *backend)
+{
+    stub->start = tm_os_api->time->now();
+    stub->deadlines = tm_alloc(a, STUB_MAX_FENCES * sizeof(uint64_t));
+    stub->read = tm_alloc(a, STUB_MAX_FENCES * sizeof(atomic_uint_least32_t));
+    memset(stub->read, 0, STUB_MAX_FENCES * sizeof(atomic_uint_least32_t));
+    *backend = (tm_renderer_backend_i) {
+        .inst = (tm_renderer_backend_o *)stub,
+        .read_complete = stub_read_complete,
+        .wait_for_reads = stub_wait_for_reads,
+    };
+}
+
+static void stub_backend_shutdown(stub_backend_o *stub, tm_allocator_i *a)
+{
+    tm_free(a, stub->deadlines, STUB_MAX_FENCES * sizeof(uint64_t));
+    tm_free(a, stub->read, STUB_MAX_FENCES * sizeof(atomic_uint_least32_t));
+}
+
+typedef struct test_context_t
+{
+    stub_backend_o *stub;
+    // Tasks in the order they were launched.
+    struct test_task_t *launch_order[16];
+    atomic_uint_least32_t num_launched;
+    // Tasks launched before their prerequisite completed.
+    atomic_uint_least32_t num_early_launches;
+} test_context_t;
+
+typedef struct test_task_t
+{
+    test_context_t *ctx;
+    const struct test_task_t *prerequisite;
+    uint32_t num_fences;
+    atomic_uint_least32_t launched;
+    atomic_uint_least32_t completed;
+    atomic_uint_least32_t canceled;
+
+    // Only touched by the thread that submitted the task.
+    uint64_t id;
+    bool cancel_requested;
+    bool confirmed;
+    TM_PAD(6);
+} test_task_t;
+
+static void test_task_f(mag_async_gpu_queue_task_args_t *args)
+{
+    test_task_t *task = args->data;
+    test_context_t *ctx = task->ctx;
+    const uint32_t i = atomic_fetch_add_uint32_t(&ctx->num_launched, 1);
+    if (i < TM_ARRAY_COUNT(ctx->launch_order))
+        ctx->launch_order[i] = task;
+    atomic_fetch_add_uint32_t(&task->launched, 1);
+    if (task->prerequisite && !atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&task->prerequisite->completed, 0))
+        atomic_fetch_add_uint32_t(&ctx->num_early_launches, 1);
+
+    for (uint32_t f = 0; f < task->num_fences; ++f) {
+        const uint32_t fence = stub_issue_fence(ctx->stub);
+        if (fence)
+            tm_carray_push(args->out_fences, fence, args->fences_allocator);
+    }
+}
+
+static void test_task_cancel(void *data)
+{
+    atomic_fetch_add_uint32_t(&((test_task_t *)data)->canceled, 1);
+}
+
+static void test_task_complete(void *data)
+{
+    atomic_fetch_add_uint32_t(&((test_task_t *)data)->completed, 1);
+}
+
+static mag_async_gpu_queue_task_params_t test_task_params(test_task_t *task, uint64_t priority)
+{
+    return (mag_async_gpu_queue_task_params_t) {
+        .f = test_task_f,
+        .data = task,
+        .cancel_callback = test_task_cancel,
+        .completion_callback = test_task_complete,
+        .priority = priority,
+    };
+}
+
+static uint64_t test_submit_after(mag_async_gpu_queue_o *q, test_task_t *task, const test_task_t *prerequisite)
+{
+    mag_async_gpu_queue_task_params_t params = test_task_params(task, 0);
+    params.prerequisites = &prerequisite->id;
+    params.num_prerequisites = 1;
+    task->prerequisite = prerequisite;
+    return task->id = queue_api.submit_task(q, &params);
+}
+
+static uint32_t test_load(const atomic_uint_least32_t *value)
+{
+    return atomic_fetch_add_uint32_t((atomic_uint_least32_t *)value, 0);
+}
+
+// Waits until `*value` reaches `expected`. Returns false on timeout.
+static bool test_wait_for(atomic_uint_least32_t *value, uint32_t expected)
+{
+    const tm_clock_o start = tm_os_api->time->now();
+    while (atomic_fetch_add_uint32_t(value, 0) < expected) {
+        if (tm_os_api->time->delta(tm_os_api->time->now(), start) > TEST_TIMEOUT)
+            return false;
+        tm_os_api->thread->sleep(0.0001);
+    }
+    return true;
+}
+
+static enum task_state test_task_state(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    return task_state_of(atomic_fetch_add_uint64_t(&task_slot(q, task_id)->state, 0));
+}
+
+// Waits until the slot of `task_id` is on the free list. Returns false on timeout.
+static bool test_wait_for_free_slot(mag_async_gpu_queue_o *q, uint64_t task_id)
+{
+    const tm_clock_o start = tm_os_api->time->now();
+    for (;;) {
+        // Only the calling thread takes slots from the list, so other threads can only push to it
+        // while it's walked.
+        uint32_t slot_i = (uint32_t)atomic_fetch_add_uint64_t(&q->free_slots, 0);
+        for (; slot_i && slot_i != (uint32_t)task_id; slot_i = atomic_fetch_add_uint32_t(&task_slot(q, slot_i)->next_free, 0))
+            ;
+        if (slot_i)
+            return true;
+        if (tm_os_api->time->delta(tm_os_api->time->now(), start) > TEST_TIMEOUT)
+            return false;
+        tm_os_api->thread->sleep(0.0001);
+    }
+}
+
+// Drains the completed tasks until `n` tasks have been returned and marks them as confirmed. Returns
+// false on timeout.
+static bool test_drain(mag_async_gpu_queue_o *q, test_task_t *tasks, uint32_t num_tasks, uint32_t n)
+{
+    const tm_clock_o start = tm_os_api->time->now();
+    uint32_t num_drained = 0;
+    while (num_drained < n) {
+        uint64_t ids[16];
+        const uint32_t num_ids = queue_api.drain_completed(q, ids, TM_ARRAY_COUNT(ids));
+        for (uint32_t i = 0; i < num_ids; ++i) {
+            for (test_task_t *task = tasks; task != tasks + num_tasks; ++task) {
+                if (task->id == ids[i])
+                    task->confirmed = true;
+            }
+        }
+        num_drained += num_ids;
+        if (!num_ids) {
+            if (tm_os_api->time->delta(tm_os_api->time->now(), start) > TEST_TIMEOUT)
+                return false;
+            tm_os_api->thread->sleep(0.0001);
+        }
+    }
+    return true;
+}
+
+// Tasks queued behind an executing task launch in priority order, taking reprioritisation and
+// cancellation into account.
+static void test_priorities(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .hold = 1 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .max_simultaneous_tasks = 1 });
+
+    test_task_t tasks[5];
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i)
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 + i % 2 };
+
+    // The first task blocks the queue until the fences are released.
+    const mag_async_gpu_queue_task_params_t first = test_task_params(tasks + 0, 0);
+    tasks[0].id = queue_api.submit_task(q, &first);
+    TM_UNIT_TEST(tr, test_wait_for(&tasks[0].launched, 1));
+
+    const uint64_t priorities[] = { 5, 1, 3, 4 };
+    mag_async_gpu_queue_task_params_t params[4];
+    uint64_t ids[4];
+    for (uint32_t i = 0; i < 4; ++i)
+        params[i] = test_task_params(tasks + 1 + i, priorities[i]);
+    queue_api.submit_tasks(q, params, 4, ids);
+    for (uint32_t i = 0; i < 4; ++i)
+        tasks[1 + i].id = ids[i];
+
+    queue_api.cancel_task(q, tasks[3].id);
+    tasks[3].cancel_requested = true;
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&tasks[3].canceled, 0) == 1);
+    TM_UNIT_TEST(tr, queue_api.update_task_priority(q, tasks[1].id, 0));
+    const uint64_t new_priority = 2;
+    TM_UNIT_TEST(tr, queue_api.update_priorities(q, &tasks[4].id, &new_priority, 1) == 1);
+    TM_UNIT_TEST(tr, !queue_api.update_task_priority(q, tasks[3].id, 0));
+
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 4));
+
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&ctx.num_launched, 0) == 4);
+    TM_UNIT_TEST(tr, ctx.launch_order[0] == tasks + 0);
+    TM_UNIT_TEST(tr, ctx.launch_order[1] == tasks + 1);
+    TM_UNIT_TEST(tr, ctx.launch_order[2] == tasks + 2);
+    TM_UNIT_TEST(tr, ctx.launch_order[3] == tasks + 4);
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i) {
+        const test_task_t *task = tasks + i;
+        TM_UNIT_TEST(tr, task->confirmed != task->cancel_requested);
+        TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&task->completed, 0) == !task->cancel_requested);
+        // Confirmed tasks aren't done a second time.
+        TM_UNIT_TEST(tr, !queue_api.is_task_done(q, task->id));
+    }
+    TM_UNIT_TEST(tr, !queue_api.is_task_done(q, 0xdeadbeef00000001ULL));
+
+    queue_api.destroy(q);
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&stub.num_fences_read, 0) == atomic_fetch_add_uint32_t(&stub.num_fences, 0));
+    stub_backend_shutdown(&stub, a);
+}
+
+// A task canceled while executing still gets its completion callback but is never reported as done,
+// and destroy() cancels the tasks that are still queued, including the ones queued while it waits
+// for the executing tasks.
+static void test_cancel(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .hold = 1 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .max_simultaneous_tasks = 1 });
+
+    test_task_t executing = { .ctx = &ctx, .num_fences = 2 };
+    test_task_t queued = { .ctx = &ctx, .num_fences = 1 };
+    const mag_async_gpu_queue_task_params_t params[] = { test_task_params(&executing, 0), test_task_params(&queued, 1) };
+    executing.id = queue_api.submit_task(q, params + 0);
+    TM_UNIT_TEST(tr, test_wait_for(&executing.launched, 1));
+    queued.id = queue_api.submit_task(q, params + 1);
+
+    queue_api.cancel_task(q, executing.id);
+    TM_UNIT_TEST(tr, !atomic_fetch_add_uint32_t(&executing.canceled, 0));
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_wait_for(&executing.completed, 1));
+    TM_UNIT_TEST(tr, !queue_api.is_task_done(q, executing.id));
+
+    // The prerequisite of `dependent` completes while destroy() waits for it, which queues
+    // `dependent` after the lane is done with its inbox.
+    test_task_t last = { .ctx = &ctx, .num_fences = 1 };
+    test_task_t dependent = { .ctx = &ctx, .num_fences = 1 };
+    stub.delay_ns = 50000000;
+    const mag_async_gpu_queue_task_params_t last_params = test_task_params(&last, 2);
+    last.id = queue_api.submit_task(q, &last_params);
+    TM_UNIT_TEST(tr, test_wait_for(&last.launched, 1));
+    test_submit_after(q, &dependent, &last);
+
+    queue_api.destroy(q);
+    TM_UNIT_TEST(tr, !atomic_fetch_add_uint32_t(&executing.canceled, 0));
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&queued.canceled, 0) + atomic_fetch_add_uint32_t(&queued.completed, 0) == 1);
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&last.completed, 0) == 1);
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&dependent.canceled, 0) + atomic_fetch_add_uint32_t(&dependent.completed, 0) == 1);
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&stub.num_fences_read, 0) == atomic_fetch_add_uint32_t(&stub.num_fences, 0));
+    stub_backend_shutdown(&stub, a);
+}
+
+// Lanes are found by name, and tasks wait for begin_frame() once the frame's budget is used up.
+static void test_lanes_and_budget(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .delay_ns = 10000 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    const mag_async_gpu_queue_lane_params_t lanes[] = {
+        { .name = "near", .max_simultaneous_tasks = 2 },
+        { .name = "far", .max_simultaneous_tasks = 2, .own_thread = true },
+    };
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .num_lanes = TM_ARRAY_COUNT(lanes), .lanes = lanes, .readback_bytes_budget_per_frame = 100 });
+    TM_UNIT_TEST(tr, queue_api.find_lane(q, "far") == 1);
+    TM_UNIT_TEST(tr, queue_api.find_lane(q, "mid") == UINT32_MAX);
+
+    test_task_t tasks[3];
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i) {
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 };
+        mag_async_gpu_queue_task_params_t params = test_task_params(tasks + i, i);
+        params.lane = 1;
+        params.readback_bytes = 60;
+        tasks[i].id = queue_api.submit_task(q, &params);
+    }
+
+    // Only the first task fits in the frame. A task without readbacks still fits, and the lane tries
+    // the next task in the same pass that launches it, so once it's done the others were held back.
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    test_task_t probe = { .ctx = &ctx, .num_fences = 1 };
+    mag_async_gpu_queue_task_params_t probe_params = test_task_params(&probe, 0);
+    probe_params.lane = 1;
+    probe.id = queue_api.submit_task(q, &probe_params);
+    TM_UNIT_TEST(tr, test_drain(q, &probe, 1, 1));
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&ctx.num_launched, 0) == 2);
+
+    queue_api.begin_frame(q);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    queue_api.begin_frame(q);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    TM_UNIT_TEST(tr, ctx.launch_order[0] == tasks + 0 && ctx.launch_order[1] == &probe && ctx.launch_order[2] == tasks + 1 && ctx.launch_order[3] == tasks + 2);
+
+    queue_api.destroy(q);
+    stub_backend_shutdown(&stub, a);
+}
+
+// Tasks launch once their prerequisites have completed, and are canceled with them.
+static void test_prerequisites(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .hold = 1 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    // Tasks in the second lane never launch.
+    const mag_async_gpu_queue_lane_params_t lanes[] = {
+        { .name = "main", .max_simultaneous_tasks = 4 },
+        { .name = "stalled" },
+    };
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .num_lanes = TM_ARRAY_COUNT(lanes), .lanes = lanes });
+
+    test_task_t tasks[16];
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i)
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 + i % 2 };
+
+    // A chain and a diamond behind an executing task.
+    const mag_async_gpu_queue_task_params_t first = test_task_params(tasks + 0, 0);
+    tasks[0].id = queue_api.submit_task(q, &first);
+    TM_UNIT_TEST(tr, test_wait_for(&tasks[0].launched, 1));
+    test_submit_after(q, tasks + 1, tasks + 0);
+    test_submit_after(q, tasks + 2, tasks + 1);
+    mag_async_gpu_queue_task_params_t params = test_task_params(tasks + 3, 0);
+    const uint64_t prerequisites[] = { tasks[0].id, tasks[2].id };
+    params.prerequisites = prerequisites;
+    params.num_prerequisites = TM_ARRAY_COUNT(prerequisites);
+    tasks[3].prerequisite = tasks + 2;
+    tasks[3].id = queue_api.submit_task(q, &params);
+    test_submit_after(q, tasks + 4, tasks + 0);
+
+    // The dependents can't be queued before `tasks[0]` completes, which the held fences prevent.
+    for (uint32_t i = 1; i < 5; ++i)
+        TM_UNIT_TEST(tr, test_task_state(q, tasks[i].id) == TASK_STATE_WAITING);
+    TM_UNIT_TEST(tr, test_load(&ctx.num_launched) == 1);
+    TM_UNIT_TEST(tr, !queue_api.update_task_priority(q, tasks[1].id, 0));
+    TM_UNIT_TEST(tr, !queue_api.is_task_done(q, tasks[1].id));
+    queue_api.cancel_task(q, tasks[4].id);
+    tasks[4].cancel_requested = true;
+    TM_UNIT_TEST(tr, test_load(&tasks[4].canceled) == 1);
+
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 4));
+    for (uint32_t i = 0; i < 4; ++i)
+        TM_UNIT_TEST(tr, ctx.launch_order[i] == tasks + i && tasks[i].confirmed);
+    TM_UNIT_TEST(tr, !test_load(&tasks[4].launched));
+
+    // Canceling a task cancels its dependents, including the ones submitted after the cancel.
+    atomic_exchange_uint32_t(&stub.hold, 1);
+    const mag_async_gpu_queue_task_params_t executing = test_task_params(tasks + 5, 0);
+    tasks[5].id = queue_api.submit_task(q, &executing);
+    TM_UNIT_TEST(tr, test_wait_for(&tasks[5].launched, 1));
+    test_submit_after(q, tasks + 6, tasks + 5);
+    test_submit_after(q, tasks + 7, tasks + 6);
+    queue_api.cancel_task(q, tasks[5].id);
+    TM_UNIT_TEST(tr, !test_load(&tasks[5].canceled));
+    TM_UNIT_TEST(tr, test_load(&tasks[6].canceled) == 1 && test_load(&tasks[7].canceled) == 1);
+    test_submit_after(q, tasks + 8, tasks + 5);
+    TM_UNIT_TEST(tr, test_load(&tasks[8].canceled) == 1);
+
+    // A prerequisite that was already confirmed counts as completed.
+    test_submit_after(q, tasks + 9, tasks + 0);
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    TM_UNIT_TEST(tr, tasks[9].confirmed);
+    TM_UNIT_TEST(tr, test_wait_for(&tasks[5].completed, 1));
+
+    // A canceled prerequisite still cancels its dependents once its slot is reused, and so does the
+    // 0 of a failed submit. The lane frees the slot of the canceled task when the next submit wakes
+    // it up. Slots freed after it, such as the one of `tasks[5]`, are reused first, so fillers are
+    // submitted until one of them gets the slot.
+    mag_async_gpu_queue_task_params_t stalled = test_task_params(tasks + 10, 0);
+    stalled.lane = 1;
+    tasks[10].id = queue_api.submit_task(q, &stalled);
+    queue_api.cancel_task(q, tasks[10].id);
+    tasks[10].cancel_requested = true;
+    stalled.data = tasks + 11;
+    tasks[11].id = queue_api.submit_task(q, &stalled);
+    TM_UNIT_TEST(tr, test_wait_for_free_slot(q, tasks[10].id));
+    test_task_t fillers[8];
+    uint32_t num_fillers = 0;
+    bool reused = false;
+    while (!reused && num_fillers < TM_ARRAY_COUNT(fillers)) {
+        test_task_t *filler = fillers + num_fillers++;
+        *filler = (test_task_t) { .ctx = &ctx, .num_fences = 1 };
+        stalled.data = filler;
+        filler->id = queue_api.submit_task(q, &stalled);
+        reused = (uint32_t)filler->id == (uint32_t)tasks[10].id;
+    }
+    TM_UNIT_TEST(tr, reused);
+    test_submit_after(q, tasks + 12, tasks + 10);
+    TM_UNIT_TEST(tr, test_load(&tasks[12].canceled) == 1);
+    const test_task_t failed = { 0 };
+    test_submit_after(q, tasks + 13, &failed);
+    TM_UNIT_TEST(tr, test_load(&tasks[13].canceled) == 1);
+
+    // destroy() cancels the tasks that wait for prerequisites.
+    stalled.data = tasks + 14;
+    tasks[14].id = queue_api.submit_task(q, &stalled);
+    test_submit_after(q, tasks + 15, tasks + 14);
+    queue_api.destroy(q);
+
+    for (const test_task_t *task = tasks; task != tasks + TM_ARRAY_COUNT(tasks); ++task) {
+        TM_UNIT_TEST(tr, test_load(&task->canceled) + test_load(&task->completed) == 1);
+        TM_UNIT_TEST(tr, test_load(&task->launched) == test_load(&task->completed));
+    }
+    for (const test_task_t *filler = fillers; filler != fillers + num_fillers; ++filler)
+        TM_UNIT_TEST(tr, test_load(&filler->canceled) == 1);
+    TM_UNIT_TEST(tr, test_load(&tasks[14].canceled) == 1 && test_load(&tasks[15].canceled) == 1);
+    TM_UNIT_TEST(tr, !test_load(&ctx.num_early_launches));
+    TM_UNIT_TEST(tr, test_load(&stub.num_fences_read) == test_load(&stub.num_fences));
+    stub_backend_shutdown(&stub, a);
+}
+
+// Allocator that holds up the worker thread when it allocates the submit request of a dependent
+// that the completion of its prerequisite has queued.
+typedef struct gate_allocator_t
+{
+    tm_allocator_i *parent;
+    mag_async_gpu_queue_o *q;
+    uint64_t task_id;
+    // 1 while armed, 2 while the worker thread waits, 3 once opened.
+    atomic_uint_least32_t state;
+    TM_PAD(4);
+} gate_allocator_t;
+
+static void *gate_realloc(tm_allocator_i *a, void *ptr, uint64_t old_size, uint64_t new_size, const char *file, uint32_t line)
+{
+    // The dependent is queued right before its submit request is allocated, and the test thread
+    // doesn't allocate while the gate is armed.
+    gate_allocator_t *gate = (gate_allocator_t *)a->inst;
+    uint32_t armed = 1;
+    if (atomic_fetch_add_uint32_t(&gate->state, 0) == armed && test_task_state(gate->q, gate->task_id) == TASK_STATE_QUEUED
+        && atomic_compare_exchange_strong_uint32_t(&gate->state, &armed, 2)) {
+        while (atomic_fetch_add_uint32_t(&gate->state, 0) == 2)
+            tm_os_api->thread->sleep(0.0001);
+    }
+    return gate->parent->realloc(gate->parent, ptr, old_size, new_size, file, line);
+}
+
+// A priority update still applies when it reaches the lane before the submit request of a
+// dependent, which the worker thread pushes once the prerequisite completes. The readback budget
+// holds the dependent back until begin_frame(), so the update is in time either way.
+static void test_update_priority_of_dependent(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .hold = 1 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    gate_allocator_t gate = { .parent = a };
+    tm_allocator_i gated = { .inst = (struct tm_allocator_o *)&gate, .realloc = gate_realloc };
+    mag_async_gpu_queue_o *q = queue_api.create(&gated, &backend, &(mag_async_gpu_queue_params_t) { .max_simultaneous_tasks = 4, .readback_bytes_budget_per_frame = 100 });
+
+    // The dependent is submitted last, with a lower priority than the task before it.
+    test_task_t tasks[3];
+    const uint64_t priorities[] = { 0, 5, 10 };
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i) {
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 };
+        mag_async_gpu_queue_task_params_t params = test_task_params(tasks + i, priorities[i]);
+        params.readback_bytes = 60;
+        if (i == 2) {
+            params.prerequisites = &tasks[0].id;
+            params.num_prerequisites = 1;
+            tasks[2].prerequisite = tasks + 0;
+        }
+        tasks[i].id = queue_api.submit_task(q, &params);
+        if (!i)
+            TM_UNIT_TEST(tr, test_wait_for(&tasks[0].launched, 1));
+    }
+
+    gate.q = q;
+    gate.task_id = tasks[2].id;
+    atomic_exchange_uint32_t(&gate.state, 1);
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_wait_for(&gate.state, 2));
+    TM_UNIT_TEST(tr, queue_api.update_task_priority(q, tasks[2].id, 0));
+    atomic_exchange_uint32_t(&gate.state, 3);
+
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    queue_api.begin_frame(q);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 1));
+    TM_UNIT_TEST(tr, ctx.launch_order[1] == tasks + 2);
+
+    queue_api.destroy(q);
+    TM_UNIT_TEST(tr, test_load(&tasks[1].canceled) == 1);
+    stub_backend_shutdown(&stub, a);
+}
+
+// The trace records the tasks the queue is done with, whether they completed or were canceled
+// while queued or executing, up to `max_trace_tasks`.
+static void test_trace(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    stub_backend_o stub = { .hold = 1 };
+    tm_renderer_backend_i backend;
+    stub_backend_init(&stub, a, &backend);
+    test_context_t ctx = { .stub = &stub };
+
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .max_simultaneous_tasks = 1, .max_trace_tasks = 3 });
+
+    test_task_t tasks[4];
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i) {
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 };
+        mag_async_gpu_queue_task_params_t params = test_task_params(tasks + i, i);
+        params.num_dispatches = 10 + i;
+        tasks[i].id = queue_api.submit_task(q, &params);
+        if (!i)
+            TM_UNIT_TEST(tr, test_wait_for(&tasks[0].launched, 1));
+    }
+
+    // The first task is canceled while executing and the second one while queued.
+    queue_api.cancel_task(q, tasks[0].id);
+    queue_api.cancel_task(q, tasks[1].id);
+    tasks[0].cancel_requested = tasks[1].cancel_requested = true;
+    atomic_exchange_uint32_t(&stub.hold, 0);
+    TM_UNIT_TEST(tr, test_drain(q, tasks, TM_ARRAY_COUNT(tasks), 2));
+    TM_UNIT_TEST(tr, test_wait_for(&tasks[0].completed, 1));
+
+    TM_UNIT_TEST(tr, test_load(&q->num_trace_events) >= q->max_trace_events);
+    uint32_t num_events = 0;
+    for (const trace_event_t *e = q->trace_events; e != q->trace_events + q->max_trace_events; ++e) {
+        TM_UNIT_TEST(tr, test_load(&e->written));
+        const test_task_t *task = 0;
+        for (uint32_t i = 0; i < TM_ARRAY_COUNT(tasks); ++i) {
+            if (tasks[i].id == e->task_id)
+                task = tasks + i;
+        }
+        if (!TM_UNIT_TEST(tr, task))
+            continue;
+        const uint32_t i = (uint32_t)(task - tasks);
+        TM_UNIT_TESTF(tr, e->lane == 0 && e->num_dispatches == 10 + i, "trace event of task %u", i);
+        TM_UNIT_TESTF(tr, e->canceled == task->cancel_requested, "trace event of task %u", i);
+        // Only the task canceled while queued never launched.
+        TM_UNIT_TESTF(tr, !e->launch_time.opaque == (i == 1), "trace event of task %u", i);
+        ++num_events;
+    }
+    TM_UNIT_TEST(tr, num_events == 3);
+
+    queue_api.destroy(q);
+    stub_backend_shutdown(&stub, a);
+}
+
+typedef struct stress_producer_t
+{
+    mag_async_gpu_queue_o *q;
+    test_task_t *tasks;
+    uint32_t seed;
+    uint32_t num_lanes;
+    bool batches;
+    TM_PAD(7);
+} stress_producer_t;
+
+static uint32_t stress_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Checks the tasks that aren't canceled or confirmed yet. Returns the number still pending.
+static uint32_t stress_confirm(mag_async_gpu_queue_o *q, test_task_t *tasks, uint32_t n)
+{
+    uint32_t num_pending = 0;
+    for (test_task_t *task = tasks; task != tasks + n; ++task) {
+        // Dependents are only canceled by the producer's own cancel_task() calls, so the counter is
+        // up to date.
+        if (task->cancel_requested || task->confirmed || test_load(&task->canceled))
+            continue;
+        if (queue_api.is_task_done(q, task->id))
+            task->confirmed = true;
+        else
+            ++num_pending;
+    }
+    return num_pending;
+}
+
+// Submits, reprioritises and cancels random tasks, some of them with a prerequisite among the
+// earlier ones, then waits for the rest to be done.
+static void stress_producer(void *data)
+{
+    stress_producer_t *p = data;
+    mag_async_gpu_queue_o *q = p->q;
+    test_task_t *tasks = p->tasks;
+    uint32_t *s = &p->seed;
+
+    for (uint32_t i = 0; i < STRESS_TASKS_PER_PRODUCER;) {
+        const uint32_t batch_size = p->batches ? 1 + stress_random(s) % STRESS_MAX_BATCH : 1;
+        const uint32_t n = tm_min(batch_size, STRESS_TASKS_PER_PRODUCER - i);
+        mag_async_gpu_queue_task_params_t params[STRESS_MAX_BATCH];
+        uint64_t ids[STRESS_MAX_BATCH];
+        for (uint32_t k = 0; k < n; ++k) {
+            params[k] = test_task_params(tasks + i + k, stress_random(s) % 1000);
+            params[k].lane = stress_random(s) % p->num_lanes;
+            params[k].num_dispatches = 1 + stress_random(s) % 8;
+
+            // Prerequisites that were confirmed are avoided, as they count as canceled once their
+            // slot has been reused enough times.
+            const test_task_t *prerequisite = i && stress_random(s) % 4 == 0 ? tasks + stress_random(s) % i : 0;
+            if (prerequisite && !prerequisite->confirmed) {
+                params[k].prerequisites = &prerequisite->id;
+                params[k].num_prerequisites = 1;
+                tasks[i + k].prerequisite = prerequisite;
+            }
+        }
+        queue_api.submit_tasks(q, params, n, ids);
+        for (uint32_t k = 0; k < n; ++k)
+            tasks[i + k].id = ids[k];
+        i += n;
+
+        if (p->batches) {
+            uint64_t priorities[16];
+            for (uint32_t k = 0; k < TM_ARRAY_COUNT(priorities); ++k) {
+                ids[k] = tasks[stress_random(s) % i].id;
+                priorities[k] = stress_random(s) % 1000;
+            }
+            queue_api.update_priorities(q, ids, priorities, TM_ARRAY_COUNT(priorities));
+        } else if (stress_random(s) % 4 == 0) {
+            queue_api.update_task_priority(q, tasks[stress_random(s) % i].id, stress_random(s) % 1000);
+        }
+
+        if (stress_random(s) % 5 == 0) {
+            test_task_t *task = tasks + stress_random(s) % i;
+            if (!task->cancel_requested && !task->confirmed) {
+                task->cancel_requested = true;
+                queue_api.cancel_task(q, task->id);
+            }
+        }
+
+        if (i % 256 < n)
+            stress_confirm(q, tasks, i);
+    }
+
+    while (stress_confirm(q, tasks, STRESS_TASKS_PER_PRODUCER))
+        tm_os_api->thread->sleep(0.0001);
+}
+
+// Runs producer threads against the queue and checks that every task was either canceled or
+// confirmed exactly once, and that the queue read all the fences. Records a trace of up to
+// `max_trace_tasks` tasks, if set.
+static void stress(tm_unit_test_runner_i *tr, tm_allocator_i *a, stub_backend_o *stub, const char *name, uint32_t max_trace_tasks)
+{
+    tm_renderer_backend_i backend;
+    stub_backend_init(stub, a, &backend);
+    test_context_t ctx = { .stub = stub };
+
+    const mag_async_gpu_queue_lane_params_t lanes[] = {
+        { .name = "near", .max_simultaneous_tasks = 4, .own_thread = true },
+        { .name = "far", .max_simultaneous_tasks = 4, .can_borrow = true },
+        { .name = "readback", .max_simultaneous_tasks = 2, .can_borrow = true },
+    };
+    mag_async_gpu_queue_o *q = queue_api.create(a, &backend, &(mag_async_gpu_queue_params_t) { .num_lanes = TM_ARRAY_COUNT(lanes), .lanes = lanes, .max_trace_tasks = max_trace_tasks });
+
+    const uint32_t num_tasks = STRESS_NUM_PRODUCERS * STRESS_TASKS_PER_PRODUCER;
+    test_task_t *tasks = tm_alloc(a, num_tasks * sizeof(test_task_t));
+    for (uint32_t i = 0; i < num_tasks; ++i)
+        tasks[i] = (test_task_t) { .ctx = &ctx, .num_fences = 1 + i % 3 };
+
+    stress_producer_t producers[STRESS_NUM_PRODUCERS];
+    tm_thread_o threads[STRESS_NUM_PRODUCERS];
+    const tm_clock_o start = tm_os_api->time->now();
+    for (uint32_t i = 0; i < STRESS_NUM_PRODUCERS; ++i) {
+        producers[i] = (stress_producer_t) {
+            .q = q,
+            .tasks = tasks + i * STRESS_TASKS_PER_PRODUCER,
+            .seed = 1234 + i,
+            .num_lanes = TM_ARRAY_COUNT(lanes),
+            .batches = i & 1,
+        };
+        threads[i] = tm_os_api->thread->create_thread(stress_producer, producers + i, THREAD_STACK_SIZE, "mag_async_gpu_queue stress");
+    }
+    for (uint32_t i = 0; i < STRESS_NUM_PRODUCERS; ++i)
+        tm_os_api->thread->wait_for_thread(threads[i]);
+    const double seconds = tm_os_api->time->delta(tm_os_api->time->now(), start);
+
+    // The events were taken from the slots before they could be reused.
+    uint32_t num_bad_events = 0;
+    for (const trace_event_t *e = q->trace_events; e != q->trace_events + max_trace_tasks; ++e) {
+        const bool launched = e->launch_time.opaque;
+        num_bad_events += !test_load(&e->written) || e->lane >= TM_ARRAY_COUNT(lanes) || e->num_dispatches < 1 || e->num_dispatches > 8 || (!launched && !e->canceled);
+    }
+    TM_UNIT_TESTF(tr, !num_bad_events, "%s: %u bad trace events", name, num_bad_events);
+
+    queue_api.destroy(q);
+
+    uint32_t num_bad = 0;
+    uint32_t num_canceled = 0;
+    for (const test_task_t *task = tasks; task != tasks + num_tasks; ++task) {
+        const uint32_t canceled = atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&task->canceled, 0);
+        const uint32_t completed = atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&task->completed, 0);
+        const uint32_t launched = atomic_fetch_add_uint32_t((atomic_uint_least32_t *)&task->launched, 0);
+        // Tasks are either confirmed, or canceled by the producer or with their prerequisite.
+        const test_task_t *prerequisite = task->prerequisite;
+        const bool canceled_with_prerequisite = canceled && prerequisite && (prerequisite->cancel_requested || test_load(&prerequisite->canceled));
+        const bool ok = canceled + completed == 1 && launched == completed && (task->confirmed ? !task->cancel_requested : task->cancel_requested || canceled_with_prerequisite);
+        num_bad += !ok;
+        num_canceled += canceled;
+    }
+    TM_UNIT_TESTF(tr, !num_bad, "%s: %u tasks not canceled or confirmed exactly once", name, num_bad);
+    TM_UNIT_TEST(tr, atomic_fetch_add_uint32_t(&stub->num_fences, 0) < STUB_MAX_FENCES);
+    TM_UNIT_TESTF(tr, atomic_fetch_add_uint32_t(&stub->num_fences_read, 0) == atomic_fetch_add_uint32_t(&stub->num_fences, 0), "%s: leaked fences", name);
+    TM_UNIT_TEST(tr, !atomic_fetch_add_uint32_t(&stub->num_fences_read_twice, 0));
+    TM_UNIT_TESTF(tr, !test_load(&ctx.num_early_launches), "%s: tasks launched before their prerequisite completed", name);
+
+    TM_LOG("mag_async_gpu_queue stress (%s): %u tasks, %u canceled, %u fences in %.2f s, %.0f tasks/s", name, num_tasks, num_canceled, atomic_fetch_add_uint32_t(&stub->num_fences, 0), seconds, num_tasks / seconds);
+
+    tm_free(a, tasks, num_tasks * sizeof(test_task_t));
+    stub_backend_shutdown(stub, a);
+}
+
+static void unit_test_async_gpu_queue(tm_unit_test_runner_i *tr, tm_allocator_i *a)
+{
+    test_priorities(tr, a);
+    test_cancel(tr, a);
+    test_lanes_and_budget(tr, a);
+    test_prerequisites(tr, a);
+    test_update_priority_of_dependent(tr, a);
+    test_trace(tr, a);
+
+    stress(tr, a, &(stub_backend_o) { .jitter_ns = 200000 }, "delayed fences", 0);
+    stress(tr, a, &(stub_backend_o) { .signal_probability = 0.25 }, "random fences", STRESS_NUM_PRODUCERS * STRESS_TASKS_PER_PRODUCER / 2);
+}
+
+static tm_unit_test_i *mag_async_gpu_queue_tests = &(tm_unit_test_i) {
+    .name = "mag_async_gpu_queue",
+    .test = unit_test_async_gpu_queue
+};
@@ -84,6 +84,17 @@ static struct mag_async_gpu_queue_api *mag_async_gpu_queue_api;
 #include "plugins/mag_voxel/mag_voxel.h"
 
 #define MAX_ASYNC_GPU_TASKS 10
+// Per-frame budgets of the async gpu queue. Keeps many regions from completing, and being read
+// back, in the same frame.
+#define GPU_TIME_BUDGET_PER_FRAME_NS 2000000
+#define READBACK_BYTES_BUDGET_PER_FRAME (4 * 1024 * 1024)
+// Set to the number of async gpu queue tasks to record. The recorded tasks are written to
+// GPU_QUEUE_TRACE_PATH as a Chrome trace when the terrain is destroyed.
+#define GPU_QUEUE_TRACE_TASKS 0
+#define GPU_QUEUE_TRACE_PATH "magnum_gpu_queue_trace.json"
+// Regions of these LODs are generated in their own lane of the async gpu queue, so that they don't
+// wait behind the backlog of far LODs.
+#define NUM_NEAR_LODS 1
 // TODO: compute this
 #define MAX_REGIONS_PER_OP 30
 #define MAX_TASK_BUFFERS (MAX_ASYNC_GPU_TASKS + MAX_REGIONS_PER_OP)
@@ -215,6 +226,19 @@ static inline tm_vec3_t region_center(const region_data_t *region_data)
     };
 }
 
+enum gpu_lane {
+    GPU_LANE_NEAR_LODS,
+    GPU_LANE_FAR_LODS,
+    GPU_LANE_PHYSICS_READBACK,
+};
+
+// The limits add up to MAX_ASYNC_GPU_TASKS, which the task buffers are sized for.
+static const mag_async_gpu_queue_lane_params_t GPU_LANES[] = {
+    [GPU_LANE_NEAR_LODS] = { .name = "near LODs", .max_simultaneous_tasks = 4, .device_affinity_mask = TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, .can_borrow = true },
+    [GPU_LANE_FAR_LODS] = { .name = "far LODs", .max_simultaneous_tasks = 4, .device_affinity_mask = TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, .can_borrow = true },
+    [GPU_LANE_PHYSICS_READBACK] = { .name = "physics readback", .max_simultaneous_tasks = 2, .device_affinity_mask = TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, .can_borrow = true },
+};
+
 static inline uint64_t region_priority(const region_data_t *region_data, const tm_vec3_t *camera_pos)
 {
     uint64_t prev_lod_bits = 0;
@@ -284,6 +308,10 @@ typedef struct mag_terrain_component_buffers_t
     uint32_t gen_region_task_buffers_id;
     uint32_t read_mesh_task_buffers_id;
 
+    // Generate and read mesh tasks in the gpu queue that haven't called their cancel or
+    // completion callback yet.
+    atomic_uint_least32_t num_gpu_tasks;
+
     tm_shader_resource_binder_instance_t region_contouring_rbinder;
     tm_shader_constant_buffer_instance_t region_contouring_cbuf;
 } mag_terrain_component_buffers_t;
@@ -385,6 +413,8 @@ typedef struct mag_terrain_component_manager_o
     op_t *last_empty_check_op;
 
     mag_async_gpu_queue_o *gpu_queue;
+    // IDs of gpu queue tasks that completed, but haven't been handled yet
+    tm_set_t completed_gpu_tasks;
 
     atomic_uint_least32_t region_task_buffers_locks[MAX_TASK_BUFFERS];
     region_task_buffers_t region_task_buffers[MAX_TASK_BUFFERS];
@@ -1128,21 +1158,45 @@ static void destroy_mesh(mag_terrain_component_buffers_t *c, tm_renderer_resourc
     }
 }
 
+static void receive_completed_gpu_tasks(mag_terrain_component_manager_o *man)
+{
+    uint64_t task_ids[256];
+    uint32_t n;
+    while ((n = mag_async_gpu_queue_api->drain_completed(man->gpu_queue, task_ids, TM_ARRAY_COUNT(task_ids)))) {
+        for (uint32_t i = 0; i < n; ++i)
+            tm_set_add(&man->completed_gpu_tasks, task_ids[i]);
+    }
+}
+
+// Returns true once the gpu queue task is done. Only sees the completions received by
+// receive_completed_gpu_tasks().
+static bool gpu_task_done(mag_terrain_component_manager_o *man, uint64_t task_id)
+{
+    if (!tm_set_has(&man->completed_gpu_tasks, task_id))
+        return false;
+    tm_set_remove(&man->completed_gpu_tasks, task_id);
+    return true;
+}
+
 static void remove(tm_component_manager_o *manager, struct tm_entity_commands_o *commands, tm_entity_t e, void *data)
 {
     mag_terrain_component_t *c = data;
     mag_terrain_component_manager_o *man = (mag_terrain_component_manager_o *)manager;
 
+    // Queued tasks are canceled right away. Executing ones use the buffers until their completion
+    // callbacks have run, which doesn't wait for the per-frame budgets of the queue.
     if (c->generate_task_id) {
-        while (!mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->generate_task_id))
-            ;
+        mag_async_gpu_queue_api->cancel_task(man->gpu_queue, c->generate_task_id);
+        tm_set_remove(&man->completed_gpu_tasks, c->generate_task_id);
     }
-
     if (c->read_mesh_task_id) {
-        while (!mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->read_mesh_task_id))
-            ;
-        RELEASE_BUFFERS(man->read_mesh_task_buffers_locks, c->buffers->read_mesh_task_buffers_id);
+        mag_async_gpu_queue_api->cancel_task(man->gpu_queue, c->read_mesh_task_id);
+        tm_set_remove(&man->completed_gpu_tasks, c->read_mesh_task_id);
     }
+    while (atomic_fetch_add_uint32_t(&c->buffers->num_gpu_tasks, 0))
+        tm_os_api->thread->yield_processor();
+    if (c->buffers->read_mesh_task_buffers_id)
+        RELEASE_BUFFERS(man->read_mesh_task_buffers_locks, c->buffers->read_mesh_task_buffers_id);
 
     tm_renderer_resource_command_buffer_o *res_buf;
     man->backend->create_resource_command_buffers(man->backend->inst, &res_buf, 1);
@@ -1200,11 +1254,14 @@ static void destroy(tm_component_manager_o *manager)
     free_terrain_settings(man, tm_entity_api->the_truth(man->ctx));
 
     if (!tm_entity_api->get_blackboard_double(man->ctx, TM_ENTITY_BB__EDITOR, 0)) {
+        if (GPU_QUEUE_TRACE_TASKS)
+            mag_async_gpu_queue_api->write_trace(man->gpu_queue, GPU_QUEUE_TRACE_PATH);
         mag_async_gpu_queue_api->destroy(man->gpu_queue);
 
         tm_slab_destroy(man->ops);
         tm_hash_free(&man->component_map);
         tm_set_free(&man->empty_regions);
+        tm_set_free(&man->completed_gpu_tasks);
 
         tm_renderer_resource_command_buffer_o *res_buf;
         man->backend->create_resource_command_buffers(man->backend->inst, &res_buf, 1);
@@ -1266,10 +1323,15 @@ static void create_mag_terrain_component(tm_entity_context_o *ctx)
     if (!tm_entity_api->get_blackboard_double(ctx, TM_ENTITY_BB__EDITOR, 0)) {
         manager->component_map.allocator = &manager->allocator;
         manager->empty_regions.allocator = &manager->allocator;
+        manager->completed_gpu_tasks.allocator = &manager->allocator;
 
         mag_async_gpu_queue_params_t params = {
-            .max_simultaneous_tasks = MAX_ASYNC_GPU_TASKS,
-            .device_affinity_mask = TM_RENDERER_DEVICE_AFFINITY_MASK_ALL,
+            .name = "magnum/gpu_queue",
+            .num_lanes = TM_ARRAY_COUNT(GPU_LANES),
+            .lanes = GPU_LANES,
+            .gpu_time_budget_per_frame_ns = GPU_TIME_BUDGET_PER_FRAME_NS,
+            .readback_bytes_budget_per_frame = READBACK_BYTES_BUDGET_PER_FRAME,
+            .max_trace_tasks = GPU_QUEUE_TRACE_TASKS,
         };
         manager->gpu_queue = mag_async_gpu_queue_api->create(&manager->allocator, backend, &params);
         tm_slab_create(&manager->ops, &manager->allocator, 64 * 1024);
@@ -1410,6 +1472,62 @@ static void generate_region_gpu(tm_renderer_command_buffer_o *cmd_buf, tm_render
     generate_mesh(man, task_buffers, c, region_data, cmd_buf, res_buf, sort_key);
 }
 
+// Bounds of the ops sorted by `min.x`, so that the ops that overlap a region are found without
+// testing all of them. Built once for all the regions submitted in a frame.
+typedef struct op_bounds_t
+{
+    /* carray */ aabb_t *aabbs;
+    // Largest size of an op along x.
+    float max_size_x;
+    TM_PAD(4);
+} op_bounds_t;
+
+static int compare_aabb_min_x(const void *a, const void *b)
+{
+    const float ax = ((const aabb_t *)a)->min.x, bx = ((const aabb_t *)b)->min.x;
+    return ax < bx ? -1 : ax > bx ? 1
+                                  : 0;
+}
+
+static op_bounds_t sorted_op_bounds(const op_t *ops, const op_t *last_op, tm_temp_allocator_i *ta)
+{
+    op_bounds_t bounds = { 0 };
+    for (const op_t *op = ops; op != last_op; op = tm_slab_next(op)) {
+        if (!tm_slab_is_valid(op))
+            continue;
+        const aabb_t aabb = op_aabb(op);
+        tm_carray_temp_push(bounds.aabbs, aabb, ta);
+        bounds.max_size_x = max(bounds.max_size_x, aabb.max.x - aabb.min.x);
+    }
+    qsort(bounds.aabbs, tm_carray_size(bounds.aabbs), sizeof(*bounds.aabbs), compare_aabb_min_x);
+    return bounds;
+}
+
+// Returns the number of compute dispatches generate_region_gpu() records for the region.
+static uint32_t generate_region_dispatch_count(const region_data_t *region_data, const op_bounds_t *op_bounds)
+{
+    // sdf, octree creation, collapse of each level but the last, contouring
+    uint32_t n = 1 + 1 + (OCTREE_DEPTH - 1) + 1;
+    const aabb_t region_aabb = region_aabb_with_margin(region_data);
+
+    // Skips the ops that end before the region along x.
+    const float first_min_x = region_aabb.min.x - op_bounds->max_size_x;
+    uint64_t first = 0, last = tm_carray_size(op_bounds->aabbs);
+    while (first < last) {
+        const uint64_t mid = (first + last) / 2;
+        if (op_bounds->aabbs[mid].min.x < first_min_x)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+
+    for (const aabb_t *aabb = op_bounds->aabbs + first; aabb != tm_carray_end(op_bounds->aabbs) && aabb->min.x <= region_aabb.max.x; ++aabb) {
+        if (aabb_intersect(&region_aabb, aabb))
+            ++n;
+    }
+    return n;
+}
+
 static uint32_t bounding_volume_type(struct tm_component_manager_o *manager)
 {
     return TM_BOUNDING_VOLUME_TYPE_BOX;
@@ -1457,6 +1575,7 @@ static void fill_bounding_volume_buffer(struct tm_component_manager_o *manager,
 static void free_read_mesh_task_data(void *data)
 {
     read_mesh_task_data_t *task_data = (read_mesh_task_data_t *)data;
+    atomic_fetch_sub_uint32_t(&task_data->c->num_gpu_tasks, 1);
     tm_free(&task_data->man->allocator, task_data, sizeof(*task_data));
 }
 
@@ -1480,7 +1599,11 @@ static void handle_generate_task_completion(mag_terrain_component_manager_o *man
             .cancel_callback = free_read_mesh_task_data,
             .completion_callback = free_read_mesh_task_data,
             .priority = 0,
+            .lane = GPU_LANE_PHYSICS_READBACK,
+            .num_dispatches = 1,
+            .readback_bytes = component->buffers->region_info.num_vertices * sizeof(tm_vec3_t) + component->buffers->region_info.num_indices * sizeof(uint16_t),
         };
+        atomic_fetch_add_uint32_t(&component->buffers->num_gpu_tasks, 1);
         component->read_mesh_task_id = mag_async_gpu_queue_api->submit_task(man->gpu_queue, &params);
     }
 }
@@ -1946,6 +2069,7 @@ static bool needs_sculpting(const region_data_t *region_data, tm_vec3_t camera_p
 static void generate_region_cancel(void *data)
 {
     generate_region_task_data_t *task_data = (generate_region_task_data_t *)data;
+    atomic_fetch_sub_uint32_t(&task_data->c->num_gpu_tasks, 1);
     tm_free(&task_data->man->allocator, task_data, sizeof(*task_data));
 }
 
@@ -1953,6 +2077,7 @@ static void generate_region_complete(void *data)
 {
     generate_region_task_data_t *task_data = (generate_region_task_data_t *)data;
     RELEASE_BUFFERS(task_data->man->region_task_buffers_locks, task_data->c->gen_region_task_buffers_id);
+    atomic_fetch_sub_uint32_t(&task_data->c->num_gpu_tasks, 1);
     tm_free(&task_data->man->allocator, task_data, sizeof(*task_data));
 }
 
@@ -2021,6 +2146,9 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
 
     // TODO: split to multiple cache-efficient components depending on the region state
 
+    mag_async_gpu_queue_api->begin_frame(man->gpu_queue);
+    receive_completed_gpu_tasks(man);
+
     tm_renderer_command_buffer_o *cmd_buf;
     man->backend->create_command_buffers(man->backend->inst, &cmd_buf, 1);
     tm_renderer_resource_command_buffer_o *res_buf;
@@ -2028,8 +2156,6 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
     tm_renderer_resource_command_buffer_o *post_res_buf;
     man->backend->create_resource_command_buffers(man->backend->inst, &post_res_buf, 1);
 
-    // TODO: batch operations on the async gpu queue
-
     uint32_t total_components = 0;
     for (tm_engine_update_array_t *a = data->arrays; a < data->arrays + data->num_arrays; ++a) {
         total_components += a->n;
@@ -2092,7 +2218,7 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
                 }
             }
             if (existing) {
-                if (c->generate_task_id && mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->generate_task_id)) {
+                if (c->generate_task_id && gpu_task_done(man, c->generate_task_id)) {
                     handle_generate_task_completion(man, c, res_buf);
                     if (c->buffers->region_info.num_indices || needs_sculpting(&c->region_data, camera_transform->pos)) {
                         mag_terrain_component_state_t state = {
@@ -2111,7 +2237,7 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
                     c->region_data.key = 0;
                 }
 
-                if (c->read_mesh_task_id && mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->read_mesh_task_id)) {
+                if (c->read_mesh_task_id && gpu_task_done(man, c->read_mesh_task_id)) {
                     c->read_mesh_task_id = 0;
                     // TODO: sort by lod, so that near lods are generated first
                     start_physics_task(man, c, NULL);
@@ -2165,11 +2291,11 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
             } else {
                 // TM_LOG("discarding region: (%f, %f, %f) cell size %f, key %llu", c->region_data.pos.x, c->region_data.pos.y, c->region_data.pos.z, c->region_data.cell_size, c->region_data.key);
                 // TODO: think of how to cancel this safely
-                if (c->generate_task_id && mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->generate_task_id)) {
+                if (c->generate_task_id && gpu_task_done(man, c->generate_task_id)) {
                     c->generate_task_id = 0;
                     c->color_rgba.w = 0.f;
                 }
-                if (c->read_mesh_task_id && mag_async_gpu_queue_api->is_task_done(man->gpu_queue, c->read_mesh_task_id)) {
+                if (c->read_mesh_task_id && gpu_task_done(man, c->read_mesh_task_id)) {
                     RELEASE_BUFFERS(man->read_mesh_task_buffers_locks, c->buffers->read_mesh_task_buffers_id);
                     c->read_mesh_task_id = 0;
                 }
@@ -2195,6 +2321,13 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
         }
     }
 
+    // New regions are submitted to the async gpu queue as a single batch.
+    mag_terrain_component_t **submitted_components = 0;
+    mag_async_gpu_queue_task_params_t *submitted_tasks = 0;
+    // All the regions of the batch are generated with the same ops.
+    op_bounds_t op_bounds = { 0 };
+    bool has_op_bounds = false;
+
     for (uint32_t i = 0; i < alive_regions.num_buckets; ++i) {
         if (tm_hash_skip_index(&alive_regions, i))
             continue;
@@ -2230,6 +2363,10 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
             };
 
             c->last_task_op = task_data->ops_end;
+            if (!has_op_bounds) {
+                op_bounds = sorted_op_bounds(man->ops, task_data->ops_end, ta);
+                has_op_bounds = true;
+            }
 
             mag_async_gpu_queue_task_params_t params = {
                 .f = generate_region_task,
@@ -2237,18 +2374,31 @@ static void engine__update_terrain(tm_engine_o *inst, tm_engine_update_set_t *da
                 .cancel_callback = generate_region_cancel,
                 .completion_callback = generate_region_complete,
                 .priority = region_priority(&c->region_data, &camera_transform->pos),
+                .lane = c->region_data.lod < NUM_NEAR_LODS ? GPU_LANE_NEAR_LODS : GPU_LANE_FAR_LODS,
+                .num_dispatches = generate_region_dispatch_count(&c->region_data, &op_bounds),
+                .readback_bytes = sizeof(gpu_region_info_t),
             };
-            c->generate_task_id = mag_async_gpu_queue_api->submit_task(man->gpu_queue, &params);
-
-            mag_terrain_component_state_t state = {
-                .generate_task_id = c->generate_task_id,
-                .buffers = c->buffers,
-            };
-            tm_hash_add(&man->component_map, c->region_data.key, state);
+            atomic_fetch_add_uint32_t(&c->buffers->num_gpu_tasks, 1);
+            tm_carray_temp_push(submitted_components, c, ta);
+            tm_carray_temp_push(submitted_tasks, params, ta);
         }
         ++active_task_count;
     }
 
+    const uint32_t num_submitted = (uint32_t)tm_carray_size(submitted_tasks);
+    uint64_t *submitted_task_ids = tm_temp_alloc(ta, num_submitted * sizeof(uint64_t));
+    mag_async_gpu_queue_api->submit_tasks(man->gpu_queue, submitted_tasks, num_submitted, submitted_task_ids);
+    for (uint32_t i = 0; i < num_submitted; ++i) {
+        mag_terrain_component_t *c = submitted_components[i];
+        c->generate_task_id = submitted_task_ids[i];
+
+        mag_terrain_component_state_t state = {
+            .generate_task_id = c->generate_task_id,
+            .buffers = c->buffers,
+        };
+        tm_hash_add(&man->component_map, c->region_data.key, state);
+    }
+
     man->backend->submit_resource_command_buffers(man->backend->inst, &res_buf, 1);
     man->backend->destroy_resource_command_buffers(man->backend->inst, &res_buf, 1);
     man->backend->submit_command_buffers(man->backend->inst, &cmd_buf, 1);
@@ -1,4 +1,5 @@
 static struct tm_error_api *tm_error_api;
+static struct tm_os_api *tm_os_api;
 
 #include "mag_voxel.h"
 
@@ -6,8 +7,11 @@ static struct tm_error_api *tm_error_api;
 #include <foundation/api_registry.h>
 #include <foundation/api_type_hashes.h>
 #include <foundation/error.h>
+#include <foundation/job_system.h>
+#include <foundation/os.h>
 #include <foundation/unit_test.h>
 
+#include <foundation/atomics.inl>
 #include <foundation/carray.inl>
 #include <foundation/hash.inl>
 #include <foundation/math.inl>
@@ -19,14 +23,33 @@ static struct tm_error_api *tm_error_api;
 #include <plugins/renderer/resources.h>
 #include <plugins/shader_system/shader_system.h>
 
-#define tm_hash_get_ptr(h, key) ((h)->values + tm_hash_index(h, key))
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+
+#include <float.h>
 
 static struct tm_shader_api *tm_shader_api;
 static struct tm_renderer_api *tm_renderer_api;
 static struct tm_temp_allocator_api *tm_temp_allocator_api;
+static struct tm_job_system_api *tm_job_system_api;
 
 #define ADAPT(v0, v1) (-v0 / (v1 - v0))
 
+// Clamps a vertex to its cell and moves it from sample coordinates to region coordinates.
+static inline tm_vec3_t cell_vertex_to_region(tm_vec3_t c, float x, float y, float z)
+{
+    c = tm_vec3_clamp(c, (tm_vec3_t) { x, y, z }, (tm_vec3_t) { x + 1, y + 1, z + 1 });
+
+    c.x -= (float)MAG_VOXEL_MARGIN;
+    c.y -= (float)MAG_VOXEL_MARGIN;
+    c.z -= (float)MAG_VOXEL_MARGIN;
+
+    return c;
+}
+
 static tm_vec3_t find_vertex(float x, float y, float z, tm_vec3_t p[12], tm_vec3_t n[12], int count, float corner_signs[8])
 {
     // Based on https://www.inf.ufrgs.br/~comba/papers/thesis/diss-leonardo.pdf
@@ -78,19 +101,188 @@ static tm_vec3_t find_vertex(float x, float y, float z, tm_vec3_t p[12], tm_vec3
         c = tm_vec3_add(c, tm_vec3_mul(f_total, 0.05f));
     }
 
-    c = tm_vec3_clamp(c, (tm_vec3_t) { x, y, z }, (tm_vec3_t) { x + 1, y + 1, z + 1 });
+    return cell_vertex_to_region(c, x, y, z);
+}
 
-    c.x -= (float)MAG_VOXEL_MARGIN;
-    c.y -= (float)MAG_VOXEL_MARGIN;
-    c.z -= (float)MAG_VOXEL_MARGIN;
+// Fixed number of Jacobi sweeps, so the QEF solve has a predictable cost. Three or four sweeps
+// are enough to converge for a 3x3 matrix, the rest are skipped by the early out.
+#define QEF_MAX_SWEEPS 5
+// Eigenvalues smaller than this fraction of the largest one are dropped from the pseudo-inverse,
+// same as in `magnum_linalg.tmsl`.
+#define QEF_EIGENVALUE_THRESHOLD 0.1f
 
-    return c;
+// Applies the Jacobi rotation that zeroes `a[p][q]` to the symmetric matrix `a` and accumulates
+// it into `v`.
+static void jacobi_rotate(float a[3][3], float v[3][3], int p, int q)
+{
+    if (a[p][q] == 0.f)
+        return;
+
+    // Explanation in Numerical Recipies in C, Second Edition, page 463
+    const float theta = (a[q][q] - a[p][p]) / (2.f * a[p][q]);
+    const float t = (theta >= 0.f ? 1.f : -1.f) / (fabsf(theta) + sqrtf(theta * theta + 1.f));
+    const float c = 1.f / sqrtf(t * t + 1.f);
+    const float s = t * c;
+
+    for (int k = 0; k < 3; ++k) {
+        const float akp = a[k][p], akq = a[k][q];
+        a[k][p] = c * akp - s * akq;
+        a[k][q] = s * akp + c * akq;
+    }
+    for (int k = 0; k < 3; ++k) {
+        const float apk = a[p][k], aqk = a[q][k];
+        a[p][k] = c * apk - s * aqk;
+        a[q][k] = s * apk + c * aqk;
+    }
+    for (int k = 0; k < 3; ++k) {
+        const float vkp = v[k][p], vkq = v[k][q];
+        v[k][p] = c * vkp - s * vkq;
+        v[k][q] = s * vkp + c * vkq;
+    }
+}
+
+// Solves `a * x = b` for the symmetric positive semi-definite `a` with a truncated
+// pseudo-inverse. Directions the planes don't constrain are left at zero.
+static tm_vec3_t qef_solve(float a[3][3], const float b[3])
+{
+    float v[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+    for (int sweep = 0; sweep < QEF_MAX_SWEEPS; ++sweep) {
+        if (fabsf(a[0][1]) + fabsf(a[0][2]) + fabsf(a[1][2]) <= 1e-6f * (fabsf(a[0][0]) + fabsf(a[1][1]) + fabsf(a[2][2])))
+            break;
+        jacobi_rotate(a, v, 0, 1);
+        jacobi_rotate(a, v, 0, 2);
+        jacobi_rotate(a, v, 1, 2);
+    }
+
+    const float max_eigenvalue = fmaxf(fmaxf(fabsf(a[0][0]), fabsf(a[1][1])), fabsf(a[2][2]));
+    if (max_eigenvalue == 0.f)
+        return (tm_vec3_t) { 0 };
+
+    // x = V * E^-1 * V^T * b
+    float x[3] = { 0 };
+    for (int i = 0; i < 3; ++i) {
+        const float e = fabsf(a[i][i]);
+        if (e < QEF_EIGENVALUE_THRESHOLD * max_eigenvalue)
+            continue;
+        const float vtb = (v[0][i] * b[0] + v[1][i] * b[1] + v[2][i] * b[2]) / e;
+        for (int k = 0; k < 3; ++k)
+            x[k] += v[k][i] * vtb;
+    }
+    return (tm_vec3_t) { x[0], x[1], x[2] };
+}
+
+// Places the vertex at the minimizer of the quadratic error to the tangent planes. The system is
+// solved relative to the mass point of the intersections, so that the directions that are not
+// constrained keep the vertex at the mass point.
+static tm_vec3_t find_vertex_qef(float x, float y, float z, tm_vec3_t p[12], tm_vec3_t n[12], int count)
+{
+    tm_vec3_t c = { 0 };
+    float one_to_n = 1.f / (float)count;
+    for (int i = 0; i < count; i++) {
+        c = tm_vec3_add(c, tm_vec3_mul(p[i], one_to_n));
+    }
+
+    // A^T A and A^T b, where the rows of A are the normals
+    float ata[3][3] = { 0 };
+    float atb[3] = { 0 };
+    for (int i = 0; i < count; i++) {
+        const float ni[3] = { n[i].x, n[i].y, n[i].z };
+        const float d = tm_vec3_dot(n[i], tm_vec3_sub(p[i], c));
+        for (int r = 0; r < 3; ++r) {
+            for (int k = r; k < 3; ++k)
+                ata[r][k] += ni[r] * ni[k];
+            atb[r] += ni[r] * d;
+        }
+    }
+    ata[1][0] = ata[0][1];
+    ata[2][0] = ata[0][2];
+    ata[2][1] = ata[1][2];
+
+    c = tm_vec3_add(c, qef_solve(ata, atb));
+    return cell_vertex_to_region(c, x, y, z);
+}
+
+// Supported memory layouts of the region data.
+typedef enum region_layout_t {
+    REGION_LAYOUT_AOS,
+    REGION_LAYOUT_SOA,
+    REGION_LAYOUT_SOA16,
+} region_layout_t;
+
+// Densities and normals at the corners of a cell, indexed by dx * 4 + dy * 2 + dz.
+typedef struct cell_corners_t
+{
+    float densities[8];
+    tm_vec3_t normals[8];
+} cell_corners_t;
+
+// Read-only view of a region in one of the supported layouts.
+typedef struct region_view_t
+{
+    region_layout_t layout;
+    union
+    {
+        const mag_voxel_region_t *aos;
+        const mag_voxel_soa_region_t *soa;
+        const mag_voxel_soa16_region_t *soa16;
+    };
+    // Reads the corners of the cell at (x, y, z). Picked for the layout by [[region_view()]], so the
+    // samples are read without a branch on the layout.
+    void (*cell_corners)(const struct region_view_t *r, int x, int y, int z, cell_corners_t *corners);
+} region_view_t;
+
+#define SNORM16_TO_FLOAT (1.f / 32767.f)
+
+static void aos_cell_corners(const region_view_t *r, int x, int y, int z, cell_corners_t *corners)
+{
+    for (int i = 0; i < 8; ++i) {
+        const int cx = x + (i >> 2), cy = y + ((i >> 1) & 1), cz = z + (i & 1);
+        corners->densities[i] = r->aos->densities[cx][cy][cz];
+        corners->normals[i] = r->aos->normals[cx][cy][cz];
+    }
+}
+
+static void soa_cell_corners(const region_view_t *r, int x, int y, int z, cell_corners_t *corners)
+{
+    for (int i = 0; i < 8; ++i) {
+        const int cx = x + (i >> 2), cy = y + ((i >> 1) & 1), cz = z + (i & 1);
+        corners->densities[i] = r->soa->densities[cx][cy][cz];
+        corners->normals[i] = (tm_vec3_t) { r->soa->nx[cx][cy][cz], r->soa->ny[cx][cy][cz], r->soa->nz[cx][cy][cz] };
+    }
+}
+
+static void soa16_cell_corners(const region_view_t *r, int x, int y, int z, cell_corners_t *corners)
+{
+    const float density_scale = r->soa16->density_scale;
+    for (int i = 0; i < 8; ++i) {
+        const int cx = x + (i >> 2), cy = y + ((i >> 1) & 1), cz = z + (i & 1);
+        corners->densities[i] = (float)r->soa16->densities[cx][cy][cz] * density_scale;
+        corners->normals[i] = (tm_vec3_t) {
+            (float)r->soa16->nx[cx][cy][cz] * SNORM16_TO_FLOAT,
+            (float)r->soa16->ny[cx][cy][cz] * SNORM16_TO_FLOAT,
+            (float)r->soa16->nz[cx][cy][cz] * SNORM16_TO_FLOAT,
+        };
+    }
+}
+
+// Returns a view of `region`, which is stored in `layout`.
+static region_view_t region_view(region_layout_t layout, const void *region)
+{
+    static void (*const cell_corners[])(const region_view_t *r, int x, int y, int z, cell_corners_t *corners) = {
+        [REGION_LAYOUT_AOS] = aos_cell_corners,
+        [REGION_LAYOUT_SOA] = soa_cell_corners,
+        [REGION_LAYOUT_SOA16] = soa16_cell_corners,
+    };
+    return (region_view_t) { .layout = layout, .aos = region, .cell_corners = cell_corners[layout] };
 }
 
-static bool dc_cell_vertex(const mag_voxel_region_t *region, int x, int y, int z, tm_vec3_t *vertex)
+// Computes the vertex of an active cell. See [[active_cells_in_row()]] for why there always is one.
+static tm_vec3_t dc_cell_vertex(const region_view_t *region, mag_voxel_vertex_placement placement, int x, int y, int z)
 {
-    const float(*v)[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE] = region->densities;
-    const tm_vec3_t(*n)[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE] = region->normals;
+    cell_corners_t corners;
+    region->cell_corners(region, x, y, z, &corners);
+    const float *v = corners.densities;
+    const tm_vec3_t *n = corners.normals;
 
     // positions of sign changes on the edges of the cell
     tm_vec3_t changes[12];
@@ -100,10 +292,11 @@ static bool dc_cell_vertex(const mag_voxel_region_t *region, int x, int y, int z
 
     for (int dx = 0; dx != 2; ++dx) {
         for (int dy = 0; dy != 2; ++dy) {
-            if ((v[x + dx][y + dy][z] > 0) != (v[x + dx][y + dy][z + 1] > 0)) {
-                float distance = ADAPT(v[x + dx][y + dy][z], v[x + dx][y + dy][z + 1]);
+            const float v0 = v[dx * 4 + dy * 2], v1 = v[dx * 4 + dy * 2 + 1];
+            if ((v0 > 0) != (v1 > 0)) {
+                float distance = ADAPT(v0, v1);
                 changes[change_idx] = (tm_vec3_t) { .x = (float)(x + dx), .y = (float)(y + dy), .z = (float)z + distance };
-                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[x + dx][y + dy][z], n[x + dx][y + dy][z + 1], distance));
+                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[dx * 4 + dy * 2], n[dx * 4 + dy * 2 + 1], distance));
                 ++change_idx;
             }
         }
@@ -111,10 +304,11 @@ static bool dc_cell_vertex(const mag_voxel_region_t *region, int x, int y, int z
 
     for (int dx = 0; dx != 2; ++dx) {
         for (int dz = 0; dz != 2; ++dz) {
-            if ((v[x + dx][y][z + dz] > 0) != (v[x + dx][y + 1][z + dz] > 0)) {
-                float distance = ADAPT(v[x + dx][y][z + dz], v[x + dx][y + 1][z + dz]);
+            const float v0 = v[dx * 4 + dz], v1 = v[dx * 4 + 2 + dz];
+            if ((v0 > 0) != (v1 > 0)) {
+                float distance = ADAPT(v0, v1);
                 changes[change_idx] = (tm_vec3_t) { .x = (float)(x + dx), .y = (float)y + distance, .z = (float)(z + dz) };
-                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[x + dx][y][z + dz], n[x + dx][y + 1][z + dz], distance));
+                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[dx * 4 + dz], n[dx * 4 + 2 + dz], distance));
                 ++change_idx;
             }
         }
@@ -122,30 +316,136 @@ static bool dc_cell_vertex(const mag_voxel_region_t *region, int x, int y, int z
 
     for (int dy = 0; dy != 2; ++dy) {
         for (int dz = 0; dz != 2; ++dz) {
-            if ((v[x][y + dy][z + dz] > 0) != (v[x + 1][y + dy][z + dz] > 0)) {
-                float distance = ADAPT(v[x][y + dy][z + dz], v[x + 1][y + dy][z + dz]);
+            const float v0 = v[dy * 2 + dz], v1 = v[4 + dy * 2 + dz];
+            if ((v0 > 0) != (v1 > 0)) {
+                float distance = ADAPT(v0, v1);
                 changes[change_idx] = (tm_vec3_t) { .x = (float)x + distance, .y = (float)(y + dy), .z = (float)(z + dz) };
-                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[x][y + dy][z + dz], n[x + 1][y + dy][z + dz], distance));
+                normals[change_idx] = tm_vec3_normalize(tm_vec3_lerp(n[dy * 2 + dz], n[4 + dy * 2 + dz], distance));
                 ++change_idx;
             }
         }
     }
 
-    if (change_idx <= 1)
-        return false;
+    if (placement == MAG_VOXEL_VERTEX_PLACEMENT_QEF)
+        return find_vertex_qef((float)x, (float)y, (float)z, changes, normals, change_idx);
 
-    float corner_signs[8] = {
-        v[x + 0][y + 0][z + 0] >= 0.f ? 1.f : -1.f,
-        v[x + 0][y + 0][z + 1] >= 0.f ? 1.f : -1.f,
-        v[x + 0][y + 1][z + 0] >= 0.f ? 1.f : -1.f,
-        v[x + 0][y + 1][z + 1] >= 0.f ? 1.f : -1.f,
-        v[x + 1][y + 0][z + 0] >= 0.f ? 1.f : -1.f,
-        v[x + 1][y + 0][z + 1] >= 0.f ? 1.f : -1.f,
-        v[x + 1][y + 1][z + 0] >= 0.f ? 1.f : -1.f,
-        v[x + 1][y + 1][z + 1] >= 0.f ? 1.f : -1.f,
-    };
-    *vertex = find_vertex((float)x, (float)y, (float)z, changes, normals, change_idx, corner_signs);
-    return true;
+    float corner_signs[8];
+    for (int i = 0; i < 8; ++i) {
+        corner_signs[i] = v[i] >= 0.f ? 1.f : -1.f;
+    }
+    return find_vertex((float)x, (float)y, (float)z, changes, normals, change_idx, corner_signs);
+}
+
+// Cell classification works on one bit per density sample, so a row of samples along Z must fit
+// into a 32-bit mask.
+TM_STATIC_ASSERT(MAG_VOXEL_REGION_SIZE == 32);
+
+// Mask of the cells in a row. The last sample in a row doesn't start a cell.
+#define CELL_ROW_MASK ((uint32_t)(((uint64_t)1 << (MAG_VOXEL_REGION_SIZE - 1)) - 1))
+
+static inline uint32_t lowest_bit_index(uint32_t v)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (uint32_t)i;
+#else
+    return (uint32_t)__builtin_ctz(v);
+#endif
+}
+
+static inline uint32_t bit_count(uint32_t v)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return __popcnt(v);
+#else
+    return (uint32_t)__builtin_popcount(v);
+#endif
+}
+
+// Builds the sign mask of a row of float densities.
+static inline uint32_t float_row_solid_mask(const float *row)
+{
+    uint32_t mask = 0;
+#if defined(__AVX__)
+    const __m256 zero = _mm256_setzero_ps();
+    for (int z = 0; z < MAG_VOXEL_REGION_SIZE; z += 8) {
+        const __m256 solid8 = _mm256_cmp_ps(_mm256_loadu_ps(row + z), zero, _CMP_GT_OQ);
+        mask |= (uint32_t)_mm256_movemask_ps(solid8) << z;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128 zero = _mm_setzero_ps();
+    for (int z = 0; z < MAG_VOXEL_REGION_SIZE; z += 4) {
+        const __m128 solid4 = _mm_cmpgt_ps(_mm_loadu_ps(row + z), zero);
+        mask |= (uint32_t)_mm_movemask_ps(solid4) << z;
+    }
+#else
+    for (int z = 0; z < MAG_VOXEL_REGION_SIZE; ++z) {
+        mask |= (uint32_t)(row[z] > 0) << z;
+    }
+#endif
+    return mask;
+}
+
+// Builds the sign mask of a row of 16-bit densities. The density scale is positive, so the sign
+// can be tested on the quantized value.
+static inline uint32_t int16_row_solid_mask(const int16_t *row)
+{
+    uint32_t mask = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero = _mm_setzero_si128();
+    for (int z = 0; z < MAG_VOXEL_REGION_SIZE; z += 16) {
+        const __m128i lo = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(row + z)), zero);
+        const __m128i hi = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(row + z + 8)), zero);
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << z;
+    }
+#else
+    for (int z = 0; z < MAG_VOXEL_REGION_SIZE; ++z) {
+        mask |= (uint32_t)(row[z] > 0) << z;
+    }
+#endif
+    return mask;
+}
+
+// Bit `z` is set if the density at (x, y, z) is positive.
+static inline uint32_t row_solid_mask(const region_view_t *region, int x, int y)
+{
+    switch (region->layout) {
+    case REGION_LAYOUT_SOA:
+        return float_row_solid_mask(region->soa->densities[x][y]);
+    case REGION_LAYOUT_SOA16:
+        return int16_row_solid_mask(region->soa16->densities[x][y]);
+    default:
+        return float_row_solid_mask(region->aos->densities[x][y]);
+    }
+}
+
+// Builds the sign masks of all the rows of the region.
+static void region_solid_masks(const region_view_t *region, uint32_t solid[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE])
+{
+    for (int x = 0; x < MAG_VOXEL_REGION_SIZE; ++x) {
+        for (int y = 0; y < MAG_VOXEL_REGION_SIZE; ++y)
+            solid[x][y] = row_solid_mask(region, x, y);
+    }
+}
+
+// Returns the mask of the cells in the row (x, y) that have a sign change on at least one of their
+// edges. Only these cells produce a vertex, since a cube with mixed corner signs always has at least
+// three sign-changing edges.
+static inline uint32_t active_cells_in_row(const uint32_t solid[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE], int x, int y)
+{
+    const uint32_t m00 = solid[x][y];
+    const uint32_t m01 = solid[x][y + 1];
+    const uint32_t m10 = solid[x + 1][y];
+    const uint32_t m11 = solid[x + 1][y + 1];
+
+    // cell z has corners at samples z and z + 1
+    uint32_t all_solid = m00 & m01 & m10 & m11;
+    all_solid &= all_solid >> 1;
+    uint32_t any_solid = m00 | m01 | m10 | m11;
+    any_solid |= any_solid >> 1;
+
+    return any_solid & ~all_solid & CELL_ROW_MASK;
 }
 
 static bool set_resource(tm_shader_io_o *io, tm_renderer_resource_command_buffer_o *res_buf, tm_shader_resource_binder_instance_t *instance,
@@ -176,142 +476,314 @@ enum {
     TM_INDEX_SEMANTIC = 16
 };
 
-static void dual_contour_region(
-    const mag_voxel_region_t *region,
-    tm_renderer_backend_i *backend,
-    tm_shader_io_o *io,
-    mag_voxel_mesh_t *out_mesh,
-    tm_shader_resource_binder_instance_t *inout_rbinder,
-    tm_shader_constant_buffer_instance_t *inout_cbuffer)
+// Bits `first` to `last` inclusive.
+static inline uint32_t bit_range(int first, int last)
 {
-    TM_INIT_TEMP_ALLOCATOR(ta);
-    /* carray */ tm_vec3_t *vertices = 0;
-    const int CAPACITY_INCREMENT = 256;
-    int vertex_capacity = CAPACITY_INCREMENT;
-    uint16_t vertex_count = 0;
-    tm_carray_temp_resize(vertices, vertex_capacity, ta);
-
-    uint16_t cell_vertices[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
-
-    for (int x = 0; x < MAG_VOXEL_REGION_SIZE - 1; ++x) {
-        for (int y = 0; y < MAG_VOXEL_REGION_SIZE - 1; ++y) {
-            for (int z = 0; z < MAG_VOXEL_REGION_SIZE - 1; ++z) {
-                tm_vec3_t vertex;
-                if (dc_cell_vertex(region, x, y, z, &vertex)) {
-                    if (vertex_count >= vertex_capacity) {
-                        vertex_capacity += CAPACITY_INCREMENT;
-                        tm_carray_temp_resize(vertices, vertex_capacity, ta);
-                    }
-                    vertices[vertex_count] = vertex;
-                    cell_vertices[x][y][z] = vertex_count;
-                    ++vertex_count;
-                }
+    return (uint32_t)((((uint64_t)1 << (last + 1)) - 1) & ~(((uint64_t)1 << first) - 1));
+}
+
+// The mesher runs in two passes. The first one classifies the samples and counts the vertices and
+// indices, so that the second one can write the mesh straight into the mapped GPU buffers without
+// any intermediate arrays.
+//
+// The cells in [lo, hi] get vertices and the edges along an axis are meshed in [lo, edge_hi] on
+// that axis and in [lo + 1, hi] on the others, so that all four cells around them exist. A full
+// region meshes everything; in interior mode a region only owns the cells of its chunk and the
+// cells in the `hi` layers belong to the neighbours on the high side.
+typedef struct contour_state_t
+{
+    uint32_t solid[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    int lo, hi, edge_hi;
+    uint32_t num_vertices;
+    uint32_t num_indices;
+} contour_state_t;
+
+static void contour_state_init(contour_state_t *state, bool interior)
+{
+    state->lo = interior ? MAG_VOXEL_MARGIN : 0;
+    state->hi = interior ? MAG_VOXEL_MARGIN + MAG_VOXEL_CHUNK_SIZE : MAG_VOXEL_REGION_SIZE - 2;
+    state->edge_hi = interior ? state->hi - 1 : state->hi;
+}
+
+// Sign-change edges along Z, Y and X that start at the samples of the row (x, y). Each of them
+// produces a quad.
+static inline void row_edge_changes(const contour_state_t *state, int x, int y,
+    uint32_t *z_changes, uint32_t *y_changes, uint32_t *x_changes)
+{
+    const int lo = state->lo, hi = state->hi, edge_hi = state->edge_hi;
+    const bool x_across = x > lo && x <= hi, y_across = y > lo && y <= hi;
+    const bool x_along = x >= lo && x <= edge_hi, y_along = y >= lo && y <= edge_hi;
+
+    const uint32_t row = state->solid[x][y];
+    *z_changes = (row ^ (row >> 1)) & (x_across && y_across ? bit_range(lo, edge_hi) : 0);
+    *y_changes = (row ^ state->solid[x][y + 1]) & (x_across && y_along ? bit_range(lo + 1, hi) : 0);
+    *x_changes = (row ^ state->solid[x + 1][y]) & (x_along && y_across ? bit_range(lo + 1, hi) : 0);
+}
+
+// Cells of a region that get a vertex in row (x, y).
+static inline uint32_t row_vertex_cells(const contour_state_t *state, int x, int y)
+{
+    return active_cells_in_row(state->solid, x, y) & bit_range(state->lo, state->hi);
+}
+
+// Seams of a region in interior mode.
+typedef struct contour_seams_t
+{
+    // The region's own seam, filled in by [[contour_count()]].
+    mag_voxel_seam_t *own;
+    // Indexed by the neighbour offset `x * 4 + y * 2 + z`.
+    const mag_voxel_seam_t *const *neighbours;
+} contour_seams_t;
+
+// Maps a cell on a low face of the chunk, relative to the margin, to its slot in a seam.
+static inline void seam_slot(int x, int y, int z, int *face, int *u, int *v)
+{
+    if (x == 0)
+        *face = 0, *u = y, *v = z;
+    else if (y == 0)
+        *face = 1, *u = x, *v = z;
+    else
+        *face = 2, *u = x, *v = y;
+}
+
+static inline bool seam_vertex(const mag_voxel_seam_t *seam, int x, int y, int z, tm_vec3_t *vertex)
+{
+    int face, u, v;
+    seam_slot(x - MAG_VOXEL_MARGIN, y - MAG_VOXEL_MARGIN, z - MAG_VOXEL_MARGIN, &face, &u, &v);
+    if (!((seam->has_vertex[face][u] >> v) & 1))
+        return false;
+    *vertex = seam->vertices[face][u][v];
+    return true;
+}
+
+// Computes the vertices of the owned cells on the low faces of the chunk and stores them in `seam`.
+static void publish_seam(const region_view_t *region, mag_voxel_vertex_placement placement, const contour_state_t *state, mag_voxel_seam_t *seam)
+{
+    memset(seam->has_vertex, 0, sizeof(seam->has_vertex));
+
+    const int lo = state->lo, hi = state->hi;
+    const uint32_t owned = bit_range(lo, hi - 1);
+    for (int x = lo; x < hi; ++x) {
+        for (int y = lo; y < hi; ++y) {
+            uint32_t active = active_cells_in_row(state->solid, x, y) & owned;
+            if (x != lo && y != lo)
+                active &= (uint32_t)1 << lo;
+            while (active) {
+                const int z = (int)lowest_bit_index(active);
+                active &= active - 1;
+
+                int face, u, v;
+                seam_slot(x - lo, y - lo, z - lo, &face, &u, &v);
+                seam->vertices[face][u][v] = dc_cell_vertex(region, placement, x, y, z);
+                seam->has_vertex[face][u] |= (uint32_t)1 << v;
             }
         }
     }
-    if (vertex_count < 4) {
-        *out_mesh = (mag_voxel_mesh_t) { 0 };
-        goto end;
-    }
-
-    // TODO: we actually know the number of active edges at this point,
-    // but this is a naive implementation
-
-    /* carray */ uint16_t *triangles = 0;
-    int ti = 0;
-    int t_capacity = CAPACITY_INCREMENT;
-    tm_carray_temp_resize(triangles, t_capacity, ta);
-
-    const float(*v)[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE] = region->densities;
-    for (int x = 0; x < MAG_VOXEL_REGION_SIZE - 1; ++x) {
-        for (int y = 0; y < MAG_VOXEL_REGION_SIZE - 1; ++y) {
-            for (int z = 0; z < MAG_VOXEL_REGION_SIZE - 1; ++z) {
-                if (x > 0 && y > 0) {
-                    bool solid0 = (v[x][y][z] > 0);
-                    bool solid1 = (v[x][y][z + 1] > 0);
-                    if (solid0 != solid1) {
-                        if (ti + 6 > t_capacity) {
-                            t_capacity += CAPACITY_INCREMENT;
-                            tm_carray_temp_resize(triangles, t_capacity, ta);
-                        }
-                        int swap = solid1 ? 2 : 0;
-                        triangles[ti + 2 - swap] = cell_vertices[x - 1][y - 1][z];
-                        triangles[ti + 1] = cell_vertices[x - 0][y - 1][z];
-                        triangles[ti + 0 + swap] = cell_vertices[x - 1][y - 0][z];
-
-                        triangles[ti + 3 + swap] = cell_vertices[x - 1][y - 0][z];
-                        triangles[ti + 4] = cell_vertices[x - 0][y - 0][z];
-                        triangles[ti + 5 - swap] = cell_vertices[x - 0][y - 1][z];
-                        ti += 6;
-                    }
+}
+
+// Vertex of an active cell. In interior mode the low face cells are read back from the region's
+// own seam and the cells of the neighbours from theirs. If a seam is missing, the vertex is computed
+// from the margin.
+static inline tm_vec3_t cell_vertex(const region_view_t *region, mag_voxel_vertex_placement placement, const contour_state_t *state,
+    const contour_seams_t *seams, int x, int y, int z)
+{
+    if (seams) {
+        const int nx = x == state->hi, ny = y == state->hi, nz = z == state->hi;
+        const mag_voxel_seam_t *seam = 0;
+        if (nx | ny | nz)
+            seam = seams->neighbours ? seams->neighbours[nx * 4 + ny * 2 + nz] : 0;
+        else if (x == state->lo || y == state->lo || z == state->lo)
+            seam = seams->own;
+
+        const tm_vec3_t offset = { (float)(nx * MAG_VOXEL_CHUNK_SIZE), (float)(ny * MAG_VOXEL_CHUNK_SIZE), (float)(nz * MAG_VOXEL_CHUNK_SIZE) };
+        tm_vec3_t vertex;
+        if (seam && seam_vertex(seam, x - (int)offset.x, y - (int)offset.y, z - (int)offset.z, &vertex))
+            return tm_vec3_add(vertex, offset);
+    }
+    return dc_cell_vertex(region, placement, x, y, z);
+}
+
+// Every active cell gets a vertex and every sign-change edge a quad, so both counts are just the
+// number of set bits in the masks. In interior mode this also publishes the region's seam, so that
+// the seams of a whole batch are ready before any region is emitted.
+//
+// The border cells are counted if they are active, even if none of the owned edges uses them.
+// Such vertices are rare and harmless.
+static void contour_count(const region_view_t *region, mag_voxel_vertex_placement placement, bool interior,
+    mag_voxel_seam_t *out_seam, contour_state_t *state)
+{
+    region_solid_masks(region, state->solid);
+    contour_state_init(state, interior);
+
+    uint32_t num_vertices = 0;
+    uint32_t num_quads = 0;
+    for (int x = state->lo; x <= state->hi; ++x) {
+        for (int y = state->lo; y <= state->hi; ++y) {
+            num_vertices += bit_count(row_vertex_cells(state, x, y));
+
+            uint32_t z_changes, y_changes, x_changes;
+            row_edge_changes(state, x, y, &z_changes, &y_changes, &x_changes);
+            num_quads += bit_count(z_changes) + bit_count(y_changes) + bit_count(x_changes);
+        }
+    }
+    state->num_vertices = num_vertices;
+    state->num_indices = num_quads * 6;
+
+    if (interior && out_seam)
+        publish_seam(region, placement, state, out_seam);
+}
+
+// Stores the indices of a quad, rebased by `base_vertex`, as 16 or 32-bit values.
+static inline void store_quad(void *triangles, uint32_t index_stride, uint32_t ti, const uint32_t quad[6], uint32_t base_vertex)
+{
+    if (index_stride == 4) {
+        uint32_t *t = (uint32_t *)triangles + ti;
+        for (int i = 0; i < 6; ++i)
+            t[i] = base_vertex + quad[i];
+    } else {
+        uint16_t *t = (uint16_t *)triangles + ti;
+        for (int i = 0; i < 6; ++i)
+            t[i] = (uint16_t)(base_vertex + quad[i]);
+    }
+}
+
+// Writes exactly `state->num_vertices` vertices and `state->num_indices` indices. The vertices are
+// moved by `offset` and the indices by `base_vertex`, so that several regions can share a mesh.
+static void contour_emit(const region_view_t *region, mag_voxel_vertex_placement placement, const contour_state_t *state,
+    const contour_seams_t *seams, tm_vec3_t offset, uint32_t base_vertex, tm_vec3_t *vertices, void *triangles, uint32_t index_stride)
+{
+    // The quads of slice x only use the vertices of slices x - 1 and x, so the vertex indices of two
+    // slices are enough. This keeps the stack small enough for the job system fibers.
+    uint16_t cell_vertices[2][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    const uint32_t(*solid)[MAG_VOXEL_REGION_SIZE] = state->solid;
+
+    uint32_t vertex_count = 0;
+    uint32_t ti = 0;
+    for (int x = state->lo; x <= state->hi; ++x) {
+        uint16_t(*cur)[MAG_VOXEL_REGION_SIZE] = cell_vertices[x & 1];
+        uint16_t(*prev)[MAG_VOXEL_REGION_SIZE] = cell_vertices[(x & 1) ^ 1];
+
+        // Most cells have no sign change, so only visit the active ones. The cells are still
+        // visited in the x, y, z order, so the vertex order is the same as with a full sweep.
+        for (int y = state->lo; y <= state->hi; ++y) {
+            uint32_t active = row_vertex_cells(state, x, y);
+            while (active) {
+                const int z = (int)lowest_bit_index(active);
+                active &= active - 1;
+
+                vertices[vertex_count] = tm_vec3_add(cell_vertex(region, placement, state, seams, x, y, z), offset);
+                cur[y][z] = (uint16_t)vertex_count;
+                ++vertex_count;
+            }
+        }
+
+        for (int y = state->lo; y <= state->hi; ++y) {
+            const uint32_t row = solid[x][y];
+            uint32_t z_changes, y_changes, x_changes;
+            row_edge_changes(state, x, y, &z_changes, &y_changes, &x_changes);
+
+            uint32_t changes = z_changes | y_changes | x_changes;
+            while (changes) {
+                const int z = (int)lowest_bit_index(changes);
+                const uint32_t bit = (uint32_t)1 << z;
+                changes &= changes - 1;
+
+                if (z_changes & bit) {
+                    const bool solid1 = (solid[x][y] >> (z + 1)) & 1;
+                    int swap = solid1 ? 2 : 0;
+                    uint32_t quad[6];
+                    quad[2 - swap] = prev[y - 1][z];
+                    quad[1] = cur[y - 1][z];
+                    quad[0 + swap] = prev[y - 0][z];
+
+                    quad[3 + swap] = prev[y - 0][z];
+                    quad[4] = cur[y - 0][z];
+                    quad[5 - swap] = cur[y - 1][z];
+                    store_quad(triangles, index_stride, ti, quad, base_vertex);
+                    ti += 6;
                 }
 
-                if (x > 0 && z > 0) {
-                    bool solid0 = (v[x][y][z] > 0);
-                    bool solid1 = (v[x][y + 1][z] > 0);
-                    if (solid0 != solid1) {
-                        if (ti + 6 > t_capacity) {
-                            t_capacity += CAPACITY_INCREMENT;
-                            tm_carray_temp_resize(triangles, t_capacity, ta);
-                        }
-                        int swap = solid0 ? 2 : 0;
-                        triangles[ti + 2 - swap] = cell_vertices[x - 1][y][z - 1];
-                        triangles[ti + 1] = cell_vertices[x - 0][y][z - 1];
-                        triangles[ti + 0 + swap] = cell_vertices[x - 1][y][z - 0];
-
-                        triangles[ti + 3 + swap] = cell_vertices[x - 1][y][z - 0];
-                        triangles[ti + 4] = cell_vertices[x - 0][y][z - 0];
-                        triangles[ti + 5 - swap] = cell_vertices[x - 0][y][z - 1];
-                        ti += 6;
-                    }
+                if (y_changes & bit) {
+                    const bool solid0 = row & bit;
+                    int swap = solid0 ? 2 : 0;
+                    uint32_t quad[6];
+                    quad[2 - swap] = prev[y][z - 1];
+                    quad[1] = cur[y][z - 1];
+                    quad[0 + swap] = prev[y][z - 0];
+
+                    quad[3 + swap] = prev[y][z - 0];
+                    quad[4] = cur[y][z - 0];
+                    quad[5 - swap] = cur[y][z - 1];
+                    store_quad(triangles, index_stride, ti, quad, base_vertex);
+                    ti += 6;
                 }
 
-                if (y > 0 && z > 0) {
-                    bool solid0 = (v[x][y][z] > 0);
-                    bool solid1 = (v[x + 1][y][z] > 0);
-                    if (solid0 != solid1) {
-                        if (ti + 6 > t_capacity) {
-                            t_capacity += CAPACITY_INCREMENT;
-                            tm_carray_temp_resize(triangles, t_capacity, ta);
-                        }
-                        int swap = solid1 ? 2 : 0;
-                        triangles[ti + 0 + swap] = cell_vertices[x][y - 1][z - 0];
-                        triangles[ti + 1] = cell_vertices[x][y - 0][z - 1];
-                        triangles[ti + 2 - swap] = cell_vertices[x][y - 1][z - 1];
-
-                        triangles[ti + 3 + swap] = cell_vertices[x][y - 1][z - 0];
-                        triangles[ti + 4] = cell_vertices[x][y - 0][z - 0];
-                        triangles[ti + 5 - swap] = cell_vertices[x][y - 0][z - 1];
-                        ti += 6;
-                    }
+                if (x_changes & bit) {
+                    const bool solid1 = solid[x + 1][y] & bit;
+                    int swap = solid1 ? 2 : 0;
+                    uint32_t quad[6];
+                    quad[0 + swap] = cur[y - 1][z - 0];
+                    quad[1] = cur[y - 0][z - 1];
+                    quad[2 - swap] = cur[y - 1][z - 1];
+
+                    quad[3 + swap] = cur[y - 1][z - 0];
+                    quad[4] = cur[y - 0][z - 0];
+                    quad[5 - swap] = cur[y - 0][z - 1];
+                    store_quad(triangles, index_stride, ti, quad, base_vertex);
+                    ti += 6;
                 }
             }
         }
     }
+}
 
-    tm_renderer_resource_command_buffer_o *res_buf;
-    backend->create_resource_command_buffers(backend->inst, &res_buf, 1);
+// Regions with fewer vertices than this get an empty mesh.
+#define MIN_MESH_VERTICES 4
+
+// Meshes use 16-bit indices unless they have too many vertices for them.
+static inline uint32_t mesh_index_stride(uint32_t num_vertices)
+{
+    return num_vertices > UINT16_MAX ? 4 : 2;
+}
+
+// Creates the GPU buffers of a mesh and returns the mapped memory to write the mesh to. The index
+// size is picked from the number of vertices.
+static void create_mesh_buffers(tm_renderer_resource_command_buffer_o *res_buf, uint32_t num_vertices, uint32_t num_indices,
+    mag_voxel_mesh_t *out_mesh, tm_vec3_t **vertices, void **triangles)
+{
+    out_mesh->index_stride = mesh_index_stride(num_vertices);
 
     void *ibuf_data;
     out_mesh->ibuf = tm_renderer_api->tm_renderer_resource_command_buffer_api->map_create_buffer(res_buf,
-        &(tm_renderer_buffer_desc_t) { .size = ti * sizeof(uint16_t), .usage_flags = TM_RENDERER_BUFFER_USAGE_STORAGE | TM_RENDERER_BUFFER_USAGE_INDEX | TM_RENDERER_BUFFER_USAGE_UPDATABLE, .debug_tag = "voxel_ibuf" },
+        &(tm_renderer_buffer_desc_t) { .size = num_indices * out_mesh->index_stride, .usage_flags = TM_RENDERER_BUFFER_USAGE_STORAGE | TM_RENDERER_BUFFER_USAGE_INDEX | TM_RENDERER_BUFFER_USAGE_UPDATABLE, .debug_tag = "voxel_ibuf" },
         TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, 0, &ibuf_data);
-    memcpy(ibuf_data, triangles, ti * sizeof(uint16_t));
-    out_mesh->num_indices = (uint32_t)ti;
+    out_mesh->num_indices = num_indices;
 
     void *vbuf_data;
     out_mesh->vbuf = tm_renderer_api->tm_renderer_resource_command_buffer_api->map_create_buffer(res_buf,
-        &(tm_renderer_buffer_desc_t) { .size = vertex_count * sizeof(tm_vec3_t), .usage_flags = TM_RENDERER_BUFFER_USAGE_STORAGE | TM_RENDERER_BUFFER_USAGE_ACCELERATION_STRUCTURE | TM_RENDERER_BUFFER_USAGE_UPDATABLE, .debug_tag = "voxel_vbuf" },
+        &(tm_renderer_buffer_desc_t) { .size = num_vertices * sizeof(tm_vec3_t), .usage_flags = TM_RENDERER_BUFFER_USAGE_STORAGE | TM_RENDERER_BUFFER_USAGE_ACCELERATION_STRUCTURE | TM_RENDERER_BUFFER_USAGE_UPDATABLE, .debug_tag = "voxel_vbuf" },
         TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, 0, &vbuf_data);
-    memcpy(vbuf_data, vertices, vertex_count * sizeof(tm_vec3_t));
 
+    *vertices = (tm_vec3_t *)vbuf_data;
+    *triangles = ibuf_data;
+}
+
+// Binds the mesh buffers to the shader instances.
+static void bind_mesh(
+    tm_renderer_resource_command_buffer_o *res_buf,
+    tm_shader_io_o *io,
+    mag_voxel_mesh_t *mesh,
+    uint32_t num_vertices,
+    tm_shader_resource_binder_instance_t *inout_rbinder,
+    tm_shader_constant_buffer_instance_t *inout_cbuffer)
+{
     if (!inout_rbinder->instance_id)
         tm_shader_api->create_resource_binder_instances(io, 1, inout_rbinder);
     if (!inout_cbuffer->instance_id)
         tm_shader_api->create_constant_buffer_instances(io, 1, inout_cbuffer);
 
-    set_resource(io, res_buf, inout_rbinder, TM_STATIC_HASH("vertex_buffer_position_buffer", 0x1ef08bede3820d69ULL), &out_mesh->vbuf, 0, 0, 1);
-    set_resource(io, res_buf, inout_rbinder, TM_STATIC_HASH("index_buffer", 0xb773460d24bcec1fULL), &out_mesh->ibuf, 0, 0, 1);
+    set_resource(io, res_buf, inout_rbinder, TM_STATIC_HASH("vertex_buffer_position_buffer", 0x1ef08bede3820d69ULL), &mesh->vbuf, 0, 0, 1);
+    set_resource(io, res_buf, inout_rbinder, TM_STATIC_HASH("index_buffer", 0xb773460d24bcec1fULL), &mesh->ibuf, 0, 0, 1);
 
 #include <the_machinery/shaders/vertex_buffer_system.inl>
     tm_shader_vertex_buffer_system_t constants = { 0 };
@@ -319,361 +791,1738 @@ static void dual_contour_region(
     uint32_t *offsets = (uint32_t *)&constants.vertex_buffer_offsets;
 
     constants.vertex_buffer_header[0] |= (1 << TM_VERTEX_SEMANTIC_POSITION) | (1 << TM_INDEX_SEMANTIC);
-    const uint32_t num_vertices = vertex_count;
     constants.vertex_buffer_header[1] = num_vertices;
     offsets[TM_VERTEX_SEMANTIC_POSITION] = 0;
     strides[TM_VERTEX_SEMANTIC_POSITION] = sizeof(tm_vec3_t);
 
     constants.index_buffer_offset_and_stride[0] = 0;
-    constants.index_buffer_offset_and_stride[1] = 2;
+    constants.index_buffer_offset_and_stride[1] = mesh->index_stride;
 
     void *cbuf = (void *)&constants;
     tm_shader_api->update_constants_raw(io, res_buf,
         &inout_cbuffer->instance_id, (const void **)&cbuf, 0, sizeof(tm_shader_vertex_buffer_system_t), 1);
+}
+
+static void dual_contour(
+    const region_view_t *region,
+    mag_voxel_vertex_placement placement,
+    const contour_seams_t *seams,
+    tm_renderer_backend_i *backend,
+    tm_shader_io_o *io,
+    mag_voxel_mesh_t *out_mesh,
+    tm_shader_resource_binder_instance_t *inout_rbinder,
+    tm_shader_constant_buffer_instance_t *inout_cbuffer)
+{
+    contour_state_t state;
+    contour_count(region, placement, seams != 0, seams ? seams->own : 0, &state);
+    if (state.num_vertices < MIN_MESH_VERTICES) {
+        *out_mesh = (mag_voxel_mesh_t) { 0 };
+        return;
+    }
+
+    tm_renderer_resource_command_buffer_o *res_buf;
+    backend->create_resource_command_buffers(backend->inst, &res_buf, 1);
+
+    tm_vec3_t *vertices;
+    void *triangles;
+    create_mesh_buffers(res_buf, state.num_vertices, state.num_indices, out_mesh, &vertices, &triangles);
+    contour_emit(region, placement, &state, seams, (tm_vec3_t) { 0 }, 0, vertices, triangles, out_mesh->index_stride);
+    bind_mesh(res_buf, io, out_mesh, state.num_vertices, inout_rbinder, inout_cbuffer);
 
     backend->submit_resource_command_buffers(backend->inst, &res_buf, 1);
     backend->destroy_resource_command_buffers(backend->inst, &res_buf, 1);
-
-end:
-    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
 }
 
-static struct mag_voxel_api mag_voxel_api = {
-    .dual_contour_region = dual_contour_region,
-};
-
-typedef struct aabb_t
+static void dual_contour_region(
+    const mag_voxel_region_t *region,
+    tm_renderer_backend_i *backend,
+    tm_shader_io_o *io,
+    mag_voxel_mesh_t *out_mesh,
+    tm_shader_resource_binder_instance_t *inout_rbinder,
+    tm_shader_constant_buffer_instance_t *inout_cbuffer)
 {
-    tm_vec3_t center;
-    tm_vec3_t half_size;
-} aabb_t;
+    const region_view_t view = region_view(REGION_LAYOUT_AOS, region);
+    dual_contour(&view, MAG_VOXEL_VERTEX_PLACEMENT_PARTICLE, 0, backend, io, out_mesh, inout_rbinder, inout_cbuffer);
+}
 
-static aabb_t aabb_from_min_max(tm_vec3_t min, tm_vec3_t max)
+static void dual_contour_soa_region(
+    const mag_voxel_soa_region_t *region,
+    tm_renderer_backend_i *backend,
+    tm_shader_io_o *io,
+    mag_voxel_mesh_t *out_mesh,
+    tm_shader_resource_binder_instance_t *inout_rbinder,
+    tm_shader_constant_buffer_instance_t *inout_cbuffer)
 {
-    tm_vec3_t half_size = tm_vec3_mul(tm_vec3_sub(max, min), 0.5f);
-    tm_vec3_t center = tm_vec3_add(min, half_size);
-    return (aabb_t) { center, half_size };
+    const region_view_t view = region_view(REGION_LAYOUT_SOA, region);
+    dual_contour(&view, MAG_VOXEL_VERTEX_PLACEMENT_PARTICLE, 0, backend, io, out_mesh, inout_rbinder, inout_cbuffer);
 }
 
-static bool aabb_intersect(const aabb_t *a, const aabb_t *b)
+static void dual_contour_soa16_region(
+    const mag_voxel_soa16_region_t *region,
+    tm_renderer_backend_i *backend,
+    tm_shader_io_o *io,
+    mag_voxel_mesh_t *out_mesh,
+    tm_shader_resource_binder_instance_t *inout_rbinder,
+    tm_shader_constant_buffer_instance_t *inout_cbuffer)
 {
-    tm_vec3_t amin = tm_vec3_sub(a->center, a->half_size);
-    tm_vec3_t amax = tm_vec3_add(a->center, a->half_size);
-
-    tm_vec3_t bmin = tm_vec3_sub(b->center, b->half_size);
-    tm_vec3_t bmax = tm_vec3_add(b->center, b->half_size);
-
-    return (
-        amin.x <= bmax.x && amax.x >= bmin.x && amin.y <= bmax.y && amax.y >= bmin.y && amin.z <= bmax.z && amax.z >= bmin.z);
+    const region_view_t view = region_view(REGION_LAYOUT_SOA16, region);
+    dual_contour(&view, MAG_VOXEL_VERTEX_PLACEMENT_PARTICLE, 0, backend, io, out_mesh, inout_rbinder, inout_cbuffer);
 }
 
-typedef struct mag_tree_region_t
+typedef struct contour_job_data_t
 {
-    tm_vec3_t pos;
-    float cell_size;
-    uint64_t key;
-} mag_tree_region_t;
-
-typedef struct mag_region_tree_node_t
+    region_view_t region;
+    mag_voxel_vertex_placement placement;
+    bool interior;
+    contour_seams_t seams;
+    contour_state_t state;
+    // Mapped buffer memory, written by the emit job.
+    tm_vec3_t *vertices;
+    void *triangles;
+    uint32_t index_stride;
+} contour_job_data_t;
+
+static void contour_count_job(void *data)
 {
-    /* carray */ mag_tree_region_t *regions;
-    uint8_t child_mask;
-} mag_region_tree_node_t;
+    contour_job_data_t *job = (contour_job_data_t *)data;
+    contour_count(&job->region, job->placement, job->interior, job->seams.own, &job->state);
+}
 
-typedef struct mag_region_tree_t
+static void contour_emit_job(void *data)
 {
-    struct TM_HASH_T(uint64_t, mag_region_tree_node_t) nodes;
-    mag_region_tree_node_t root;
-    aabb_t aabb;
-    tm_allocator_i *allocator;
-} mag_region_tree_t;
+    contour_job_data_t *job = (contour_job_data_t *)data;
+    contour_emit(&job->region, job->placement, &job->state, job->interior ? &job->seams : 0, (tm_vec3_t) { 0 }, 0, job->vertices, job->triangles, job->index_stride);
+}
 
-static aabb_t tree_region_aabb(tm_vec3_t region_pos, float cell_size)
+static region_view_t contour_job_view(const mag_voxel_contour_job_t *job)
 {
-    float region_size = (float)MAG_VOXEL_CHUNK_SIZE * cell_size;
-    float half_size = region_size * 0.5f;
-    tm_vec3_t half_size_vec = { half_size, half_size, half_size };
-    return (aabb_t) { tm_vec3_add(region_pos, half_size_vec), half_size_vec };
+    if (job->soa_region)
+        return region_view(REGION_LAYOUT_SOA, job->soa_region);
+    if (job->soa16_region)
+        return region_view(REGION_LAYOUT_SOA16, job->soa16_region);
+    return region_view(REGION_LAYOUT_AOS, job->region);
 }
 
-static aabb_t child_aabb(uint32_t child_idx, const aabb_t *node_aabb)
+static contour_seams_t contour_job_seams(const mag_voxel_contour_job_t *job)
 {
-    tm_vec3_t child_half_size = tm_vec3_mul(node_aabb->half_size, 0.5f);
-    tm_vec3_t center_diff = {
-        child_idx & 1 ? child_half_size.x : -child_half_size.x,
-        child_idx & 2 ? child_half_size.y : -child_half_size.y,
-        child_idx & 4 ? child_half_size.z : -child_half_size.z,
-    };
-    tm_vec3_t child_center = tm_vec3_add(node_aabb->center, center_diff);
-
-    return (aabb_t) { child_center, child_half_size };
+    return (contour_seams_t) { .own = job->out_seam, .neighbours = job->neighbour_seams };
 }
 
-static uint32_t child_idx_for_point(tm_vec3_t node_center, tm_vec3_t point)
+static void dual_contour_job(const mag_voxel_contour_job_t *job, tm_renderer_backend_i *backend, tm_shader_io_o *io)
 {
-    tm_vec3_t obj_center_diff = tm_vec3_sub(point, node_center);
-    uint32_t child_i = 0;
-    child_i |= obj_center_diff.x >= 0 ? 1 : 0;
-    child_i |= obj_center_diff.y >= 0 ? 2 : 0;
-    child_i |= obj_center_diff.z >= 0 ? 4 : 0;
-    return child_i;
+    const region_view_t view = contour_job_view(job);
+    const contour_seams_t seams = contour_job_seams(job);
+    dual_contour(&view, job->vertex_placement, job->interior ? &seams : 0, backend, io, job->out_mesh, job->inout_rbinder, job->inout_cbuffer);
 }
 
-static mag_region_tree_t *octree_create(tm_allocator_i *allocator, tm_vec3_t min, tm_vec3_t max)
+static void dual_contour_regions(
+    const mag_voxel_contour_job_t *jobs,
+    uint32_t num_jobs,
+    tm_renderer_backend_i *backend,
+    tm_shader_io_o *io)
 {
-    mag_region_tree_t *result = tm_alloc(allocator, sizeof(mag_region_tree_t));
-    *result = (mag_region_tree_t) {
+    if (!num_jobs)
+        return;
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    /* carray */ contour_job_data_t *job_data = 0;
+    tm_carray_temp_resize(job_data, num_jobs, ta);
+    /* carray */ tm_jobdecl_t *decls = 0;
+    tm_carray_temp_resize(decls, num_jobs, ta);
+    for (uint32_t i = 0; i < num_jobs; ++i) {
+        job_data[i].region = contour_job_view(jobs + i);
+        job_data[i].placement = jobs[i].vertex_placement;
+        job_data[i].interior = jobs[i].interior;
+        job_data[i].seams = contour_job_seams(jobs + i);
+        decls[i] = (tm_jobdecl_t) { .task = contour_count_job, .data = job_data + i };
+    }
+    tm_job_system_api->wait_for_counter_and_free(tm_job_system_api->run_jobs(decls, num_jobs));
+
+    // The command buffer API isn't thread safe, so the buffers are created from here and the
+    // workers only write to the mapped memory.
+    tm_renderer_resource_command_buffer_o *res_buf;
+    backend->create_resource_command_buffers(backend->inst, &res_buf, 1);
+
+    uint32_t num_emit_jobs = 0;
+    for (uint32_t i = 0; i < num_jobs; ++i) {
+        contour_job_data_t *job = job_data + i;
+        if (job->state.num_vertices < MIN_MESH_VERTICES) {
+            *jobs[i].out_mesh = (mag_voxel_mesh_t) { 0 };
+            continue;
+        }
+        create_mesh_buffers(res_buf, job->state.num_vertices, job->state.num_indices, jobs[i].out_mesh, &job->vertices, &job->triangles);
+        job->index_stride = jobs[i].out_mesh->index_stride;
+        decls[num_emit_jobs++] = (tm_jobdecl_t) { .task = contour_emit_job, .data = job };
+    }
+    if (num_emit_jobs)
+        tm_job_system_api->wait_for_counter_and_free(tm_job_system_api->run_jobs(decls, num_emit_jobs));
+
+    for (uint32_t i = 0; i < num_jobs; ++i) {
+        if (job_data[i].state.num_vertices >= MIN_MESH_VERTICES)
+            bind_mesh(res_buf, io, jobs[i].out_mesh, job_data[i].state.num_vertices, jobs[i].inout_rbinder, jobs[i].inout_cbuffer);
+    }
+
+    backend->submit_resource_command_buffers(backend->inst, &res_buf, 1);
+    backend->destroy_resource_command_buffers(backend->inst, &res_buf, 1);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
+
+static void dual_contour_block(const mag_voxel_contour_block_t *block, tm_renderer_backend_i *backend, tm_shader_io_o *io)
+{
+    region_view_t regions[8];
+    contour_state_t states[8];
+    uint32_t num_vertices = 0;
+    uint32_t num_indices = 0;
+    for (uint32_t i = 0; i < 8; ++i) {
+        if (block->soa_regions[i])
+            regions[i] = region_view(REGION_LAYOUT_SOA, block->soa_regions[i]);
+        else if (block->soa16_regions[i])
+            regions[i] = region_view(REGION_LAYOUT_SOA16, block->soa16_regions[i]);
+        else
+            regions[i] = region_view(REGION_LAYOUT_AOS, block->regions[i]);
+
+        // `aos` aliases the other layouts, so it is null only if the region is missing
+        if (regions[i].aos) {
+            contour_count(regions + i, block->vertex_placement, false, 0, states + i);
+            num_vertices += states[i].num_vertices;
+            num_indices += states[i].num_indices;
+        }
+    }
+    if (num_vertices < MIN_MESH_VERTICES) {
+        *block->out_mesh = (mag_voxel_mesh_t) { 0 };
+        return;
+    }
+
+    tm_renderer_resource_command_buffer_o *res_buf;
+    backend->create_resource_command_buffers(backend->inst, &res_buf, 1);
+
+    tm_vec3_t *vertices;
+    void *triangles;
+    create_mesh_buffers(res_buf, num_vertices, num_indices, block->out_mesh, &vertices, &triangles);
+    const uint32_t index_stride = block->out_mesh->index_stride;
+
+    uint32_t base_vertex = 0;
+    uint32_t base_index = 0;
+    for (uint32_t i = 0; i < 8; ++i) {
+        if (!regions[i].aos)
+            continue;
+        const tm_vec3_t offset = {
+            (float)(((i >> 2) & 1) * MAG_VOXEL_CHUNK_SIZE),
+            (float)(((i >> 1) & 1) * MAG_VOXEL_CHUNK_SIZE),
+            (float)((i & 1) * MAG_VOXEL_CHUNK_SIZE),
+        };
+        contour_emit(regions + i, block->vertex_placement, states + i, 0, offset, base_vertex,
+            vertices + base_vertex, (char *)triangles + (uint64_t)base_index * index_stride, index_stride);
+        base_vertex += states[i].num_vertices;
+        base_index += states[i].num_indices;
+    }
+
+    bind_mesh(res_buf, io, block->out_mesh, num_vertices, block->inout_rbinder, block->inout_cbuffer);
+
+    backend->submit_resource_command_buffers(backend->inst, &res_buf, 1);
+    backend->destroy_resource_command_buffers(backend->inst, &res_buf, 1);
+}
+
+// A remesh cache keeps the vertex slot of every active cell and the quad slot of every sign-change
+// edge, plus CPU copies of the mesh. After an edit, only the cells in the dirty box get new
+// vertices and only the edges around them new quads. Freed slots are reused by later edits and
+// freed quads are made degenerate, so the GPU buffers are only patched over the range of the
+// changed slots.
+
+#define REGION_CELLS (MAG_VOXEL_REGION_SIZE - 1)
+#define NO_VERTEX UINT16_MAX
+#define NO_QUAD UINT32_MAX
+
+// A region has at most one vertex per cell, so the cached meshes always use 16-bit indices.
+TM_STATIC_ASSERT(REGION_CELLS * REGION_CELLS * REGION_CELLS < NO_VERTEX);
+
+enum { EDGE_AXIS_Z, EDGE_AXIS_Y, EDGE_AXIS_X };
+
+struct mag_voxel_remesh_cache_o
+{
+    tm_allocator_i *allocator;
+
+    // False until the first call to [[remesh_region()]].
+    bool valid;
+    contour_state_t state;
+
+    uint16_t cell_vertices[REGION_CELLS][REGION_CELLS][REGION_CELLS];
+    // Quad slot of the edge starting at sample (x, y, z), per axis.
+    uint32_t edge_quads[3][REGION_CELLS][REGION_CELLS][REGION_CELLS];
+
+    /* carray */ tm_vec3_t *vertices;
+    /* carray */ uint16_t *indices;
+    /* carray */ uint16_t *free_vertices;
+    /* carray */ uint32_t *free_quads;
+
+    // Size of the GPU buffers, zero if there are none.
+    uint32_t vertex_capacity;
+    uint32_t quad_capacity;
+};
+
+// Half-open range of the slots changed by an update.
+typedef struct slot_range_t
+{
+    uint32_t first, end;
+} slot_range_t;
+
+static inline void slot_range_add(slot_range_t *range, uint32_t slot)
+{
+    range->first = slot < range->first ? slot : range->first;
+    range->end = slot + 1 > range->end ? slot + 1 : range->end;
+}
+
+static mag_voxel_remesh_cache_o *create_remesh_cache(tm_allocator_i *allocator)
+{
+    mag_voxel_remesh_cache_o *cache = tm_alloc(allocator, sizeof(mag_voxel_remesh_cache_o));
+    *cache = (mag_voxel_remesh_cache_o) { .allocator = allocator };
+    return cache;
+}
+
+static void destroy_remesh_cache(mag_voxel_remesh_cache_o *cache)
+{
+    tm_carray_free(cache->vertices, cache->allocator);
+    tm_carray_free(cache->indices, cache->allocator);
+    tm_carray_free(cache->free_vertices, cache->allocator);
+    tm_carray_free(cache->free_quads, cache->allocator);
+    tm_free(cache->allocator, cache, sizeof(*cache));
+}
+
+static void reset_remesh_cache(mag_voxel_remesh_cache_o *cache, bool interior)
+{
+    contour_state_init(&cache->state, interior);
+    memset(cache->cell_vertices, 0xff, sizeof(cache->cell_vertices));
+    memset(cache->edge_quads, 0xff, sizeof(cache->edge_quads));
+    tm_carray_shrink(cache->vertices, 0);
+    tm_carray_shrink(cache->indices, 0);
+    tm_carray_shrink(cache->free_vertices, 0);
+    tm_carray_shrink(cache->free_quads, 0);
+    cache->valid = true;
+}
+
+static uint16_t alloc_vertex_slot(mag_voxel_remesh_cache_o *cache)
+{
+    if (tm_carray_size(cache->free_vertices))
+        return tm_carray_pop(cache->free_vertices);
+    tm_carray_push(cache->vertices, (tm_vec3_t) { 0 }, cache->allocator);
+    return (uint16_t)(tm_carray_size(cache->vertices) - 1);
+}
+
+static uint32_t alloc_quad_slot(mag_voxel_remesh_cache_o *cache)
+{
+    if (tm_carray_size(cache->free_quads))
+        return tm_carray_pop(cache->free_quads);
+    tm_carray_resize(cache->indices, tm_carray_size(cache->indices) + 6, cache->allocator);
+    return (uint32_t)(tm_carray_size(cache->indices) / 6 - 1);
+}
+
+// Builds the quad of a sign-change edge, with the same winding as [[contour_emit()]].
+static void edge_quad(const mag_voxel_remesh_cache_o *cache, uint32_t axis, int x, int y, int z, uint16_t quad[6])
+{
+    const uint32_t(*solid)[MAG_VOXEL_REGION_SIZE] = cache->state.solid;
+    const uint16_t(*prev)[REGION_CELLS] = cache->cell_vertices[x - 1];
+    const uint16_t(*cur)[REGION_CELLS] = cache->cell_vertices[x];
+
+    if (axis == EDGE_AXIS_Z) {
+        const int swap = (solid[x][y] >> (z + 1)) & 1 ? 2 : 0;
+        quad[2 - swap] = prev[y - 1][z];
+        quad[1] = cur[y - 1][z];
+        quad[0 + swap] = prev[y - 0][z];
+        quad[3 + swap] = prev[y - 0][z];
+        quad[4] = cur[y - 0][z];
+        quad[5 - swap] = cur[y - 1][z];
+    } else if (axis == EDGE_AXIS_Y) {
+        const int swap = (solid[x][y] >> z) & 1 ? 2 : 0;
+        quad[2 - swap] = prev[y][z - 1];
+        quad[1] = cur[y][z - 1];
+        quad[0 + swap] = prev[y][z - 0];
+        quad[3 + swap] = prev[y][z - 0];
+        quad[4] = cur[y][z - 0];
+        quad[5 - swap] = cur[y][z - 1];
+    } else {
+        const int swap = (solid[x + 1][y] >> z) & 1 ? 2 : 0;
+        quad[0 + swap] = cur[y - 1][z - 0];
+        quad[1] = cur[y - 0][z - 1];
+        quad[2 - swap] = cur[y - 1][z - 1];
+        quad[3 + swap] = cur[y - 1][z - 0];
+        quad[4] = cur[y - 0][z - 0];
+        quad[5 - swap] = cur[y - 0][z - 1];
+    }
+}
+
+// Rewrites the quads of the edges in `candidates` of row (x, y) along `axis`. The edges in
+// `changes` get a quad, the others lose theirs.
+static void update_edge_quads(mag_voxel_remesh_cache_o *cache, uint32_t axis, int x, int y, uint32_t candidates, uint32_t changes,
+    slot_range_t *quad_range)
+{
+    while (candidates) {
+        const int z = (int)lowest_bit_index(candidates);
+        candidates &= candidates - 1;
+
+        uint32_t *slot = &cache->edge_quads[axis][x][y][z];
+        if ((changes >> z) & 1) {
+            if (*slot == NO_QUAD)
+                *slot = alloc_quad_slot(cache);
+            edge_quad(cache, axis, x, y, z, cache->indices + *slot * 6);
+            slot_range_add(quad_range, *slot);
+        } else if (*slot != NO_QUAD) {
+            memset(cache->indices + *slot * 6, 0, 6 * sizeof(uint16_t));
+            slot_range_add(quad_range, *slot);
+            tm_carray_push(cache->free_quads, *slot, cache->allocator);
+            *slot = NO_QUAD;
+        }
+    }
+}
+
+// Recomputes the cells in the box [min, max] and all edges with a quad that uses one of them.
+static void remesh_box(mag_voxel_remesh_cache_o *cache, const region_view_t *region, mag_voxel_vertex_placement placement,
+    const contour_seams_t *seams, const int min[3], const int max[3], slot_range_t *vertex_range, slot_range_t *quad_range)
+{
+    contour_state_t *state = &cache->state;
+    for (int x = min[0]; x <= max[0] + 1; ++x) {
+        for (int y = min[1]; y <= max[1] + 1; ++y)
+            state->solid[x][y] = row_solid_mask(region, x, y);
+    }
+
+    mag_voxel_seam_t *own_seam = seams ? seams->own : 0;
+    for (int x = min[0]; x <= max[0]; ++x) {
+        for (int y = min[1]; y <= max[1]; ++y) {
+            const uint32_t active = row_vertex_cells(state, x, y);
+            for (int z = min[2]; z <= max[2]; ++z) {
+                const bool is_active = (active >> z) & 1;
+                uint16_t *slot = &cache->cell_vertices[x][y][z];
+
+                // The region's own seam is rebuilt along with the cells that are on it.
+                const bool on_seam = own_seam && x < state->hi && y < state->hi && z < state->hi
+                    && (x == state->lo || y == state->lo || z == state->lo);
+                if (on_seam) {
+                    int face, u, v;
+                    seam_slot(x - state->lo, y - state->lo, z - state->lo, &face, &u, &v);
+                    own_seam->has_vertex[face][u] &= ~((uint32_t)1 << v);
+                    if (is_active) {
+                        own_seam->vertices[face][u][v] = dc_cell_vertex(region, placement, x, y, z);
+                        own_seam->has_vertex[face][u] |= (uint32_t)1 << v;
+                    }
+                }
+
+                if (is_active) {
+                    if (*slot == NO_VERTEX)
+                        *slot = alloc_vertex_slot(cache);
+                    cache->vertices[*slot] = cell_vertex(region, placement, state, seams, x, y, z);
+                    slot_range_add(vertex_range, *slot);
+                } else if (*slot != NO_VERTEX) {
+                    tm_carray_push(cache->free_vertices, *slot, cache->allocator);
+                    *slot = NO_VERTEX;
+                }
+            }
+        }
+    }
+
+    // An edge along an axis is used by the cells before and after it on the other two axes.
+    const int edge_max_x = tm_min(max[0] + 1, state->hi), edge_max_y = tm_min(max[1] + 1, state->hi);
+    const uint32_t along_z = bit_range(min[2], max[2]), across_z = bit_range(min[2], tm_min(max[2] + 1, state->hi));
+    for (int x = min[0]; x <= edge_max_x; ++x) {
+        for (int y = min[1]; y <= edge_max_y; ++y) {
+            uint32_t z_changes, y_changes, x_changes;
+            row_edge_changes(state, x, y, &z_changes, &y_changes, &x_changes);
+            update_edge_quads(cache, EDGE_AXIS_Z, x, y, along_z, z_changes, quad_range);
+            if (y <= max[1])
+                update_edge_quads(cache, EDGE_AXIS_Y, x, y, across_z, y_changes, quad_range);
+            if (x <= max[0])
+                update_edge_quads(cache, EDGE_AXIS_X, x, y, across_z, x_changes, quad_range);
+        }
+    }
+}
+
+// Uploads the changed slots of the cache to the mesh. The buffers are patched in place if they
+// are large enough, otherwise they are replaced with larger ones.
+static void upload_remesh(mag_voxel_remesh_cache_o *cache, tm_renderer_resource_command_buffer_o *res_buf, mag_voxel_mesh_t *mesh,
+    slot_range_t vertex_range, slot_range_t quad_range)
+{
+    const struct tm_renderer_resource_command_buffer_api *res_api = tm_renderer_api->tm_renderer_resource_command_buffer_api;
+    const uint32_t num_vertices = (uint32_t)tm_carray_size(cache->vertices);
+    const uint32_t num_quads = (uint32_t)(tm_carray_size(cache->indices) / 6);
+
+    if (num_vertices > cache->vertex_capacity || num_quads > cache->quad_capacity) {
+        if (cache->vertex_capacity) {
+            res_api->destroy_resource(res_buf, mesh->vbuf);
+            res_api->destroy_resource(res_buf, mesh->ibuf);
+        }
+
+        // Leave room for edits to add geometry without replacing the buffers every time.
+        cache->vertex_capacity = tm_min(num_vertices + num_vertices / 4 + 64, NO_VERTEX);
+        cache->quad_capacity = num_quads + num_quads / 4 + 64;
+
+        tm_vec3_t *vertices;
+        void *triangles;
+        create_mesh_buffers(res_buf, cache->vertex_capacity, cache->quad_capacity * 6, mesh, &vertices, &triangles);
+        memcpy(vertices, cache->vertices, num_vertices * sizeof(tm_vec3_t));
+        memcpy(triangles, cache->indices, num_quads * 6 * sizeof(uint16_t));
+    } else {
+        void *data;
+        if (vertex_range.first < vertex_range.end) {
+            const uint32_t n = vertex_range.end - vertex_range.first;
+            res_api->map_update_buffer(res_buf, mesh->vbuf, vertex_range.first * sizeof(tm_vec3_t), n * sizeof(tm_vec3_t),
+                TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, 0, &data);
+            memcpy(data, cache->vertices + vertex_range.first, n * sizeof(tm_vec3_t));
+        }
+        if (quad_range.first < quad_range.end) {
+            const uint32_t n = quad_range.end - quad_range.first;
+            res_api->map_update_buffer(res_buf, mesh->ibuf, quad_range.first * 6 * sizeof(uint16_t), n * 6 * sizeof(uint16_t),
+                TM_RENDERER_DEVICE_AFFINITY_MASK_ALL, 0, &data);
+            memcpy(data, cache->indices + quad_range.first * 6, n * 6 * sizeof(uint16_t));
+        }
+    }
+    mesh->num_indices = num_quads * 6;
+}
+
+static void remesh_region(const mag_voxel_contour_job_t *job, mag_voxel_remesh_cache_o *cache, const mag_voxel_cell_box_t *dirty,
+    tm_renderer_backend_i *backend, tm_shader_io_o *io)
+{
+    const region_view_t view = contour_job_view(job);
+    const contour_seams_t seams = contour_job_seams(job);
+    const contour_seams_t *job_seams = job->interior ? &seams : 0;
+
+    contour_state_t bounds;
+    contour_state_init(&bounds, job->interior);
+    if (!cache->valid || cache->state.lo != bounds.lo)
+        dirty = 0;
+
+    int min[3], max[3];
+    for (int i = 0; i < 3; ++i) {
+        min[i] = dirty ? tm_max(dirty->min[i], bounds.lo) : bounds.lo;
+        max[i] = dirty ? tm_min(dirty->max[i], bounds.hi) : bounds.hi;
+        if (min[i] > max[i])
+            return;
+    }
+
+    if (!dirty) {
+        reset_remesh_cache(cache, job->interior);
+        region_solid_masks(&view, cache->state.solid);
+    }
+
+    slot_range_t vertex_range = { UINT32_MAX, 0 }, quad_range = { UINT32_MAX, 0 };
+    remesh_box(cache, &view, job->vertex_placement, job_seams, min, max, &vertex_range, &quad_range);
+
+    const uint32_t num_vertices = (uint32_t)tm_carray_size(cache->vertices);
+    if (!cache->vertex_capacity && num_vertices < MIN_MESH_VERTICES) {
+        *job->out_mesh = (mag_voxel_mesh_t) { 0 };
+        return;
+    }
+
+    tm_renderer_resource_command_buffer_o *res_buf;
+    backend->create_resource_command_buffers(backend->inst, &res_buf, 1);
+
+    upload_remesh(cache, res_buf, job->out_mesh, vertex_range, quad_range);
+    bind_mesh(res_buf, io, job->out_mesh, num_vertices, job->inout_rbinder, job->inout_cbuffer);
+
+    backend->submit_resource_command_buffers(backend->inst, &res_buf, 1);
+    backend->destroy_resource_command_buffers(backend->inst, &res_buf, 1);
+}
+
+static struct mag_voxel_api mag_voxel_api = {
+    .dual_contour_region = dual_contour_region,
+    .dual_contour_soa_region = dual_contour_soa_region,
+    .dual_contour_soa16_region = dual_contour_soa16_region,
+    .dual_contour_regions = dual_contour_regions,
+    .dual_contour_job = dual_contour_job,
+    .dual_contour_block = dual_contour_block,
+    .create_remesh_cache = create_remesh_cache,
+    .destroy_remesh_cache = destroy_remesh_cache,
+    .remesh_region = remesh_region,
+};
+
+typedef struct aabb_t
+{
+    tm_vec3_t center;
+    tm_vec3_t half_size;
+} aabb_t;
+
+static aabb_t aabb_from_min_max(tm_vec3_t min, tm_vec3_t max)
+{
+    tm_vec3_t half_size = tm_vec3_mul(tm_vec3_sub(max, min), 0.5f);
+    tm_vec3_t center = tm_vec3_add(min, half_size);
+    return (aabb_t) { center, half_size };
+}
+
+typedef mag_region_tree_entry_t mag_tree_region_t;
+
+#define LEAF_BLOCK_SIZE 16
+#define SPLIT_THRESHOLD LEAF_BLOCK_SIZE
+#define COLLAPSE_THRESHOLD 8
+// Leaves at this depth don't split any more and chain blocks instead.
+#define MAX_TREE_DEPTH 20
+#define NO_BLOCK UINT32_MAX
+#define NO_LOCATION UINT64_MAX
+#define MAX_TREE_READERS 64
+// Snapshots kept for reuse by [[octree_publish()]]. More are only needed while readers lag behind.
+#define MAX_UNUSED_SNAPSHOTS 2
+// Nodes and leaf blocks are copied to reused snapshots in pages of this many.
+#define TREE_NODE_PAGE_SIZE 64
+#define TREE_BLOCK_PAGE_SIZE 8
+
+// The regions of a leaf are stored inline in a block, so a leaf visit reads a single run of memory.
+typedef struct mag_tree_leaf_block_t
+{
+    mag_tree_region_t regions[LEAF_BLOCK_SIZE];
+    // Next block of a leaf at `MAX_TREE_DEPTH`, or next free block.
+    uint32_t next;
+} mag_tree_leaf_block_t;
+
+typedef struct mag_region_tree_node_t
+{
+    // Union of the AABBs of the regions in the subtree. The regions are bucketed by their center,
+    // so this can extend beyond the node's cell. Removals don't shrink it.
+    tm_vec3_t bounds_min;
+    tm_vec3_t bounds_max;
+    // Index of the first of the eight children, which are stored next to each other in Morton
+    // order. Zero for leaves, since the root is never a child. Next free group in the free list.
+    uint32_t first_child;
+    // First block of a leaf, `NO_BLOCK` if the leaf is empty.
+    uint32_t first_block;
+    // Number of regions in the subtree.
+    uint32_t num_regions;
+    // Parent of the node, unused for the root.
+    uint32_t parent;
+    // Children with at least one region.
+    uint8_t child_mask;
+} mag_region_tree_node_t;
+
+enum tree_change_kind {
+    TREE_CHANGE_NODE_PAGE,
+    TREE_CHANGE_BLOCK_PAGE,
+    TREE_CHANGE_KEY,
+};
+
+// Entry of the log that [[octree_publish()]] brings reused snapshots up to date with.
+typedef struct tree_change_t
+{
+    uint64_t version;
+    // Index of the page, or the key whose location changed.
+    uint64_t index;
+    enum tree_change_kind kind;
+    TM_PAD(4);
+} tree_change_t;
+
+typedef struct mag_region_tree_t
+{
+    // Node 0 is the root. Nodes and blocks refer to each other by index, so the pools can grow.
+    /* carray */ mag_region_tree_node_t *nodes;
+    /* carray */ mag_tree_leaf_block_t *blocks;
+    // Heads of the free lists, 0 and `NO_BLOCK` if empty.
+    uint32_t free_group;
+    uint32_t free_block;
+    // Where each key is stored, as `node << 32 | slot`.
+    struct TM_HASH_T(uint64_t, uint64_t) key_locations;
+    aabb_t aabb;
+    tm_allocator_i *allocator;
+    // Snapshots for concurrent readers, zero in the snapshots themselves.
+    struct tree_snapshots_t *snapshots;
+    // In the tree, the version that the changes since the last [[octree_publish()]] are published
+    // as. In a snapshot, the version it holds, 0 until it's first published.
+    uint64_t version;
+    // Changes that the snapshots which may still be reused don't have yet, in version order. Zero
+    // in the snapshots.
+    /* carray */ tree_change_t *changes;
+    // Version of the last change to each page of nodes and blocks, so that each page is logged once
+    // per version. Zero in the snapshots.
+    /* carray */ uint64_t *node_page_versions;
+    /* carray */ uint64_t *block_page_versions;
+    // Set when regions were added or removed since the last [[octree_publish()]].
+    bool unpublished_changes;
+    TM_PAD(7);
+} mag_region_tree_t;
+
+// Epoch of an active reader, or 0 if the slot is free. On its own cache line, since each reader
+// writes it on begin and end.
+typedef struct tree_reader_slot_t
+{
+    atomic_uint_least64_t epoch;
+    TM_PAD(56);
+} tree_reader_slot_t;
+
+typedef struct retired_snapshot_t
+{
+    mag_region_tree_t *snapshot;
+    // Epoch at which the snapshot was replaced. Readers that pinned a later epoch can't see it.
+    uint64_t epoch;
+} retired_snapshot_t;
+
+typedef struct tree_snapshots_t
+{
+    // The published `mag_region_tree_t *`.
+    atomic_uint_least64_t current;
+    // Incremented by each publish, starts at 1.
+    atomic_uint_least64_t epoch;
+    // Where the next reader starts looking for a free slot.
+    atomic_uint_least32_t next_reader;
+    TM_PAD(4);
+    tree_reader_slot_t readers[MAX_TREE_READERS];
+
+    // Only touched by the writer.
+    /* carray */ retired_snapshot_t *retired;
+    /* carray */ mag_region_tree_t **unused;
+} tree_snapshots_t;
+
+static aabb_t tree_region_aabb(tm_vec3_t region_pos, float cell_size)
+{
+    float region_size = (float)MAG_VOXEL_CHUNK_SIZE * cell_size;
+    float half_size = region_size * 0.5f;
+    tm_vec3_t half_size_vec = { half_size, half_size, half_size };
+    return (aabb_t) { tm_vec3_add(region_pos, half_size_vec), half_size_vec };
+}
+
+static aabb_t child_aabb(uint32_t child_idx, const aabb_t *node_aabb)
+{
+    tm_vec3_t child_half_size = tm_vec3_mul(node_aabb->half_size, 0.5f);
+    tm_vec3_t center_diff = {
+        child_idx & 1 ? child_half_size.x : -child_half_size.x,
+        child_idx & 2 ? child_half_size.y : -child_half_size.y,
+        child_idx & 4 ? child_half_size.z : -child_half_size.z,
+    };
+    tm_vec3_t child_center = tm_vec3_add(node_aabb->center, center_diff);
+
+    return (aabb_t) { child_center, child_half_size };
+}
+
+static uint32_t child_idx_for_point(tm_vec3_t node_center, tm_vec3_t point)
+{
+    tm_vec3_t obj_center_diff = tm_vec3_sub(point, node_center);
+    uint32_t child_i = 0;
+    child_i |= obj_center_diff.x >= 0 ? 1 : 0;
+    child_i |= obj_center_diff.y >= 0 ? 2 : 0;
+    child_i |= obj_center_diff.z >= 0 ? 4 : 0;
+    return child_i;
+}
+
+static inline bool bounds_intersect(tm_vec3_t amin, tm_vec3_t amax, tm_vec3_t bmin, tm_vec3_t bmax)
+{
+    return amin.x <= bmax.x && amax.x >= bmin.x && amin.y <= bmax.y && amax.y >= bmin.y && amin.z <= bmax.z && amax.z >= bmin.z;
+}
+
+static inline void region_bounds(const mag_tree_region_t *region, tm_vec3_t *min, tm_vec3_t *max)
+{
+    const float size = (float)MAG_VOXEL_CHUNK_SIZE * region->cell_size;
+    *min = region->pos;
+    *max = tm_vec3_add(region->pos, (tm_vec3_t) { size, size, size });
+}
+
+static inline void grow_node_bounds(mag_region_tree_node_t *node, const mag_tree_region_t *region)
+{
+    tm_vec3_t min, max;
+    region_bounds(region, &min, &max);
+    node->bounds_min = tm_vec3_min(node->bounds_min, min);
+    node->bounds_max = tm_vec3_max(node->bounds_max, max);
+}
+
+static inline mag_region_tree_node_t empty_leaf(void)
+{
+    return (mag_region_tree_node_t) {
+        .bounds_min = { FLT_MAX, FLT_MAX, FLT_MAX },
+        .bounds_max = { -FLT_MAX, -FLT_MAX, -FLT_MAX },
+        .first_block = NO_BLOCK,
+    };
+}
+
+static void log_change(mag_region_tree_t *octree, enum tree_change_kind kind, uint64_t index)
+{
+    const tree_change_t change = { .version = octree->version, .index = index, .kind = kind };
+    tm_carray_push(octree->changes, change, octree->allocator);
+    octree->unpublished_changes = true;
+}
+
+static void touch_page(mag_region_tree_t *octree, uint64_t **page_versions, uint32_t page, enum tree_change_kind kind)
+{
+    while (tm_carray_size(*page_versions) <= page)
+        tm_carray_push(*page_versions, 0, octree->allocator);
+    if ((*page_versions)[page] != octree->version) {
+        (*page_versions)[page] = octree->version;
+        log_change(octree, kind, page);
+    }
+}
+
+// Returns the node for writing. All writes to the nodes and blocks go through these, so that the
+// next publish knows which pages to copy.
+static mag_region_tree_node_t *write_node(mag_region_tree_t *octree, uint32_t node_i)
+{
+    touch_page(octree, &octree->node_page_versions, node_i / TREE_NODE_PAGE_SIZE, TREE_CHANGE_NODE_PAGE);
+    return octree->nodes + node_i;
+}
+
+static mag_tree_leaf_block_t *write_block(mag_region_tree_t *octree, uint32_t block)
+{
+    touch_page(octree, &octree->block_page_versions, block / TREE_BLOCK_PAGE_SIZE, TREE_CHANGE_BLOCK_PAGE);
+    return octree->blocks + block;
+}
+
+static void set_key_location(mag_region_tree_t *octree, uint64_t key, uint64_t location)
+{
+    tm_hash_add(&octree->key_locations, key, location);
+    log_change(octree, TREE_CHANGE_KEY, key);
+}
+
+static void remove_key_location(mag_region_tree_t *octree, uint64_t key)
+{
+    tm_hash_remove(&octree->key_locations, key);
+    log_change(octree, TREE_CHANGE_KEY, key);
+}
+
+static uint32_t alloc_leaf_block(mag_region_tree_t *octree)
+{
+    uint32_t block = octree->free_block;
+    if (block != NO_BLOCK) {
+        octree->free_block = octree->blocks[block].next;
+    } else {
+        block = (uint32_t)tm_carray_size(octree->blocks);
+        tm_carray_resize(octree->blocks, block + 1, octree->allocator);
+    }
+    write_block(octree, block)->next = NO_BLOCK;
+    return block;
+}
+
+static void free_leaf_block(mag_region_tree_t *octree, uint32_t block)
+{
+    write_block(octree, block)->next = octree->free_block;
+    octree->free_block = block;
+}
+
+// Allocates eight empty leaves and returns the index of the first one.
+static uint32_t alloc_child_group(mag_region_tree_t *octree, uint32_t parent)
+{
+    uint32_t first = octree->free_group;
+    if (first) {
+        octree->free_group = octree->nodes[first].first_child;
+    } else {
+        first = (uint32_t)tm_carray_size(octree->nodes);
+        tm_carray_resize(octree->nodes, first + 8, octree->allocator);
+    }
+    for (uint32_t i = 0; i < 8; ++i) {
+        mag_region_tree_node_t *node = write_node(octree, first + i);
+        *node = empty_leaf();
+        node->parent = parent;
+    }
+    return first;
+}
+
+static void free_child_group(mag_region_tree_t *octree, uint32_t first)
+{
+    write_node(octree, first)->first_child = octree->free_group;
+    octree->free_group = first;
+}
+
+// Returns the block that holds region `i` of a leaf.
+static uint32_t leaf_block(const mag_region_tree_t *octree, const mag_region_tree_node_t *node, uint32_t i)
+{
+    uint32_t block = node->first_block;
+    for (; i >= LEAF_BLOCK_SIZE; i -= LEAF_BLOCK_SIZE)
+        block = octree->blocks[block].next;
+    return block;
+}
+
+// Returns region `i` of a leaf.
+static mag_tree_region_t *leaf_region(mag_region_tree_t *octree, const mag_region_tree_node_t *node, uint32_t i)
+{
+    return octree->blocks[leaf_block(octree, node, i)].regions + i % LEAF_BLOCK_SIZE;
+}
+
+static mag_tree_region_t *write_leaf_region(mag_region_tree_t *octree, const mag_region_tree_node_t *node, uint32_t i)
+{
+    return write_block(octree, leaf_block(octree, node, i))->regions + i % LEAF_BLOCK_SIZE;
+}
+
+static inline uint64_t key_location(uint32_t node_i, uint32_t slot)
+{
+    return ((uint64_t)node_i << 32) | slot;
+}
+
+static void leaf_add(mag_region_tree_t *octree, uint32_t node_i, mag_tree_region_t region)
+{
+    mag_region_tree_node_t *node = write_node(octree, node_i);
+    if (node->num_regions % LEAF_BLOCK_SIZE == 0) {
+        const uint32_t block = alloc_leaf_block(octree);
+        if (node->first_block == NO_BLOCK) {
+            node->first_block = block;
+        } else {
+            uint32_t last = node->first_block;
+            while (octree->blocks[last].next != NO_BLOCK)
+                last = octree->blocks[last].next;
+            write_block(octree, last)->next = block;
+        }
+    }
+    const uint32_t slot = node->num_regions++;
+    *write_leaf_region(octree, node, slot) = region;
+    grow_node_bounds(node, &region);
+    set_key_location(octree, region.key, key_location(node_i, slot));
+}
+
+// Moves the last region of the leaf into `slot`. The key locations are only updated if they point
+// at the slots being changed, so that a duplicate key elsewhere in the tree keeps its location. If
+// the removed region was the tracked copy of its key, another copy in the same leaf takes over.
+static void leaf_remove_at(mag_region_tree_t *octree, uint32_t node_i, uint32_t slot)
+{
+    mag_region_tree_node_t *node = write_node(octree, node_i);
+    mag_tree_region_t *region = write_leaf_region(octree, node, slot);
+    const uint64_t key = region->key;
+    const bool tracked = tm_hash_get_default(&octree->key_locations, key, NO_LOCATION) == key_location(node_i, slot);
+    if (tracked)
+        remove_key_location(octree, key);
+
+    const uint32_t last = --node->num_regions;
+    if (slot != last) {
+        *region = *leaf_region(octree, node, last);
+        if (tm_hash_get_default(&octree->key_locations, region->key, NO_LOCATION) == key_location(node_i, last))
+            set_key_location(octree, region->key, key_location(node_i, slot));
+    }
+
+    if (tracked) {
+        for (uint32_t i = 0; i < node->num_regions; ++i) {
+            if (leaf_region(octree, node, i)->key == key) {
+                set_key_location(octree, key, key_location(node_i, i));
+                break;
+            }
+        }
+    }
+
+    if (last % LEAF_BLOCK_SIZE == 0) {
+        // the last block is empty now
+        const uint32_t first = node->first_block;
+        if (octree->blocks[first].next == NO_BLOCK) {
+            free_leaf_block(octree, first);
+            node->first_block = NO_BLOCK;
+        } else {
+            uint32_t prev = first;
+            while (octree->blocks[octree->blocks[prev].next].next != NO_BLOCK)
+                prev = octree->blocks[prev].next;
+            free_leaf_block(octree, octree->blocks[prev].next);
+            write_block(octree, prev)->next = NO_BLOCK;
+        }
+    }
+}
+
+static bool leaf_remove(mag_region_tree_t *octree, uint32_t node_i, uint64_t key)
+{
+    const uint64_t location = tm_hash_get_default(&octree->key_locations, key, NO_LOCATION);
+    if (location != NO_LOCATION && (uint32_t)(location >> 32) == node_i) {
+        leaf_remove_at(octree, node_i, (uint32_t)location);
+        return true;
+    }
+
+    // Duplicate keys are only found by searching the leaf.
+    const mag_region_tree_node_t *node = octree->nodes + node_i;
+    for (uint32_t i = 0; i < node->num_regions; ++i) {
+        if (leaf_region(octree, node, i)->key == key) {
+            leaf_remove_at(octree, node_i, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void octree_publish(mag_region_tree_t *octree);
+
+static mag_region_tree_t *octree_create(tm_allocator_i *allocator, tm_vec3_t min, tm_vec3_t max)
+{
+    mag_region_tree_t *result = tm_alloc(allocator, sizeof(mag_region_tree_t));
+    *result = (mag_region_tree_t) {
         .allocator = allocator,
         .aabb = aabb_from_min_max(min, max),
-        .nodes = { .allocator = allocator },
+        .free_block = NO_BLOCK,
+        .key_locations = { .allocator = allocator },
+        .snapshots = tm_alloc(allocator, sizeof(tree_snapshots_t)),
+        .version = 1,
+        .unpublished_changes = true,
     };
+    *result->snapshots = (tree_snapshots_t) { .epoch = 1 };
+    tm_carray_push(result->nodes, empty_leaf(), allocator);
+    // So that readers always find a snapshot.
+    octree_publish(result);
     return result;
 }
 
-static void octree_free_regions_recur(mag_region_tree_t *octree, uint64_t node_id, mag_region_tree_node_t *node)
+static void octree_free(mag_region_tree_t *octree)
 {
-    uint8_t child_mask = node->child_mask;
-    if (child_mask) {
-        for (uint32_t i = 0; i < 8; ++i) {
-            if (child_mask & ((uint8_t)1 << i)) {
-                uint64_t child_id = (node_id << 3) | i;
-                octree_free_regions_recur(octree, child_id, tm_hash_get_ptr(&octree->nodes, child_id));
-            }
+    tm_carray_free(octree->nodes, octree->allocator);
+    tm_carray_free(octree->blocks, octree->allocator);
+    tm_hash_free(&octree->key_locations);
+    tm_carray_free(octree->changes, octree->allocator);
+    tm_carray_free(octree->node_page_versions, octree->allocator);
+    tm_carray_free(octree->block_page_versions, octree->allocator);
+    tm_free(octree->allocator, octree, sizeof(*octree));
+}
+
+static void octree_destroy(mag_region_tree_t *octree)
+{
+    tree_snapshots_t *snapshots = octree->snapshots;
+    octree_free((mag_region_tree_t *)(uintptr_t)snapshots->current);
+    for (const retired_snapshot_t *r = snapshots->retired; r != tm_carray_end(snapshots->retired); ++r)
+        octree_free(r->snapshot);
+    for (mag_region_tree_t **s = snapshots->unused; s != tm_carray_end(snapshots->unused); ++s)
+        octree_free(*s);
+    tm_carray_free(snapshots->retired, octree->allocator);
+    tm_carray_free(snapshots->unused, octree->allocator);
+    tm_free(octree->allocator, snapshots, sizeof(*snapshots));
+    octree_free(octree);
+}
+
+// Copies all of `src` into the new snapshot `dst`.
+static void copy_tree(mag_region_tree_t *dst, const mag_region_tree_t *src)
+{
+    tm_carray_resize(dst->nodes, tm_carray_size(src->nodes), dst->allocator);
+    memcpy(dst->nodes, src->nodes, tm_carray_bytes(src->nodes));
+    tm_carray_resize(dst->blocks, tm_carray_size(src->blocks), dst->allocator);
+    if (src->blocks)
+        memcpy(dst->blocks, src->blocks, tm_carray_bytes(src->blocks));
+
+    // The hash is copied bucket by bucket, so lookups probe the same way as in `src`.
+    if (dst->key_locations.num_buckets != src->key_locations.num_buckets) {
+        tm_hash_free(&dst->key_locations);
+        const uint32_t num_buckets = src->key_locations.num_buckets;
+        dst->key_locations.keys = tm_alloc(dst->allocator, num_buckets * sizeof(uint64_t));
+        dst->key_locations.values = tm_alloc(dst->allocator, num_buckets * sizeof(uint64_t));
+        dst->key_locations.num_buckets = num_buckets;
+    }
+    if (src->key_locations.num_buckets) {
+        memcpy(dst->key_locations.keys, src->key_locations.keys, src->key_locations.num_buckets * sizeof(uint64_t));
+        memcpy(dst->key_locations.values, src->key_locations.values, src->key_locations.num_buckets * sizeof(uint64_t));
+    }
+    dst->key_locations.num_used = src->key_locations.num_used;
+}
+
+// Brings the reused snapshot `dst` up to date with `src` by copying only the pages and keys that
+// changed after the version it holds.
+static void update_tree(mag_region_tree_t *dst, const mag_region_tree_t *src)
+{
+    const uint64_t num_nodes = tm_carray_size(src->nodes);
+    const uint64_t num_blocks = tm_carray_size(src->blocks);
+    tm_carray_resize(dst->nodes, num_nodes, dst->allocator);
+    tm_carray_resize(dst->blocks, num_blocks, dst->allocator);
+
+    for (const tree_change_t *c = src->changes; c != tm_carray_end(src->changes); ++c) {
+        if (c->version <= dst->version)
+            continue;
+        switch (c->kind) {
+        case TREE_CHANGE_NODE_PAGE: {
+            const uint64_t first = c->index * TREE_NODE_PAGE_SIZE;
+            const uint64_t n = tm_min(num_nodes - first, (uint64_t)TREE_NODE_PAGE_SIZE);
+            memcpy(dst->nodes + first, src->nodes + first, n * sizeof(*src->nodes));
+        } break;
+        case TREE_CHANGE_BLOCK_PAGE: {
+            const uint64_t first = c->index * TREE_BLOCK_PAGE_SIZE;
+            const uint64_t n = tm_min(num_blocks - first, (uint64_t)TREE_BLOCK_PAGE_SIZE);
+            memcpy(dst->blocks + first, src->blocks + first, n * sizeof(*src->blocks));
+        } break;
+        case TREE_CHANGE_KEY: {
+            const uint64_t location = tm_hash_get_default(&src->key_locations, c->index, NO_LOCATION);
+            if (location == NO_LOCATION)
+                tm_hash_remove(&dst->key_locations, c->index);
+            else
+                tm_hash_add(&dst->key_locations, c->index, location);
+        } break;
         }
-    } else {
-        tm_carray_free(node->regions, octree->allocator);
     }
 }
 
-static void octree_destroy(mag_region_tree_t *octree)
+// Drops the changes that the current snapshot and every snapshot that may be reused already hold.
+static void trim_changes(mag_region_tree_t *octree)
 {
-    octree_free_regions_recur(octree, 1, &octree->root);
-    tm_hash_free(&octree->nodes);
-    tm_free(octree->allocator, octree, sizeof(*octree));
+    const tree_snapshots_t *snapshots = octree->snapshots;
+    uint64_t oldest = ((const mag_region_tree_t *)(uintptr_t)snapshots->current)->version;
+    for (const retired_snapshot_t *r = snapshots->retired; r != tm_carray_end(snapshots->retired); ++r)
+        oldest = tm_min(oldest, r->snapshot->version);
+    for (mag_region_tree_t *const *s = snapshots->unused; s != tm_carray_end(snapshots->unused); ++s)
+        oldest = tm_min(oldest, (*s)->version);
+
+    const uint64_t num_changes = tm_carray_size(octree->changes);
+    uint64_t first = 0;
+    while (first < num_changes && octree->changes[first].version <= oldest)
+        ++first;
+    if (first) {
+        memmove(octree->changes, octree->changes + first, (num_changes - first) * sizeof(*octree->changes));
+        tm_carray_shrink(octree->changes, num_changes - first);
+    }
+}
+
+// Readers pin the epoch before loading the snapshot. A snapshot replaced at epoch `e` can only have
+// been loaded by readers that pinned `e` or earlier, so it's reused once every active reader pinned
+// a later epoch.
+static void octree_publish(mag_region_tree_t *octree)
+{
+    tree_snapshots_t *snapshots = octree->snapshots;
+    if (octree->unpublished_changes) {
+        mag_region_tree_t *snapshot = tm_carray_size(snapshots->unused) ? tm_carray_pop(snapshots->unused) : 0;
+        if (!snapshot) {
+            snapshot = tm_alloc(octree->allocator, sizeof(mag_region_tree_t));
+            *snapshot = (mag_region_tree_t) {
+                .allocator = octree->allocator,
+                .key_locations = { .allocator = octree->allocator },
+            };
+        }
+        if (snapshot->version)
+            update_tree(snapshot, octree);
+        else
+            copy_tree(snapshot, octree);
+        snapshot->free_group = octree->free_group;
+        snapshot->free_block = octree->free_block;
+        snapshot->aabb = octree->aabb;
+        snapshot->version = octree->version++;
+        octree->unpublished_changes = false;
+
+        const uint64_t replaced = atomic_exchange_uint64_t(&snapshots->current, (uint64_t)(uintptr_t)snapshot);
+        const uint64_t epoch = atomic_fetch_add_uint64_t(&snapshots->epoch, 1);
+        if (replaced) {
+            const retired_snapshot_t retired = { (mag_region_tree_t *)(uintptr_t)replaced, epoch };
+            tm_carray_push(snapshots->retired, retired, octree->allocator);
+        }
+    }
+
+    uint64_t oldest_reader = UINT64_MAX;
+    for (uint32_t i = 0; i < MAX_TREE_READERS; ++i) {
+        const uint64_t epoch = atomic_fetch_add_uint64_t(&snapshots->readers[i].epoch, 0);
+        if (epoch)
+            oldest_reader = tm_min(oldest_reader, epoch);
+    }
+
+    uint32_t num_retired = 0;
+    for (uint32_t i = 0; i < tm_carray_size(snapshots->retired); ++i) {
+        if (snapshots->retired[i].epoch >= oldest_reader)
+            snapshots->retired[num_retired++] = snapshots->retired[i];
+        else if (tm_carray_size(snapshots->unused) < MAX_UNUSED_SNAPSHOTS)
+            tm_carray_push(snapshots->unused, snapshots->retired[i].snapshot, octree->allocator);
+        else
+            octree_free(snapshots->retired[i].snapshot);
+    }
+    tm_carray_shrink(snapshots->retired, num_retired);
+    trim_changes(octree);
+}
+
+static const mag_region_tree_t *octree_begin_read(mag_region_tree_t *octree, uint32_t *reader)
+{
+    tree_snapshots_t *snapshots = octree->snapshots;
+    for (uint32_t i = atomic_fetch_add_uint32_t(&snapshots->next_reader, 1);; ++i) {
+        tree_reader_slot_t *slot = snapshots->readers + i % MAX_TREE_READERS;
+        const uint64_t epoch = atomic_fetch_add_uint64_t(&snapshots->epoch, 0);
+        uint64_t free_slot = 0;
+        if (atomic_compare_exchange_strong_uint64_t(&slot->epoch, &free_slot, epoch)) {
+            *reader = i % MAX_TREE_READERS;
+            return (const mag_region_tree_t *)(uintptr_t)atomic_fetch_add_uint64_t(&snapshots->current, 0);
+        }
+    }
+}
+
+static void octree_end_read(mag_region_tree_t *octree, uint32_t reader)
+{
+    atomic_exchange_uint64_t(&octree->snapshots->readers[reader].epoch, 0);
 }
 
-static void octree_query_recur(const mag_region_tree_t *octree, const aabb_t *aabb, tm_temp_allocator_i *ta, uint64_t **result, const mag_region_tree_node_t *node, const aabb_t *node_aabb, uint64_t node_id)
+static void octree_query_recur(const mag_region_tree_t *octree, tm_vec3_t min, tm_vec3_t max, tm_temp_allocator_i *ta, uint64_t **result, uint32_t node_i)
 {
-    if (!node->child_mask) {
-        for (uint64_t i = 0; i < tm_carray_size(node->regions); ++i) {
-            mag_tree_region_t *region = node->regions + i;
-            aabb_t region_aabb = tree_region_aabb(region->pos, region->cell_size);
-            if (aabb_intersect(aabb, &region_aabb)) {
-                tm_carray_temp_push(*result, region->key, ta);
+    const mag_region_tree_node_t *node = octree->nodes + node_i;
+    if (!bounds_intersect(min, max, node->bounds_min, node->bounds_max))
+        return;
+
+    if (!node->first_child) {
+        uint32_t remaining = node->num_regions;
+        for (uint32_t block = node->first_block; block != NO_BLOCK; block = octree->blocks[block].next) {
+            const mag_tree_region_t *regions = octree->blocks[block].regions;
+            const uint32_t n = tm_min(remaining, LEAF_BLOCK_SIZE);
+            for (uint32_t i = 0; i < n; ++i) {
+                tm_vec3_t region_min, region_max;
+                region_bounds(regions + i, &region_min, &region_max);
+                if (bounds_intersect(min, max, region_min, region_max))
+                    tm_carray_temp_push(*result, regions[i].key, ta);
             }
+            remaining -= n;
         }
     } else {
-        for (uint8_t i = 0; i < 8; ++i) {
-            if (node->child_mask & ((uint8_t)1 << i)) {
-                uint64_t child_id = (node_id << 3) | (uint64_t)i;
-                // TODO: actual hash
-                uint64_t child_hash = child_id;
-                aabb_t caabb = child_aabb(i, node_aabb);
-                if (aabb_intersect(aabb, &caabb)) {
-                    mag_region_tree_node_t *child = tm_hash_get_ptr(&octree->nodes, child_hash);
-                    octree_query_recur(octree, aabb, ta, result, child, &caabb, child_id);
+        for (uint32_t i = 0; i < 8; ++i) {
+            if (node->child_mask & ((uint8_t)1 << i))
+                octree_query_recur(octree, min, max, ta, result, node->first_child + i);
+        }
+    }
+}
+
+static uint64_t *octree_query(const mag_region_tree_t *octree, tm_vec3_t min, tm_vec3_t max, tm_temp_allocator_i *ta)
+{
+    uint64_t *result = NULL;
+    octree_query_recur(octree, min, max, ta, &result, 0);
+    return result;
+}
+
+// Each level of the batch traversal writes the queries that overlap the node to `scratch` and passes
+// the rest of it on to the children.
+static void octree_query_batch_recur(const mag_region_tree_t *octree, const tm_vec3_t *mins, const tm_vec3_t *maxs,
+    const uint32_t *queries, uint32_t num_queries, uint32_t *scratch, uint64_t **out_keys, tm_temp_allocator_i *ta, uint32_t node_i)
+{
+    const mag_region_tree_node_t *node = octree->nodes + node_i;
+    uint32_t *active = scratch;
+    uint32_t num_active = 0;
+    for (uint32_t i = 0; i < num_queries; ++i) {
+        if (bounds_intersect(mins[queries[i]], maxs[queries[i]], node->bounds_min, node->bounds_max))
+            active[num_active++] = queries[i];
+    }
+    if (!num_active)
+        return;
+
+    if (!node->first_child) {
+        uint32_t remaining = node->num_regions;
+        for (uint32_t block = node->first_block; block != NO_BLOCK; block = octree->blocks[block].next) {
+            const mag_tree_region_t *regions = octree->blocks[block].regions;
+            const uint32_t n = tm_min(remaining, LEAF_BLOCK_SIZE);
+            for (uint32_t r = 0; r < n; ++r) {
+                tm_vec3_t region_min, region_max;
+                region_bounds(regions + r, &region_min, &region_max);
+                for (uint32_t i = 0; i < num_active; ++i) {
+                    const uint32_t q = active[i];
+                    if (bounds_intersect(mins[q], maxs[q], region_min, region_max))
+                        tm_carray_temp_push(out_keys[q], regions[r].key, ta);
                 }
             }
+            remaining -= n;
+        }
+    } else {
+        for (uint32_t i = 0; i < 8; ++i) {
+            if (node->child_mask & ((uint8_t)1 << i))
+                octree_query_batch_recur(octree, mins, maxs, active, num_active, active + num_active, out_keys, ta, node->first_child + i);
         }
     }
 }
 
-static uint64_t *octree_query(const mag_region_tree_t *octree, tm_vec3_t min, tm_vec3_t max, tm_temp_allocator_i *ta)
+static void octree_query_batch(const mag_region_tree_t *octree, const tm_vec3_t *mins, const tm_vec3_t *maxs, uint32_t num_queries,
+    uint64_t **out_keys, tm_temp_allocator_i *ta)
 {
-    tm_vec3_t half_size = tm_vec3_mul(tm_vec3_sub(max, min), 0.5f);
-    tm_vec3_t center = tm_vec3_add(min, half_size);
-    aabb_t aabb = { center, half_size };
+    memset(out_keys, 0, num_queries * sizeof(*out_keys));
+    if (!num_queries)
+        return;
+
+    // Each level of the tree needs room for all the queries.
+    /* carray */ uint32_t *scratch = 0;
+    tm_carray_temp_resize(scratch, (uint64_t)num_queries * (MAX_TREE_DEPTH + 2), ta);
+    for (uint32_t i = 0; i < num_queries; ++i)
+        scratch[i] = i;
+    octree_query_batch_recur(octree, mins, maxs, scratch, num_queries, scratch + num_queries, out_keys, ta, 0);
+}
 
-    aabb_t cur_aabb = octree->aabb;
-    const mag_region_tree_node_t *cur_node = &octree->root;
-    uint64_t cur_id = 1;
-    uint64_t *result = NULL;
-    if (aabb_intersect(&aabb, &cur_aabb)) {
-        octree_query_recur(octree, &aabb, ta, &result, cur_node, &cur_aabb, cur_id);
+enum {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTING,
+    FRUSTUM_INSIDE,
+};
+
+// Classifies a box against the planes in `*plane_mask` and clears the planes that it is fully
+// inside of, so that the children don't test them again.
+static uint32_t classify_frustum_bounds(tm_vec3_t min, tm_vec3_t max, const tm_vec4_t planes[6], uint32_t *plane_mask)
+{
+    for (uint32_t i = 0; i < 6; ++i) {
+        if (!(*plane_mask & (1u << i)))
+            continue;
+
+        const tm_vec4_t p = planes[i];
+        // corners of the box furthest along and against the plane normal
+        const tm_vec3_t p_vertex = { p.x >= 0 ? max.x : min.x, p.y >= 0 ? max.y : min.y, p.z >= 0 ? max.z : min.z };
+        const tm_vec3_t n_vertex = { p.x >= 0 ? min.x : max.x, p.y >= 0 ? min.y : max.y, p.z >= 0 ? min.z : max.z };
+        if (p.x * p_vertex.x + p.y * p_vertex.y + p.z * p_vertex.z + p.w < 0)
+            return FRUSTUM_OUTSIDE;
+        if (p.x * n_vertex.x + p.y * n_vertex.y + p.z * n_vertex.z + p.w >= 0)
+            *plane_mask &= ~(1u << i);
     }
-    return result;
+    return *plane_mask ? FRUSTUM_INTERSECTING : FRUSTUM_INSIDE;
 }
 
-static mag_region_tree_node_t *octree_split_node(mag_region_tree_t *octree, mag_region_tree_node_t *node, uint64_t node_id, const aabb_t *node_aabb)
+static void octree_collect_subtree(const mag_region_tree_t *octree, uint32_t node_i, mag_region_tree_frustum_key_t **result, tm_temp_allocator_i *ta)
 {
-    uint8_t child_mask = 0;
-    mag_tree_region_t *child_regions[8] = { 0 };
-    for (uint64_t i = 0; i < tm_carray_size(node->regions); ++i) {
-        tm_vec3_t center = tree_region_aabb(node->regions[i].pos, node->regions[i].cell_size).center;
-        uint32_t child_i = child_idx_for_point(node_aabb->center, center);
-        tm_carray_push(child_regions[child_i], node->regions[i], octree->allocator);
-        child_mask |= ((uint8_t)1 << child_i);
+    const mag_region_tree_node_t *node = octree->nodes + node_i;
+    if (!node->first_child) {
+        uint32_t remaining = node->num_regions;
+        for (uint32_t block = node->first_block; block != NO_BLOCK; block = octree->blocks[block].next) {
+            const uint32_t n = tm_min(remaining, LEAF_BLOCK_SIZE);
+            for (uint32_t i = 0; i < n; ++i)
+                tm_carray_temp_push(*result, ((mag_region_tree_frustum_key_t) { .key = octree->blocks[block].regions[i].key, .inside = true }), ta);
+            remaining -= n;
+        }
+    } else {
+        for (uint32_t i = 0; i < 8; ++i) {
+            if (node->child_mask & ((uint8_t)1 << i))
+                octree_collect_subtree(octree, node->first_child + i, result, ta);
+        }
     }
+}
 
-    tm_carray_free(node->regions, octree->allocator);
-    node->regions = NULL;
-    node->child_mask = child_mask;
+static void octree_query_frustum_recur(const mag_region_tree_t *octree, const tm_vec4_t planes[6], uint32_t plane_mask,
+    mag_region_tree_frustum_key_t **result, tm_temp_allocator_i *ta, uint32_t node_i)
+{
+    const mag_region_tree_node_t *node = octree->nodes + node_i;
+    const uint32_t node_class = classify_frustum_bounds(node->bounds_min, node->bounds_max, planes, &plane_mask);
+    if (node_class == FRUSTUM_OUTSIDE)
+        return;
+    if (node_class == FRUSTUM_INSIDE) {
+        octree_collect_subtree(octree, node_i, result, ta);
+        return;
+    }
 
-    for (uint32_t i = 0; i < 8; ++i) {
-        if (child_regions[i]) {
-            uint64_t child_id = (node_id << 3) | i;
-            *tm_hash_add_reference(&octree->nodes, child_id) = (mag_region_tree_node_t) {
-                .regions = child_regions[i]
-            };
+    if (!node->first_child) {
+        uint32_t remaining = node->num_regions;
+        for (uint32_t block = node->first_block; block != NO_BLOCK; block = octree->blocks[block].next) {
+            const mag_tree_region_t *regions = octree->blocks[block].regions;
+            const uint32_t n = tm_min(remaining, LEAF_BLOCK_SIZE);
+            for (uint32_t i = 0; i < n; ++i) {
+                tm_vec3_t region_min, region_max;
+                region_bounds(regions + i, &region_min, &region_max);
+                uint32_t region_mask = plane_mask;
+                const uint32_t region_class = classify_frustum_bounds(region_min, region_max, planes, &region_mask);
+                if (region_class != FRUSTUM_OUTSIDE)
+                    tm_carray_temp_push(*result, ((mag_region_tree_frustum_key_t) { .key = regions[i].key, .inside = region_class == FRUSTUM_INSIDE }), ta);
+            }
+            remaining -= n;
+        }
+    } else {
+        for (uint32_t i = 0; i < 8; ++i) {
+            if (node->child_mask & ((uint8_t)1 << i))
+                octree_query_frustum_recur(octree, planes, plane_mask, result, ta, node->first_child + i);
         }
     }
+}
 
-    return node_id == 1 ? node : tm_hash_get_ptr(&octree->nodes, node_id);
+static mag_region_tree_frustum_key_t *octree_query_frustum(const mag_region_tree_t *octree, const tm_vec4_t planes[6], tm_temp_allocator_i *ta)
+{
+    mag_region_tree_frustum_key_t *result = NULL;
+    octree_query_frustum_recur(octree, planes, 0x3f, &result, ta, 0);
+    return result;
 }
 
-#define SPLIT_THRESHOLD 16
-#define COLLAPSE_THRESHOLD 8
+// Distances along the ray to the two planes of a slab. A ray parallel to the slab would compute
+// `0 * inf = NaN` if its origin lies on one of the planes, so it's either inside the slab for all
+// `t` or never.
+static inline void ray_slab(float origin, float inv_dir, float min, float max, float *t0, float *t1)
+{
+    if (isinf(inv_dir)) {
+        const bool inside = origin >= min && origin <= max;
+        *t0 = inside ? -INFINITY : INFINITY;
+        *t1 = inside ? INFINITY : -INFINITY;
+        return;
+    }
+    const float ta = (min - origin) * inv_dir, tb = (max - origin) * inv_dir;
+    *t0 = fminf(ta, tb);
+    *t1 = fmaxf(ta, tb);
+}
+
+// Clips the ray to the box. `inv_dir` is the reciprocal of the direction, so the slabs of axes
+// the ray is parallel to give infinite distances.
+static inline bool ray_bounds(tm_vec3_t origin, tm_vec3_t inv_dir, float max_t, tm_vec3_t min, tm_vec3_t max, float *t_enter, float *t_exit)
+{
+    float tx0, tx1, ty0, ty1, tz0, tz1;
+    ray_slab(origin.x, inv_dir.x, min.x, max.x, &tx0, &tx1);
+    ray_slab(origin.y, inv_dir.y, min.y, max.y, &ty0, &ty1);
+    ray_slab(origin.z, inv_dir.z, min.z, max.z, &tz0, &tz1);
+    const float t0 = fmaxf(fmaxf(tx0, ty0), fmaxf(tz0, 0.f));
+    const float t1 = fminf(fminf(tx1, ty1), fminf(tz1, max_t));
+    *t_enter = t0;
+    *t_exit = t1;
+    return t0 <= t1;
+}
+
+// Entry of the raycast heap, either a node or a region.
+typedef struct ray_heap_entry_t
+{
+    float t_enter;
+    float t_exit;
+    // Region key, or node index for nodes.
+    uint64_t key;
+    bool is_region;
+    TM_PAD(7);
+} ray_heap_entry_t;
+
+static void ray_heap_push(ray_heap_entry_t **heap, ray_heap_entry_t entry, tm_temp_allocator_i *ta)
+{
+    tm_carray_temp_push(*heap, entry, ta);
+    ray_heap_entry_t *h = *heap;
+    uint64_t i = tm_carray_size(h) - 1;
+    while (i && h[(i - 1) / 2].t_enter > entry.t_enter) {
+        h[i] = h[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h[i] = entry;
+}
+
+static ray_heap_entry_t ray_heap_pop(ray_heap_entry_t *heap)
+{
+    const ray_heap_entry_t top = heap[0];
+    const ray_heap_entry_t last = tm_carray_pop(heap);
+    const uint64_t n = tm_carray_size(heap);
+    uint64_t i = 0;
+    while (n) {
+        uint64_t child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && heap[child + 1].t_enter < heap[child].t_enter)
+            ++child;
+        if (heap[child].t_enter >= last.t_enter)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (n)
+        heap[i] = last;
+    return top;
+}
+
+// The regions can stick out of the node cells, so the nodes and regions are visited best-first
+// from a heap ordered by the entry distance. A region is only reported once no node in the heap can
+// hold a region that the ray enters earlier.
+static mag_region_tree_ray_hit_t *octree_raycast(const mag_region_tree_t *octree, tm_vec3_t origin, tm_vec3_t dir, float max_t,
+    bool (*hit_callback)(void *data, const mag_region_tree_ray_hit_t *hit), void *data, tm_temp_allocator_i *ta)
+{
+    const tm_vec3_t inv_dir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+    mag_region_tree_ray_hit_t *result = NULL;
+    /* carray */ ray_heap_entry_t *heap = NULL;
+
+    float t_enter, t_exit;
+    const mag_region_tree_node_t *root = octree->nodes;
+    if (ray_bounds(origin, inv_dir, max_t, root->bounds_min, root->bounds_max, &t_enter, &t_exit))
+        ray_heap_push(&heap, (ray_heap_entry_t) { .t_enter = t_enter, .t_exit = t_exit, .key = 0 }, ta);
+
+    while (tm_carray_size(heap)) {
+        const ray_heap_entry_t entry = ray_heap_pop(heap);
+        if (entry.is_region) {
+            const mag_region_tree_ray_hit_t hit = { .key = entry.key, .t_enter = entry.t_enter, .t_exit = entry.t_exit };
+            tm_carray_temp_push(result, hit, ta);
+            if (hit_callback && hit_callback(data, &hit))
+                break;
+            continue;
+        }
+
+        const mag_region_tree_node_t *node = octree->nodes + entry.key;
+        if (!node->first_child) {
+            uint32_t remaining = node->num_regions;
+            for (uint32_t block = node->first_block; block != NO_BLOCK; block = octree->blocks[block].next) {
+                const mag_tree_region_t *regions = octree->blocks[block].regions;
+                const uint32_t n = tm_min(remaining, LEAF_BLOCK_SIZE);
+                for (uint32_t i = 0; i < n; ++i) {
+                    tm_vec3_t region_min, region_max;
+                    region_bounds(regions + i, &region_min, &region_max);
+                    if (ray_bounds(origin, inv_dir, max_t, region_min, region_max, &t_enter, &t_exit))
+                        ray_heap_push(&heap, (ray_heap_entry_t) { .t_enter = t_enter, .t_exit = t_exit, .key = regions[i].key, .is_region = true }, ta);
+                }
+                remaining -= n;
+            }
+        } else {
+            for (uint32_t i = 0; i < 8; ++i) {
+                if (!(node->child_mask & ((uint8_t)1 << i)))
+                    continue;
+                const mag_region_tree_node_t *child = octree->nodes + node->first_child + i;
+                if (ray_bounds(origin, inv_dir, max_t, child->bounds_min, child->bounds_max, &t_enter, &t_exit))
+                    ray_heap_push(&heap, (ray_heap_entry_t) { .t_enter = t_enter, .t_exit = t_exit, .key = node->first_child + i }, ta);
+            }
+        }
+    }
+    return result;
+}
+
+// Turns a full leaf into a node with eight children and moves the regions down into them.
+static void octree_split_leaf(mag_region_tree_t *octree, uint32_t node_i, const aabb_t *node_aabb)
+{
+    const uint32_t first_child = alloc_child_group(octree, node_i);
+    mag_region_tree_node_t *node = write_node(octree, node_i);
+    const uint32_t block = node->first_block;
+    const uint32_t num_regions = node->num_regions;
+    node->first_child = first_child;
+    node->first_block = NO_BLOCK;
+
+    uint8_t child_mask = 0;
+    for (uint32_t i = 0; i < num_regions; ++i) {
+        const mag_tree_region_t region = octree->blocks[block].regions[i];
+        const uint32_t child_i = child_idx_for_point(node_aabb->center, tree_region_aabb(region.pos, region.cell_size).center);
+        leaf_add(octree, first_child + child_i, region);
+        child_mask |= (uint8_t)1 << child_i;
+    }
+    octree->nodes[node_i].child_mask = child_mask;
+    free_leaf_block(octree, block);
+}
 
 static void octree_insert(mag_region_tree_t *octree, tm_vec3_t region_pos, float cell_size, uint64_t key)
 {
     // TODO: warn if region is outside octree boundaries
 
-    aabb_t aabb = tree_region_aabb(region_pos, cell_size);
+    const mag_tree_region_t region = { .pos = region_pos, .cell_size = cell_size, .key = key };
+    const tm_vec3_t center = tree_region_aabb(region_pos, cell_size).center;
 
-    mag_region_tree_node_t *node = &octree->root;
+    uint32_t node_i = 0;
     aabb_t node_aabb = octree->aabb;
-    uint64_t node_id = 1;
-    if (key == 16) {
-        node_id = 1;
-    }
-    if (key == 54) {
-        node_id = 1;
-    }
-    while (true) {
-        if (!node->child_mask) {
-            uint64_t cur_size = tm_carray_size(node->regions);
-            if (cur_size < SPLIT_THRESHOLD) {
-                mag_tree_region_t region = { .pos = region_pos, .cell_size = cell_size, .key = key };
-                tm_carray_push(node->regions, region, octree->allocator);
-                break;
-            } else {
-                node = octree_split_node(octree, node, node_id, &node_aabb);
+    for (uint32_t depth = 0;; ++depth) {
+        if (!octree->nodes[node_i].first_child) {
+            if (octree->nodes[node_i].num_regions < SPLIT_THRESHOLD || depth == MAX_TREE_DEPTH) {
+                leaf_add(octree, node_i, region);
+                return;
             }
+            octree_split_leaf(octree, node_i, &node_aabb);
         }
 
-        uint32_t child_i = child_idx_for_point(node_aabb.center, aabb.center);
-        node_aabb = child_aabb(child_i, &node_aabb);
-        node_id = (node_id << 3) | child_i;
+        mag_region_tree_node_t *node = write_node(octree, node_i);
+        grow_node_bounds(node, &region);
+        ++node->num_regions;
 
-        if (node->child_mask & ((uint8_t)1 << child_i)) {
-            node = tm_hash_get_ptr(&octree->nodes, node_id);
-        } else {
-            node->child_mask |= (uint8_t)1 << child_i;
-            node = tm_hash_add_reference(&octree->nodes, node_id);
-            *node = (mag_region_tree_node_t) { 0 };
-        }
+        const uint32_t child_i = child_idx_for_point(node_aabb.center, center);
+        node->child_mask |= (uint8_t)1 << child_i;
+        node_aabb = child_aabb(child_i, &node_aabb);
+        node_i = node->first_child + child_i;
     }
 }
 
-static void octree_collapse_regions(mag_region_tree_t *octree, uint64_t node_id, mag_tree_region_t **regions)
+// Moves the regions of the subtree into `regions` and frees its nodes and blocks.
+static void octree_gather_regions(mag_region_tree_t *octree, uint32_t node_i, mag_tree_region_t *regions, uint32_t *num_regions)
 {
-    mag_region_tree_node_t *node = tm_hash_get_ptr(&octree->nodes, node_id);
-
-    if (!node->child_mask) {
-        tm_carray_push_array(*regions, node->regions, tm_carray_size(node->regions), octree->allocator);
-        tm_carray_free(node->regions, octree->allocator);
+    const mag_region_tree_node_t node = octree->nodes[node_i];
+    if (!node.first_child) {
+        for (uint32_t i = 0; i < node.num_regions; ++i)
+            regions[(*num_regions)++] = *leaf_region(octree, &node, i);
+        for (uint32_t block = node.first_block; block != NO_BLOCK;) {
+            const uint32_t next = octree->blocks[block].next;
+            free_leaf_block(octree, block);
+            block = next;
+        }
     } else {
-        uint8_t child_mask = node->child_mask;
         for (uint32_t i = 0; i < 8; ++i) {
-            if (child_mask & ((uint8_t)1 << i)) {
-                uint64_t child_id = (node_id << 3) | i;
-                octree_collapse_regions(octree, child_id, regions);
-            }
+            if (node.child_mask & ((uint8_t)1 << i))
+                octree_gather_regions(octree, node.first_child + i, regions, num_regions);
         }
+        free_child_group(octree, node.first_child);
     }
+}
 
-    tm_hash_remove(&octree->nodes, node_id);
+// Turns a node with fewer than `COLLAPSE_THRESHOLD` regions into a leaf.
+static void octree_collapse(mag_region_tree_t *octree, uint32_t node_i)
+{
+    mag_tree_region_t regions[COLLAPSE_THRESHOLD];
+    uint32_t num_regions = 0;
+    octree_gather_regions(octree, node_i, regions, &num_regions);
+
+    mag_region_tree_node_t *node = write_node(octree, node_i);
+    const uint32_t parent = node->parent;
+    *node = empty_leaf();
+    node->parent = parent;
+    for (uint32_t i = 0; i < num_regions; ++i)
+        leaf_add(octree, node_i, regions[i]);
 }
 
-static void count_regions_for_collapse(mag_region_tree_t *octree, uint64_t node_id, uint64_t *region_count)
+// Updates the ancestors of a leaf that lost a region. The counts are exact, so the topmost node
+// that got small enough to collapse is found on the way up.
+static void octree_leaf_shrunk(mag_region_tree_t *octree, uint32_t node_i)
 {
-    mag_region_tree_node_t *node = tm_hash_get_ptr(&octree->nodes, node_id);
-    if (node->child_mask) {
-        for (uint32_t i = 0; i < 8; ++i) {
-            if (node->child_mask & ((uint8_t)1 << i)) {
-                uint64_t child_id = (node_id << 3) | i;
-                count_regions_for_collapse(octree, child_id, region_count);
-                if (*region_count >= COLLAPSE_THRESHOLD)
-                    break;
-            }
+    uint32_t collapse = 0;
+    bool should_collapse = false;
+    for (uint32_t child = node_i; child;) {
+        const uint32_t parent_i = octree->nodes[child].parent;
+        mag_region_tree_node_t *parent = write_node(octree, parent_i);
+        --parent->num_regions;
+        if (!octree->nodes[child].num_regions)
+            parent->child_mask &= ~(uint8_t)(1 << (child - parent->first_child));
+        if (parent->num_regions < COLLAPSE_THRESHOLD) {
+            collapse = parent_i;
+            should_collapse = true;
         }
-    } else {
-        *region_count += tm_carray_size(node->regions);
+        child = parent_i;
     }
+
+    if (should_collapse)
+        octree_collapse(octree, collapse);
 }
 
 static bool octree_remove(mag_region_tree_t *octree, tm_vec3_t region_pos, float cell_size, uint64_t key)
 {
-    aabb_t aabb = tree_region_aabb(region_pos, cell_size);
+    const tm_vec3_t center = tree_region_aabb(region_pos, cell_size).center;
 
-    mag_region_tree_node_t *node = &octree->root;
+    uint32_t node_i = 0;
     aabb_t node_aabb = octree->aabb;
-    uint64_t node_id = 1;
-    while (node->child_mask) {
-        uint32_t child_i = child_idx_for_point(node_aabb.center, aabb.center);
-        if (!(node->child_mask & ((uint8_t)1 << child_i))) {
+    while (octree->nodes[node_i].first_child) {
+        const mag_region_tree_node_t *node = octree->nodes + node_i;
+        const uint32_t child_i = child_idx_for_point(node_aabb.center, center);
+        if (!(node->child_mask & ((uint8_t)1 << child_i)))
             return false;
-        }
 
         node_aabb = child_aabb(child_i, &node_aabb);
-        node_id = (node_id << 3) | child_i;
-        node = tm_hash_get_ptr(&octree->nodes, node_id);
-    }
-
-    uint64_t region_count = tm_carray_size(node->regions);
-    bool found = false;
-    for (uint64_t i = 0; i < region_count; ++i) {
-        if (node->regions[i].key == key) {
-            if (i < region_count - 1)
-                node->regions[i] = node->regions[region_count - 1];
-            tm_carray_shrink(node->regions, region_count - 1);
-            found = true;
-            region_count -= 1;
-            break;
-        }
+        node_i = node->first_child + child_i;
     }
 
-    if (!found) {
+    if (!leaf_remove(octree, node_i, key))
+        return false;
+
+    octree_leaf_shrunk(octree, node_i);
+    return true;
+}
+
+static bool octree_remove_by_key(mag_region_tree_t *octree, uint64_t key)
+{
+    const uint64_t location = tm_hash_get_default(&octree->key_locations, key, NO_LOCATION);
+    if (location == NO_LOCATION)
         return false;
+
+    const uint32_t node_i = (uint32_t)(location >> 32);
+    leaf_remove_at(octree, node_i, (uint32_t)location);
+    octree_leaf_shrunk(octree, node_i);
+    return true;
+}
+
+static bool octree_contains(const mag_region_tree_t *octree, uint64_t key)
+{
+    return tm_hash_has(&octree->key_locations, key);
+}
+
+static bool octree_upsert(mag_region_tree_t *octree, tm_vec3_t region_pos, float cell_size, uint64_t key)
+{
+    const uint64_t location = tm_hash_get_default(&octree->key_locations, key, NO_LOCATION);
+    if (location != NO_LOCATION) {
+        const uint32_t node_i = (uint32_t)(location >> 32);
+        const mag_tree_region_t *region = leaf_region(octree, octree->nodes + node_i, (uint32_t)location);
+        if (region->pos.x == region_pos.x && region->pos.y == region_pos.y && region->pos.z == region_pos.z && region->cell_size == cell_size)
+            return true;
+        leaf_remove_at(octree, node_i, (uint32_t)location);
+        octree_leaf_shrunk(octree, node_i);
     }
 
-    if (!region_count && node_id != 1) {
-        tm_carray_free(node->regions, octree->allocator);
-        tm_hash_remove(&octree->nodes, node_id);
+    octree_insert(octree, region_pos, cell_size, key);
+    return location != NO_LOCATION;
+}
+
+// Region of a batch, with the path to the leaf at `MAX_TREE_DEPTH` that it belongs to.
+typedef struct batch_region_t
+{
+    // Child indices from the root down, three bits per level, starting at the top bits. Sorting by
+    // it orders the regions along a Morton curve.
+    uint64_t morton;
+    mag_tree_region_t region;
+} batch_region_t;
+
+// The code is built with the same child selection as [[octree_insert()]], so that the batch paths
+// always agree with the single region paths, even for centers right on a cell boundary.
+static uint64_t region_morton_code(const mag_region_tree_t *octree, const mag_tree_region_t *region)
+{
+    const tm_vec3_t center = tree_region_aabb(region->pos, region->cell_size).center;
+    aabb_t node_aabb = octree->aabb;
+    uint64_t code = 0;
+    for (uint32_t depth = 0; depth < MAX_TREE_DEPTH; ++depth) {
+        const uint32_t child_i = child_idx_for_point(node_aabb.center, center);
+        code = (code << 3) | child_i;
+        node_aabb = child_aabb(child_i, &node_aabb);
     }
+    return code;
+}
 
-    if (region_count < COLLAPSE_THRESHOLD && node_id != 1) {
-        uint64_t parent_id = node_id >> 3;
-        mag_region_tree_node_t *parent = parent_id == 1 ? &octree->root : tm_hash_get_ptr(&octree->nodes, parent_id);
-        if (!region_count)
-            parent->child_mask &= ~((uint8_t)1 << (node_id & 7));
+static inline uint32_t morton_child(uint64_t code, uint32_t depth)
+{
+    return (uint32_t)(code >> (3 * (MAX_TREE_DEPTH - 1 - depth))) & 7;
+}
 
-        for (uint32_t i = 0; i < 8; ++i) {
-            uint64_t child_id = (parent_id << 3) | i;
-            if (child_id == node_id) {
-                continue;
-            }
-            count_regions_for_collapse(octree, child_id, &region_count);
-            if (region_count >= COLLAPSE_THRESHOLD) {
-                return true;
-            }
+static int compare_batch_regions(const void *a, const void *b)
+{
+    const uint64_t ca = ((const batch_region_t *)a)->morton, cb = ((const batch_region_t *)b)->morton;
+    return ca < cb ? -1 : ca > cb;
+}
+
+static batch_region_t *sorted_batch(const mag_region_tree_t *octree, const mag_region_tree_entry_t *regions, uint32_t num_regions, tm_temp_allocator_i *ta)
+{
+    /* carray */ batch_region_t *batch = 0;
+    tm_carray_temp_resize(batch, num_regions, ta);
+    for (uint32_t i = 0; i < num_regions; ++i)
+        batch[i] = (batch_region_t) { .morton = region_morton_code(octree, regions + i), .region = regions[i] };
+    qsort(batch, num_regions, sizeof(*batch), compare_batch_regions);
+    return batch;
+}
+
+// Adds a sorted run of regions to the subtree of `node_i`. Nodes are split once, when they
+// overflow, instead of once per region.
+static void octree_insert_run(mag_region_tree_t *octree, uint32_t node_i, uint32_t depth, const aabb_t *node_aabb, const batch_region_t *batch, uint32_t num)
+{
+    mag_region_tree_node_t *node = octree->nodes + node_i;
+    if (!node->first_child) {
+        if (node->num_regions + num <= SPLIT_THRESHOLD || depth == MAX_TREE_DEPTH) {
+            for (uint32_t i = 0; i < num; ++i)
+                leaf_add(octree, node_i, batch[i].region);
+            return;
+        }
+        if (node->num_regions) {
+            octree_split_leaf(octree, node_i, node_aabb);
+        } else {
+            const uint32_t first_child = alloc_child_group(octree, node_i);
+            write_node(octree, node_i)->first_child = first_child;
         }
+    }
 
-        // collapse threshold reached, turn this node into leaf
-        uint8_t child_mask = parent->child_mask;
-        parent->child_mask = 0;
-        tm_carray_ensure(parent->regions, region_count, octree->allocator);
-        // parent pointer will be invalid below, so need to copy the region pointer
-        mag_tree_region_t *regions = parent->regions;
-        for (uint32_t i = 0; i < 8; ++i) {
-            if (child_mask & ((uint8_t)1 << i)) {
-                uint64_t child_id = (parent_id << 3) | i;
-                octree_collapse_regions(octree, child_id, &regions);
-            }
+    node = write_node(octree, node_i);
+    for (uint32_t i = 0; i < num; ++i)
+        grow_node_bounds(node, &batch[i].region);
+    node->num_regions += num;
+
+    uint32_t first = 0;
+    while (first < num) {
+        const uint32_t child_i = morton_child(batch[first].morton, depth);
+        uint32_t end = first + 1;
+        while (end < num && morton_child(batch[end].morton, depth) == child_i)
+            ++end;
+
+        octree->nodes[node_i].child_mask |= (uint8_t)1 << child_i;
+        const aabb_t caabb = child_aabb(child_i, node_aabb);
+        octree_insert_run(octree, octree->nodes[node_i].first_child + child_i, depth + 1, &caabb, batch + first, end - first);
+        first = end;
+    }
+}
+
+static void octree_insert_batch(mag_region_tree_t *octree, const mag_region_tree_entry_t *regions, uint32_t num_regions)
+{
+    if (!num_regions)
+        return;
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+    const batch_region_t *batch = sorted_batch(octree, regions, num_regions, ta);
+    octree_insert_run(octree, 0, 0, &octree->aabb, batch, num_regions);
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
+
+// Removes a sorted run of regions from the subtree of `node_i` and returns how many were found.
+// Nodes are collapsed on the way back up, once all their children are done.
+static uint32_t octree_remove_run(mag_region_tree_t *octree, uint32_t node_i, uint32_t depth, const batch_region_t *batch, uint32_t num)
+{
+    if (!octree->nodes[node_i].first_child) {
+        uint32_t removed = 0;
+        for (uint32_t i = 0; i < num; ++i)
+            removed += leaf_remove(octree, node_i, batch[i].region.key);
+        return removed;
+    }
+
+    uint32_t removed = 0;
+    uint32_t first = 0;
+    while (first < num) {
+        const uint32_t child_i = morton_child(batch[first].morton, depth);
+        uint32_t end = first + 1;
+        while (end < num && morton_child(batch[end].morton, depth) == child_i)
+            ++end;
+
+        if (octree->nodes[node_i].child_mask & ((uint8_t)1 << child_i)) {
+            const uint32_t child = octree->nodes[node_i].first_child + child_i;
+            removed += octree_remove_run(octree, child, depth + 1, batch + first, end - first);
+            if (!octree->nodes[child].num_regions)
+                write_node(octree, node_i)->child_mask &= ~(uint8_t)(1 << child_i);
         }
+        first = end;
     }
 
-    return true;
+    mag_region_tree_node_t *node = write_node(octree, node_i);
+    node->num_regions -= removed;
+    if (node->num_regions < COLLAPSE_THRESHOLD)
+        octree_collapse(octree, node_i);
+    return removed;
+}
+
+static uint32_t octree_remove_batch(mag_region_tree_t *octree, const mag_region_tree_entry_t *regions, uint32_t num_regions)
+{
+    if (!num_regions)
+        return 0;
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+    const batch_region_t *batch = sorted_batch(octree, regions, num_regions, ta);
+    const uint32_t removed = octree_remove_run(octree, 0, 0, batch, num_regions);
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return removed;
 }
 
 static struct mag_region_tree_api tree_api = {
@@ -682,10 +2531,55 @@ static struct mag_region_tree_api tree_api = {
     .insert = octree_insert,
     .remove = octree_remove,
     .query = octree_query,
+    .query_batch = octree_query_batch,
+    .query_frustum = octree_query_frustum,
+    .raycast = octree_raycast,
+    .insert_batch = octree_insert_batch,
+    .remove_batch = octree_remove_batch,
+    .remove_by_key = octree_remove_by_key,
+    .contains = octree_contains,
+    .upsert = octree_upsert,
+    .publish = octree_publish,
+    .begin_read = octree_begin_read,
+    .end_read = octree_end_read,
 };
 
 #define MAG_TEST_KEY_COUNT(tr, keys, expected) \
-    TM_UNIT_TESTF((tr), tm_carray_size(keys) == (expected), "expected %llu keys, got %llu", expected, tm_carray_size(keys));
+    TM_UNIT_TESTF((tr), tm_carray_size(keys) == (expected), "expected %llu keys, got %llu", (uint64_t)(expected), tm_carray_size(keys));
+
+static bool test_stop_at_first_hit(void *data, const mag_region_tree_ray_hit_t *hit)
+{
+    return true;
+}
+
+typedef struct tree_reader_test_t
+{
+    mag_region_tree_t *tree;
+    uint32_t num_regions;
+    uint32_t stop;
+    uint32_t num_reads;
+    uint32_t num_failed_reads;
+} tree_reader_test_t;
+
+// Reads snapshots until stopped. The writer only moves regions, so every snapshot holds all of them.
+static void tree_reader_test_thread(void *data)
+{
+    tree_reader_test_t *test = data;
+    while (!atomic_fetch_add_uint32_t(&test->stop, 0)) {
+        TM_INIT_TEMP_ALLOCATOR(ta);
+        uint32_t reader;
+        const mag_region_tree_t *snapshot = tree_api.begin_read(test->tree, &reader);
+        const uint64_t *keys = tree_api.query(snapshot, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 10000, 10000, 10000 }, ta);
+        bool ok = tm_carray_size(keys) == test->num_regions;
+        for (const uint64_t *key = keys; key != tm_carray_end(keys); ++key)
+            ok = ok && *key < test->num_regions && tree_api.contains(snapshot, *key);
+        tree_api.end_read(test->tree, reader);
+        atomic_fetch_add_uint32_t(&test->num_reads, 1);
+        if (!ok)
+            atomic_fetch_add_uint32_t(&test->num_failed_reads, 1);
+        TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    }
+}
 
 static void unit_test_tree_api(tm_unit_test_runner_i *tr, tm_allocator_i *a)
 {
@@ -713,6 +2607,80 @@ static void unit_test_tree_api(tm_unit_test_runner_i *tr, tm_allocator_i *a)
         MAG_TEST_KEY_COUNT(tr, keys, 8);
     }
 
+    {
+        // The queries are answered in a single traversal, but each gets its own keys.
+        const tm_vec3_t mins[3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 29, 29, 29 } };
+        const tm_vec3_t maxs[3] = { { 5, 5, 5 }, { 33, 33, 33 }, { 31, 31, 31 } };
+        uint64_t *keys[3];
+        tree_api.query_batch(tree, mins, maxs, 3, keys, ta);
+        MAG_TEST_KEY_COUNT(tr, keys[0], 1);
+        TM_UNIT_TEST(tr, keys[0][0] == 0);
+        MAG_TEST_KEY_COUNT(tr, keys[1], 8);
+        MAG_TEST_KEY_COUNT(tr, keys[2], 0);
+    }
+
+    {
+        // Box from -1 to 40 on each axis: region 0 is fully inside, the regions at 32 cross the
+        // high planes and the rest are outside.
+        const tm_vec4_t planes[6] = {
+            { 1, 0, 0, 1 }, { -1, 0, 0, 40 },
+            { 0, 1, 0, 1 }, { 0, -1, 0, 40 },
+            { 0, 0, 1, 1 }, { 0, 0, -1, 40 },
+        };
+        mag_region_tree_frustum_key_t *keys = tree_api.query_frustum(tree, planes, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 8);
+        for (uint64_t i = 0; i < tm_carray_size(keys); ++i)
+            TM_UNIT_TESTF(tr, keys[i].inside == (keys[i].key == 0), "region %llu", keys[i].key);
+    }
+
+    {
+        // The ray passes through the column of regions at x = 0, y = 0 in order.
+        mag_region_tree_ray_hit_t *hits = tree_api.raycast(tree, (tm_vec3_t) { 14, 14, -10 }, (tm_vec3_t) { 0, 0, 1 }, 1000.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, insert_size);
+        for (uint32_t i = 0; i < tm_carray_size(hits); ++i)
+            TM_UNIT_TESTF(tr, hits[i].key == i && hits[i].t_enter == 10.f + 32 * i && hits[i].t_exit == 38.f + 32 * i, "hit %u", i);
+    }
+
+    {
+        // Clipped by `max_t` and by the callback.
+        mag_region_tree_ray_hit_t *hits = tree_api.raycast(tree, (tm_vec3_t) { 14, 14, -10 }, (tm_vec3_t) { 0, 0, 1 }, 50.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, 2);
+        TM_UNIT_TEST(tr, hits[1].t_exit == 50.f);
+        hits = tree_api.raycast(tree, (tm_vec3_t) { 14, 14, -10 }, (tm_vec3_t) { 0, 0, 1 }, 1000.f, test_stop_at_first_hit, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, 1);
+    }
+
+    {
+        // Through the gap between the regions.
+        mag_region_tree_ray_hit_t *hits = tree_api.raycast(tree, (tm_vec3_t) { 30, 14, -10 }, (tm_vec3_t) { 0, 0, 1 }, 1000.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, 0);
+        hits = tree_api.raycast(tree, (tm_vec3_t) { 14, 14, -10 }, (tm_vec3_t) { 0, 0, -1 }, 1000.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, 0);
+    }
+
+    {
+        // Axis-aligned rays on the boundary planes of the regions still hit them.
+        mag_region_tree_ray_hit_t *hits = tree_api.raycast(tree, (tm_vec3_t) { 28, 14, -10 }, (tm_vec3_t) { 0, 0, 1 }, 1000.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, insert_size);
+        TM_UNIT_TEST(tr, hits[0].key == 0);
+        hits = tree_api.raycast(tree, (tm_vec3_t) { 32, 0, -10 }, (tm_vec3_t) { 0, 0, 1 }, 1000.f, NULL, NULL, ta);
+        MAG_TEST_KEY_COUNT(tr, hits, insert_size);
+        TM_UNIT_TEST(tr, hits[0].key == insert_size * insert_size);
+    }
+
+    {
+        // A snapshot doesn't see the changes published after it was read.
+        tree_api.publish(tree);
+        uint32_t reader;
+        const mag_region_tree_t *snapshot = tree_api.begin_read(tree, &reader);
+        tree_api.remove(tree, (tm_vec3_t) { 0, 0, 0 }, 1.f, 0);
+        tree_api.publish(tree);
+        uint64_t *keys = tree_api.query(snapshot, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 5, 5, 5 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 1);
+        tree_api.end_read(tree, reader);
+        tree_api.insert(tree, (tm_vec3_t) { 0, 0, 0 }, 1.f, 0);
+    }
+
     {
         tree_api.remove(tree, (tm_vec3_t) { 0, 0, 0 }, 1.f, 0);
         uint64_t *keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 5, 5, 5 }, ta);
@@ -731,7 +2699,114 @@ static void unit_test_tree_api(tm_unit_test_runner_i *tr, tm_allocator_i *a)
         uint64_t *keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 10000, 10000, 10000 }, ta);
         MAG_TEST_KEY_COUNT(tr, keys, 0)
     }
-    TM_UNIT_TEST(tr, !tree->root.child_mask);
+    TM_UNIT_TEST(tr, !tree->nodes[0].child_mask && !tree->nodes[0].first_child);
+
+    {
+        mag_region_tree_entry_t *regions = 0;
+        for (uint32_t x = 0; x < insert_size; ++x) {
+            for (uint32_t y = 0; y < insert_size; ++y) {
+                for (uint32_t z = 0; z < insert_size; ++z) {
+                    const mag_region_tree_entry_t region = { .pos = { (float)(32 * x), (float)(32 * y), (float)(32 * z) }, .cell_size = 1.f, .key = x * insert_size * insert_size + y * insert_size + z };
+                    tm_carray_temp_push(regions, region, ta);
+                }
+            }
+        }
+        const uint32_t num_regions = (uint32_t)tm_carray_size(regions);
+        tree_api.insert_batch(tree, regions, num_regions);
+
+        uint64_t *keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 10000, 10000, 10000 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, num_regions);
+        keys = tree_api.query(tree, (tm_vec3_t) { 33, 0, 0 }, (tm_vec3_t) { 34, 1, 1 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 1);
+        TM_UNIT_TEST(tr, keys[0] == insert_size * insert_size);
+
+        // Removes the low half in x, plus a region that isn't in the tree.
+        const uint32_t num_removed = num_regions / 2;
+        mag_region_tree_entry_t missing = regions[num_regions - 1];
+        missing.key = num_regions;
+        const mag_region_tree_entry_t kept = regions[num_removed];
+        regions[num_removed] = missing;
+        TM_UNIT_TEST(tr, tree_api.remove_batch(tree, regions, num_removed + 1) == num_removed);
+        regions[num_removed] = kept;
+        keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 10000, 10000, 10000 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, num_regions - num_removed);
+        TM_UNIT_TEST(tr, !tree_api.contains(tree, 0));
+        TM_UNIT_TEST(tr, tree_api.contains(tree, num_regions - 1));
+
+        // Moves the last region to where region 0 was.
+        TM_UNIT_TEST(tr, tree_api.upsert(tree, (tm_vec3_t) { 0, 0, 0 }, 1.f, num_regions - 1));
+        keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 5, 5, 5 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 1);
+        TM_UNIT_TEST(tr, keys[0] == num_regions - 1);
+        keys = tree_api.query(tree, regions[num_regions - 1].pos, regions[num_regions - 1].pos, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 0);
+
+        TM_UNIT_TEST(tr, !tree_api.upsert(tree, (tm_vec3_t) { 0, 0, 32 }, 1.f, num_regions));
+        TM_UNIT_TEST(tr, tree_api.contains(tree, num_regions));
+        TM_UNIT_TEST(tr, tree_api.remove_by_key(tree, num_regions));
+        TM_UNIT_TEST(tr, !tree_api.remove_by_key(tree, num_regions));
+        TM_UNIT_TEST(tr, !tree_api.contains(tree, num_regions));
+
+        TM_UNIT_TEST(tr, tree_api.remove_by_key(tree, num_regions - 1));
+        TM_UNIT_TEST(tr, tree_api.remove_batch(tree, regions + num_removed, num_regions - num_removed) == num_regions - num_removed - 1);
+        keys = tree_api.query(tree, (tm_vec3_t) { 0, 0, 0 }, (tm_vec3_t) { 10000, 10000, 10000 }, ta);
+        MAG_TEST_KEY_COUNT(tr, keys, 0);
+        TM_UNIT_TEST(tr, !tree->nodes[0].child_mask && !tree->nodes[0].first_child);
+    }
+
+    {
+        // Readers query snapshots while the writer moves regions and publishes.
+        const uint32_t num_regions = insert_size * insert_size * insert_size;
+        for (uint32_t i = 0; i < num_regions; ++i)
+            tree_api.insert(tree, (tm_vec3_t) { (float)(32 * (i % insert_size)), (float)(32 * (i / insert_size % insert_size)), (float)(32 * (i / insert_size / insert_size)) }, 1.f, i);
+        tree_api.publish(tree);
+
+        tree_reader_test_t test = { .tree = tree, .num_regions = num_regions };
+        tm_thread_o readers[4];
+        for (uint32_t i = 0; i < TM_ARRAY_COUNT(readers); ++i)
+            readers[i] = tm_os_api->thread->create_thread(tree_reader_test_thread, &test, 64 * 1024, "tree reader test");
+
+        uint64_t random = 1;
+        for (uint32_t i = 0; i < 20000 || atomic_fetch_add_uint32_t(&test.num_reads, 0) < 100; ++i) {
+            random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+            const uint64_t key = (random >> 33) % num_regions;
+            const tm_vec3_t pos = { (float)((random >> 8) % 320), (float)((random >> 16) % 320), (float)((random >> 24) % 320) };
+            tree_api.remove_by_key(tree, key);
+            tree_api.insert(tree, pos, 1.f, key);
+            if (i % 8 == 0)
+                tree_api.publish(tree);
+        }
+
+        atomic_exchange_uint32_t(&test.stop, 1);
+        for (uint32_t i = 0; i < TM_ARRAY_COUNT(readers); ++i)
+            tm_os_api->thread->wait_for_thread(readers[i]);
+        TM_UNIT_TEST(tr, test.num_failed_reads == 0);
+
+        // Without readers, every publish reuses a snapshot that holds an older version.
+        tree_api.remove_by_key(tree, 0);
+        for (uint32_t i = 0; i < 64; ++i) {
+            random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+            const uint64_t key = 1 + (random >> 33) % (num_regions - 1);
+            tree_api.upsert(tree, (tm_vec3_t) { (float)((random >> 8) % 320), (float)((random >> 16) % 320), (float)((random >> 24) % 320) }, 1.f, key);
+            tree_api.publish(tree);
+        }
+        uint32_t reader;
+        const mag_region_tree_t *snapshot = tree_api.begin_read(tree, &reader);
+        TM_UNIT_TEST(tr, !tree_api.contains(snapshot, 0));
+        for (uint32_t i = 1; i < num_regions; ++i) {
+            const uint64_t location = tm_hash_get_default(&tree->key_locations, i, NO_LOCATION);
+            TM_UNIT_TEST(tr, tm_hash_get_default(&snapshot->key_locations, i, NO_LOCATION) == location);
+            const mag_tree_region_t *region = leaf_region(tree, tree->nodes + (location >> 32), (uint32_t)location);
+            tm_vec3_t min, max;
+            region_bounds(region, &min, &max);
+            uint64_t *keys = tree_api.query(snapshot, min, max, ta);
+            bool found = false;
+            for (const uint64_t *key = keys; key != tm_carray_end(keys); ++key)
+                found = found || *key == i;
+            TM_UNIT_TEST(tr, found);
+        }
+        tree_api.end_read(tree, reader);
+    }
 
     tree_api.destroy(tree);
     TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
@@ -749,7 +2824,9 @@ TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
     tm_shader_api = tm_get_api(reg, tm_shader_api);
     tm_renderer_api = tm_get_api(reg, tm_renderer_api);
     tm_temp_allocator_api = tm_get_api(reg, tm_temp_allocator_api);
+    tm_job_system_api = tm_get_api(reg, tm_job_system_api);
     tm_error_api = tm_get_api(reg, tm_error_api);
+    tm_os_api = tm_get_api(reg, tm_os_api);
 
     tm_set_or_remove_api(reg, load, mag_voxel_api, &mag_voxel_api);
     tm_set_or_remove_api(reg, load, mag_region_tree_api, &tree_api);
@@ -9,8 +9,10 @@ struct tm_temp_allocator_i;
 struct tm_allocator_i;
 
 struct mag_region_tree_t;
+struct mag_voxel_remesh_cache_o;
 
 typedef struct mag_region_tree_t mag_region_tree_t;
+typedef struct mag_voxel_remesh_cache_o mag_voxel_remesh_cache_o;
 
 enum {
     MAG_VOXEL_CHUNK_SIZE = 28,
@@ -24,21 +26,142 @@ typedef struct mag_voxel_region_t
     tm_vec3_t normals[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
 } mag_voxel_region_t;
 
+// Structure-of-arrays variant of [[mag_voxel_region_t]]. The normal components are stored in
+// separate planes, so the mesher doesn't pull unused components into the cache.
+typedef struct mag_voxel_soa_region_t
+{
+    float densities[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    float nx[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    float ny[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    float nz[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+} mag_voxel_soa_region_t;
+
+// 16-bit quantized variant of [[mag_voxel_soa_region_t]], half the size of the float layouts.
+// The density is `densities[x][y][z] * density_scale` and the normal components are stored as
+// snorm16, i.e. `nx[x][y][z] / 32767.f`.
+typedef struct mag_voxel_soa16_region_t
+{
+    // Must be positive.
+    float density_scale;
+    int16_t densities[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    int16_t nx[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    int16_t ny[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+    int16_t nz[MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE][MAG_VOXEL_REGION_SIZE];
+} mag_voxel_soa16_region_t;
+
 typedef struct mag_voxel_mesh_t
 {
     tm_renderer_handle_t vbuf;
-    // indexes are 16 bit
     tm_renderer_handle_t ibuf;
     uint32_t num_indices;
+    // Size of an index in bytes. 2 unless the mesh has more than 65535 vertices, then 4.
+    uint32_t index_stride;
 } mag_voxel_mesh_t;
 
+// How the mesher places the vertex inside each active cell.
+typedef enum mag_voxel_vertex_placement {
+    // Relaxes the vertex towards the tangent planes with up to 50 steps of interpolated forces.
+    MAG_VOXEL_VERTEX_PLACEMENT_PARTICLE,
+    // Minimizes the quadratic error to the tangent planes in closed form, like the GPU mesher.
+    // Fixed cost per cell.
+    MAG_VOXEL_VERTEX_PLACEMENT_QEF,
+} mag_voxel_vertex_placement;
+
+// Vertices of the owned cells on the low (-X, -Y and -Z) faces of a region's chunk. A region meshed
+// in interior mode publishes its seam, so that the neighbours on its low side can stitch to it
+// without meshing their margins. The positions are in the coordinates of the publishing region.
+typedef struct mag_voxel_seam_t
+{
+    // Bit `v` of `has_vertex[face][u]` is set if `vertices[face][u][v]` is valid. Face 0 is indexed
+    // by (y, z), face 1 by (x, z) and face 2 by (x, y), all relative to `MAG_VOXEL_MARGIN`. A cell
+    // on more than one face is only stored on the first of them.
+    uint32_t has_vertex[3][MAG_VOXEL_CHUNK_SIZE];
+    tm_vec3_t vertices[3][MAG_VOXEL_CHUNK_SIZE][MAG_VOXEL_CHUNK_SIZE];
+} mag_voxel_seam_t;
+
+// A region to mesh with [[dual_contour_job()]] or [[dual_contour_regions()]]. Exactly one of the
+// region pointers must be set.
+typedef struct mag_voxel_contour_job_t
+{
+    const mag_voxel_region_t *region;
+    const mag_voxel_soa_region_t *soa_region;
+    const mag_voxel_soa16_region_t *soa16_region;
+
+    mag_voxel_mesh_t *out_mesh;
+    struct tm_shader_resource_binder_instance_t *inout_rbinder;
+    struct tm_shader_constant_buffer_instance_t *inout_cbuffer;
+
+    mag_voxel_vertex_placement vertex_placement;
+
+    // Interior mode: only the cells of the chunk are meshed, plus the quads that connect them to
+    // the neighbours on the high side. The vertices of the neighbour cells are taken from
+    // `neighbour_seams`, indexed by the neighbour offset `x * 4 + y * 2 + z` (entry 0 is unused),
+    // and computed from the margin if a seam is missing. The region's own seam is published to
+    // `out_seam`, if set.
+    bool interior;
+    TM_PAD(3);
+    mag_voxel_seam_t *out_seam;
+    const mag_voxel_seam_t *neighbour_seams[8];
+} mag_voxel_contour_job_t;
+
+// A 2x2x2 block of neighbouring regions to mesh into a single mesh with [[dual_contour_block()]].
+// The regions are indexed by `x * 4 + y * 2 + z` and region `i` is offset by
+// `MAG_VOXEL_CHUNK_SIZE` along the axes whose bits are set. For each region at most one of the
+// layouts must be set; regions with none are skipped.
+typedef struct mag_voxel_contour_block_t
+{
+    const mag_voxel_region_t *regions[8];
+    const mag_voxel_soa_region_t *soa_regions[8];
+    const mag_voxel_soa16_region_t *soa16_regions[8];
+
+    mag_voxel_vertex_placement vertex_placement;
+
+    mag_voxel_mesh_t *out_mesh;
+    struct tm_shader_resource_binder_instance_t *inout_rbinder;
+    struct tm_shader_constant_buffer_instance_t *inout_cbuffer;
+} mag_voxel_contour_block_t;
+
+// Inclusive box of cells in region coordinates. Cell (x, y, z) spans the samples (x, y, z) to
+// (x + 1, y + 1, z + 1), so changing the samples from `a` to `b` dirties the cells from `a - 1` to `b`.
+typedef struct mag_voxel_cell_box_t
+{
+    int32_t min[3];
+    int32_t max[3];
+} mag_voxel_cell_box_t;
+
+// Region for [[insert_batch()]] and [[remove_batch()]].
+typedef struct mag_region_tree_entry_t
+{
+    tm_vec3_t pos;
+    float cell_size;
+    uint64_t key;
+} mag_region_tree_entry_t;
+
+// Result of [[query_frustum()]].
+typedef struct mag_region_tree_frustum_key_t
+{
+    uint64_t key;
+    // True if the region is fully inside the frustum, false if it crosses one of the planes.
+    bool inside;
+    TM_PAD(7);
+} mag_region_tree_frustum_key_t;
+
+// Region hit by [[raycast()]]. The distances are in units of the ray direction.
+typedef struct mag_region_tree_ray_hit_t
+{
+    uint64_t key;
+    float t_enter;
+    float t_exit;
+} mag_region_tree_ray_hit_t;
+
 struct mag_region_tree_api
 {
     mag_region_tree_t *(*create)(struct tm_allocator_i *allocator, tm_vec3_t min, tm_vec3_t max);
 
     void (*destroy)(mag_region_tree_t *tree);
 
-    // Beware: does *NOT* check for duplicates.
+    // Beware: does *NOT* check for duplicates. Use [[upsert()]] if the key may already be in the
+    // tree. Keys must be less than `UINT64_MAX - 1`.
     void (*insert)(mag_region_tree_t *tree, tm_vec3_t region_pos, float cell_size, uint64_t key);
 
     // Returns true if the region was found (and removed).
@@ -46,9 +169,63 @@ struct mag_region_tree_api
 
     // Returns carray of region keys allocated with the temporary allocator.
     uint64_t *(*query)(const mag_region_tree_t *tree, tm_vec3_t min, tm_vec3_t max, struct tm_temp_allocator_i *ta);
+
+    // Answers `num_queries` AABB queries in a single traversal, so nodes shared by several queries
+    // are only visited once. Sets `out_keys[i]` to a carray of the region keys for the query
+    // (`mins[i]`, `maxs[i]`), allocated with the temporary allocator.
+    void (*query_batch)(const mag_region_tree_t *tree, const tm_vec3_t *mins, const tm_vec3_t *maxs, uint32_t num_queries,
+        uint64_t **out_keys, struct tm_temp_allocator_i *ta);
+
+    // Returns carray of the regions that intersect the frustum, allocated with the temporary
+    // allocator. The planes point inwards: a point `p` is inside plane `n` if
+    // `n.x * p.x + n.y * p.y + n.z * p.z + n.w >= 0`. Subtrees fully inside the frustum are
+    // returned without testing their regions.
+    mag_region_tree_frustum_key_t *(*query_frustum)(const mag_region_tree_t *tree, const tm_vec4_t planes[6], struct tm_temp_allocator_i *ta);
+
+    // Returns carray of the regions hit by the ray `origin + t * dir` for `t` in [0, `max_t`],
+    // sorted by `t_enter` and allocated with the temporary allocator. If `hit_callback` is set, it
+    // is called for each hit in order and the walk stops as soon as it returns true, e.g. once the
+    // caller has found the surface in a region.
+    mag_region_tree_ray_hit_t *(*raycast)(const mag_region_tree_t *tree, tm_vec3_t origin, tm_vec3_t dir, float max_t,
+        bool (*hit_callback)(void *data, const mag_region_tree_ray_hit_t *hit), void *data, struct tm_temp_allocator_i *ta);
+
+    // Same as calling [[insert()]] for each region, but the regions are sorted along a Morton curve
+    // and each subtree is built or extended in one pass. Beware: does *NOT* check for duplicates.
+    void (*insert_batch)(mag_region_tree_t *tree, const mag_region_tree_entry_t *regions, uint32_t num_regions);
+
+    // Same as calling [[remove()]] for each region, but each subtree is pruned and collapsed once.
+    // Returns the number of regions that were found (and removed).
+    uint32_t (*remove_batch)(mag_region_tree_t *tree, const mag_region_tree_entry_t *regions, uint32_t num_regions);
+
+    // The tree keeps the location of each key, so the functions below don't descend the tree. If a
+    // key was inserted more than once, they only see the most recent copy.
+
+    // Returns true if the region was found (and removed).
+    bool (*remove_by_key)(mag_region_tree_t *tree, uint64_t key);
+
+    bool (*contains)(const mag_region_tree_t *tree, uint64_t key);
+
+    // Inserts the region, or moves it if the key is already in the tree with a different position
+    // or cell size. Returns true if the key was already in the tree.
+    bool (*upsert)(mag_region_tree_t *tree, tm_vec3_t region_pos, float cell_size, uint64_t key);
+
+    // The tree is not thread-safe, so other threads read a published snapshot of it instead. A
+    // snapshot is a read-only tree that works with all the `const` functions above.
+
+    // Publishes the current state of the tree, if it changed since the last call. Must be called
+    // from the thread that modifies the tree. Snapshots are reused once no reader holds them, and
+    // only the nodes and leaf blocks that changed since a snapshot's version are copied into it. A
+    // new snapshot, allocated while readers hold the others, gets a full copy.
+    void (*publish)(mag_region_tree_t *tree);
+
+    // Returns the latest snapshot, which stays valid until [[end_read()]] is called with `reader`,
+    // regardless of what the writer does meanwhile. Doesn't lock. Up to 64 reads can be active at
+    // a time; more spin until one ends.
+    const mag_region_tree_t *(*begin_read)(mag_region_tree_t *tree, uint32_t *reader);
+    void (*end_read)(mag_region_tree_t *tree, uint32_t reader);
 };
 
-#define mag_region_tree_api_version TM_VERSION(1, 0, 0)
+#define mag_region_tree_api_version TM_VERSION(1, 5, 0)
 
 struct mag_voxel_api
 {
@@ -59,6 +236,70 @@ struct mag_voxel_api
         mag_voxel_mesh_t *out_mesh,
         struct tm_shader_resource_binder_instance_t *inout_rbinder,
         struct tm_shader_constant_buffer_instance_t *inout_cbuffer);
+
+    // Same as [[dual_contour_region()]], but for the structure-of-arrays layout.
+    void (*dual_contour_soa_region)(
+        const mag_voxel_soa_region_t *region,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io,
+        mag_voxel_mesh_t *out_mesh,
+        struct tm_shader_resource_binder_instance_t *inout_rbinder,
+        struct tm_shader_constant_buffer_instance_t *inout_cbuffer);
+
+    // Same as [[dual_contour_region()]], but for the 16-bit quantized layout.
+    void (*dual_contour_soa16_region)(
+        const mag_voxel_soa16_region_t *region,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io,
+        mag_voxel_mesh_t *out_mesh,
+        struct tm_shader_resource_binder_instance_t *inout_rbinder,
+        struct tm_shader_constant_buffer_instance_t *inout_cbuffer);
+
+    // Meshes all of the `jobs` in parallel on the job system and blocks until they are done. The
+    // meshes are uploaded with a single resource command buffer. All seams are published before
+    // any region reads them, so neighbours can be meshed in the same batch.
+    void (*dual_contour_regions)(
+        const mag_voxel_contour_job_t *jobs,
+        uint32_t num_jobs,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io);
+
+    // Meshes a single job on the calling thread. Unlike [[dual_contour_region()]] and its variants,
+    // this lets the caller pick the vertex placement.
+    void (*dual_contour_job)(
+        const mag_voxel_contour_job_t *job,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io);
+
+    // Meshes a 2x2x2 block of regions into one mesh, in the coordinates of the first region. Meant
+    // for the far LODs, where it saves 7 of every 8 draw calls and buffer pairs.
+    void (*dual_contour_block)(
+        const mag_voxel_contour_block_t *block,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io);
+
+    // Creates a cache for [[remesh_region()]]. Each cache takes about 420 KB plus a copy of the
+    // mesh. Destroying the cache doesn't destroy the mesh buffers.
+    mag_voxel_remesh_cache_o *(*create_remesh_cache)(struct tm_allocator_i *allocator);
+
+    void (*destroy_remesh_cache)(mag_voxel_remesh_cache_o *cache);
+
+    // Meshes the region of `job` on the calling thread like [[dual_contour_job()]], and keeps the
+    // cell vertices and quads in `cache`. If `dirty` is set, only the cells in the box and the quads
+    // that use them are recomputed and the existing buffers of `job->out_mesh` are patched in place,
+    // so the cost scales with the size of the box. Buffers that are too small for the new mesh are
+    // replaced and the old ones destroyed. The mesh may contain degenerate triangles left behind by
+    // removed quads.
+    //
+    // `job->out_mesh` must be the same mesh in every call with the same cache. The first call and
+    // calls that switch `job->interior` mesh the whole region. In interior mode, the border cells
+    // must be included in `dirty` when a neighbour seam changes.
+    void (*remesh_region)(
+        const mag_voxel_contour_job_t *job,
+        mag_voxel_remesh_cache_o *cache,
+        const mag_voxel_cell_box_t *dirty,
+        struct tm_renderer_backend_i *backend,
+        struct tm_shader_io_o *io);
 };
 
-#define mag_voxel_api_version TM_VERSION(1, 0, 0)
\ No newline at end of file
+#define mag_voxel_api_version TM_VERSION(2, 0, 0)
\ No newline at end of file
@@ -0,0 +1,606 @@
+// Standalone benchmark for `mag_voxel`: the region tree and the CPU mesher. It includes the plugin
+// source directly, so it can time the internal passes without the engine, with stub allocators and a
+// stub renderer in place of the engine APIs. Prints the results as JSON to stdout.
+//
+// Usage: mag_voxel_benchmark [max_regions]
+
+#include "plugins/mag_voxel/mag_voxel.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Stub engine APIs. They count allocations, so a regression that starts allocating in a hot path
+// shows up in the results.
+
+static uint64_t bench_allocations;
+static uint64_t bench_temp_allocations;
+
+static void *bench_realloc(tm_allocator_i *a, void *ptr, uint64_t old_size, uint64_t new_size, const char *file, uint32_t line)
+{
+    if (!new_size) {
+        free(ptr);
+        return 0;
+    }
+    ++bench_allocations;
+    return realloc(ptr, new_size);
+}
+
+static tm_allocator_i bench_allocator = { .realloc = bench_realloc };
+
+// Temp allocations are kept in a list and freed when the temp allocator is destroyed.
+typedef struct bench_temp_block_t
+{
+    struct bench_temp_block_t *next;
+    uint64_t size;
+} bench_temp_block_t;
+
+typedef struct bench_temp_allocator_t
+{
+    tm_temp_allocator_i i;
+    bench_temp_block_t *blocks;
+} bench_temp_allocator_t;
+
+static void *bench_temp_realloc(tm_temp_allocator_i *ta, void *ptr, uint64_t old_size, uint64_t new_size, const char *file, uint32_t line)
+{
+    if (new_size <= old_size)
+        return new_size ? ptr : 0;
+
+    bench_temp_allocator_t *temp = (bench_temp_allocator_t *)ta->inst;
+    bench_temp_block_t *block = malloc(sizeof(bench_temp_block_t) + new_size);
+    *block = (bench_temp_block_t) { .next = temp->blocks, .size = new_size };
+    temp->blocks = block;
+    ++bench_temp_allocations;
+    if (ptr)
+        memcpy(block + 1, ptr, old_size);
+    return block + 1;
+}
+
+static tm_temp_allocator_i *bench_temp_create(tm_allocator_i *backing)
+{
+    bench_temp_allocator_t *temp = calloc(1, sizeof(bench_temp_allocator_t));
+    temp->i = (tm_temp_allocator_i) { .inst = (void *)temp, .realloc = bench_temp_realloc };
+    return &temp->i;
+}
+
+static tm_temp_allocator_i *bench_temp_create_in_buffer(char *buffer, uint64_t size, tm_allocator_i *backing)
+{
+    return bench_temp_create(backing);
+}
+
+static void bench_temp_destroy(tm_temp_allocator_i *ta)
+{
+    bench_temp_allocator_t *temp = (bench_temp_allocator_t *)ta->inst;
+    for (bench_temp_block_t *block = temp->blocks, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(temp);
+}
+
+static struct tm_temp_allocator_api bench_temp_allocator_api = {
+    .create = bench_temp_create,
+    .create_in_buffer = bench_temp_create_in_buffer,
+    .destroy = bench_temp_destroy,
+};
+
+// The renderer hands out plain memory for mapped buffers, which is freed by
+// [[bench_renderer_reset()]]. Shader resources are ignored.
+
+#define BENCH_MAX_BUFFERS 64
+
+static void *bench_buffers[BENCH_MAX_BUFFERS];
+static uint32_t bench_num_buffers;
+
+static tm_renderer_handle_t bench_map_create_buffer(tm_renderer_resource_command_buffer_o *inst, const tm_renderer_buffer_desc_t *desc,
+    uint32_t device_affinity_mask, uint32_t flags, void **data)
+{
+    if (bench_num_buffers == BENCH_MAX_BUFFERS) {
+        fprintf(stderr, "mag_voxel_benchmark: out of stub buffers\n");
+        exit(1);
+    }
+    *data = malloc(desc->size + 1);
+    bench_buffers[bench_num_buffers] = *data;
+    return (tm_renderer_handle_t) { .resource = ++bench_num_buffers };
+}
+
+static void bench_map_update_buffer(tm_renderer_resource_command_buffer_o *inst, tm_renderer_handle_t handle, uint64_t offset, uint64_t size,
+    uint32_t device_affinity_mask, uint32_t flags, void **data)
+{
+    *data = (char *)bench_buffers[handle.resource - 1] + offset;
+}
+
+static void bench_destroy_resource(tm_renderer_resource_command_buffer_o *inst, tm_renderer_handle_t handle)
+{
+}
+
+static void bench_renderer_reset(void)
+{
+    for (uint32_t i = 0; i < bench_num_buffers; ++i)
+        free(bench_buffers[i]);
+    bench_num_buffers = 0;
+}
+
+static struct tm_renderer_resource_command_buffer_api bench_resource_command_buffer_api = {
+    .map_create_buffer = bench_map_create_buffer,
+    .map_update_buffer = bench_map_update_buffer,
+    .destroy_resource = bench_destroy_resource,
+};
+
+static struct tm_renderer_api bench_renderer_api = {
+    .tm_renderer_resource_command_buffer_api = &bench_resource_command_buffer_api,
+};
+
+static void bench_resource_command_buffers(tm_renderer_backend_o *inst, tm_renderer_resource_command_buffer_o **buffers, uint32_t num_buffers)
+{
+}
+
+static tm_renderer_backend_i bench_backend = {
+    .create_resource_command_buffers = bench_resource_command_buffers,
+    .submit_resource_command_buffers = bench_resource_command_buffers,
+    .destroy_resource_command_buffers = bench_resource_command_buffers,
+};
+
+static bool bench_lookup_resource(tm_shader_io_o *io, tm_strhash_t name, tm_shader_resource_t *resource, uint32_t *resource_slot)
+{
+    return false;
+}
+
+static void bench_create_resource_binder_instances(tm_shader_io_o *io, uint32_t num_instances, tm_shader_resource_binder_instance_t *instances)
+{
+    for (uint32_t i = 0; i < num_instances; ++i)
+        instances[i].instance_id = 1;
+}
+
+static void bench_create_constant_buffer_instances(tm_shader_io_o *io, uint32_t num_instances, tm_shader_constant_buffer_instance_t *instances)
+{
+    for (uint32_t i = 0; i < num_instances; ++i)
+        instances[i].instance_id = 1;
+}
+
+static void bench_update_constants_raw(tm_shader_io_o *io, tm_renderer_resource_command_buffer_o *res_buf, const uint32_t *instance_ids,
+    const void **data, uint32_t offset, uint32_t size, uint32_t num_instances)
+{
+}
+
+static struct tm_shader_api bench_shader_api = {
+    .lookup_resource = bench_lookup_resource,
+    .create_resource_binder_instances = bench_create_resource_binder_instances,
+    .create_constant_buffer_instances = bench_create_constant_buffer_instances,
+    .update_constants_raw = bench_update_constants_raw,
+};
+
+// Test fields, sampled in region sample coordinates.
+
+typedef enum bench_sdf_t {
+    BENCH_SDF_SPHERE,
+    BENCH_SDF_FBM,
+    BENCH_SDF_CAVES,
+    BENCH_SDF_COUNT,
+} bench_sdf_t;
+
+static const char *bench_sdf_names[BENCH_SDF_COUNT] = { "sphere", "fbm", "caves" };
+
+static float lattice_value(int x, int y, int z)
+{
+    uint32_t h = (uint32_t)(x * 73856093) ^ (uint32_t)(y * 19349663) ^ (uint32_t)(z * 83492791);
+    h ^= h >> 13;
+    h *= 0x5bd1e995;
+    h ^= h >> 15;
+    return (float)(h & 0xffff) / 65535.f * 2.f - 1.f;
+}
+
+static float value_noise(float x, float y, float z)
+{
+    const float fx0 = floorf(x), fy0 = floorf(y), fz0 = floorf(z);
+    const int ix = (int)fx0, iy = (int)fy0, iz = (int)fz0;
+    const float fx = x - fx0, fy = y - fy0, fz = z - fz0;
+    float res = 0.f;
+    for (int c = 0; c < 8; ++c) {
+        const int dx = c >> 2, dy = (c >> 1) & 1, dz = c & 1;
+        res += lattice_value(ix + dx, iy + dy, iz + dz) * (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+    }
+    return res;
+}
+
+// Positive inside, same as the terrain densities.
+static float sdf(bench_sdf_t kind, tm_vec3_t p)
+{
+    switch (kind) {
+    case BENCH_SDF_SPHERE:
+        return 11.3f - tm_vec3_length(tm_vec3_sub(p, (tm_vec3_t) { 16.2f, 15.7f, 16.1f }));
+    case BENCH_SDF_FBM: {
+        float f = 0.f, amplitude = 8.f, scale = 1.f / 8.f;
+        for (int o = 0; o < 4; ++o) {
+            f += amplitude * value_noise(p.x * scale, p.y * scale, p.z * scale);
+            amplitude *= 0.5f;
+            scale *= 2.f;
+        }
+        return f + (14.f - p.y);
+    }
+    default: {
+        float f = 0.f, amplitude = 4.f, scale = 1.f / 6.f;
+        for (int o = 0; o < 3; ++o) {
+            f += amplitude * value_noise(p.x * scale + 7.f, p.y * scale, p.z * scale);
+            amplitude *= 0.5f;
+            scale *= 2.f;
+        }
+        return fabsf(f) - 0.6f;
+    }
+    }
+}
+
+static tm_vec3_t sdf_gradient(bench_sdf_t kind, tm_vec3_t p)
+{
+    const float e = 0.01f;
+    return (tm_vec3_t) {
+        (sdf(kind, (tm_vec3_t) { p.x + e, p.y, p.z }) - sdf(kind, (tm_vec3_t) { p.x - e, p.y, p.z })) / (2.f * e),
+        (sdf(kind, (tm_vec3_t) { p.x, p.y + e, p.z }) - sdf(kind, (tm_vec3_t) { p.x, p.y - e, p.z })) / (2.f * e),
+        (sdf(kind, (tm_vec3_t) { p.x, p.y, p.z + e }) - sdf(kind, (tm_vec3_t) { p.x, p.y, p.z - e })) / (2.f * e),
+    };
+}
+
+static void fill_region(mag_voxel_region_t *region, bench_sdf_t kind)
+{
+    for (int x = 0; x < MAG_VOXEL_REGION_SIZE; ++x) {
+        for (int y = 0; y < MAG_VOXEL_REGION_SIZE; ++y) {
+            for (int z = 0; z < MAG_VOXEL_REGION_SIZE; ++z) {
+                const tm_vec3_t p = { (float)x, (float)y, (float)z };
+                region->densities[x][y][z] = sdf(kind, p);
+                region->normals[x][y][z] = tm_vec3_normalize(sdf_gradient(kind, p));
+            }
+        }
+    }
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#define BENCH_REPEATS 20
+
+// Best time of the repeats, with the allocations of the last one.
+typedef struct bench_sample_t
+{
+    double seconds;
+    uint64_t allocations;
+    uint64_t temp_allocations;
+    double start;
+    uint64_t start_allocations;
+    uint64_t start_temp_allocations;
+} bench_sample_t;
+
+static void bench_start(bench_sample_t *sample)
+{
+    sample->start_allocations = bench_allocations;
+    sample->start_temp_allocations = bench_temp_allocations;
+    sample->start = now_seconds();
+}
+
+static void bench_stop(bench_sample_t *sample)
+{
+    const double t = now_seconds() - sample->start;
+    sample->seconds = sample->seconds && sample->seconds < t ? sample->seconds : t;
+    sample->allocations = bench_allocations - sample->start_allocations;
+    sample->temp_allocations = bench_temp_allocations - sample->start_temp_allocations;
+}
+
+// Records are printed as the elements of a single JSON array.
+static bool bench_first_record = true;
+
+static void bench_begin_record(void)
+{
+    printf(bench_first_record ? "\n  {" : ",\n  {");
+    bench_first_record = false;
+}
+
+static void print_tree_record(const char *workload, uint32_t num_regions, uint32_t ops, const bench_sample_t *sample)
+{
+    bench_begin_record();
+    printf("\"suite\": \"region_tree\", \"workload\": \"%s\", \"regions\": %u, \"ops\": %u, \"ns_per_op\": %.1f, "
+           "\"allocations\": %llu, \"temp_allocations\": %llu}",
+        workload, num_regions, ops, sample->seconds * 1e9 / ops, (unsigned long long)sample->allocations,
+        (unsigned long long)sample->temp_allocations);
+}
+
+// Region tree workloads.
+
+static uint32_t bench_random_state = 1;
+
+static uint32_t bench_random(void)
+{
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 17;
+    bench_random_state ^= bench_random_state << 5;
+    return bench_random_state;
+}
+
+#define BENCH_QUERIES 10000
+#define BENCH_RAYS 1000
+
+typedef struct bench_tree_input_t
+{
+    // Regions on a cubic grid in random order, the key is the index in the grid.
+    mag_region_tree_entry_t *regions;
+    uint32_t num_regions;
+    tm_vec3_t min;
+    tm_vec3_t max;
+    // Each query box is a region grown by a cell, so it finds the region and its neighbours, like
+    // the neighbour lookups in the engine.
+    tm_vec3_t query_mins[BENCH_QUERIES];
+    tm_vec3_t query_maxs[BENCH_QUERIES];
+    tm_vec3_t ray_origins[BENCH_RAYS];
+    tm_vec3_t ray_dirs[BENCH_RAYS];
+} bench_tree_input_t;
+
+static void make_tree_input(bench_tree_input_t *input, uint32_t num_regions)
+{
+    const float region_size = (float)MAG_VOXEL_CHUNK_SIZE;
+    uint32_t side = 1;
+    while (side * side * side < num_regions)
+        ++side;
+
+    input->num_regions = num_regions;
+    input->regions = malloc(num_regions * sizeof(mag_region_tree_entry_t));
+    for (uint32_t i = 0; i < num_regions; ++i) {
+        const tm_vec3_t pos = { (float)(i % side) * region_size, (float)(i / side % side) * region_size, (float)(i / side / side) * region_size };
+        input->regions[i] = (mag_region_tree_entry_t) { .pos = pos, .cell_size = 1.f, .key = i };
+    }
+    for (uint32_t i = num_regions - 1; i > 0; --i) {
+        const uint32_t j = bench_random() % (i + 1);
+        const mag_region_tree_entry_t t = input->regions[i];
+        input->regions[i] = input->regions[j];
+        input->regions[j] = t;
+    }
+    input->min = (tm_vec3_t) { 0, 0, 0 };
+    input->max = (tm_vec3_t) { (float)side * region_size, (float)side * region_size, (float)side * region_size };
+
+    for (uint32_t i = 0; i < BENCH_QUERIES; ++i) {
+        const mag_region_tree_entry_t *region = input->regions + bench_random() % num_regions;
+        input->query_mins[i] = tm_vec3_sub(region->pos, (tm_vec3_t) { 1, 1, 1 });
+        input->query_maxs[i] = tm_vec3_add(region->pos, (tm_vec3_t) { region_size + 1, region_size + 1, region_size + 1 });
+    }
+    for (uint32_t i = 0; i < BENCH_RAYS; ++i) {
+        const mag_region_tree_entry_t *region = input->regions + bench_random() % num_regions;
+        input->ray_origins[i] = tm_vec3_add(region->pos, (tm_vec3_t) { 0.5f * region_size, 0.5f * region_size, 0.5f * region_size });
+        const tm_vec3_t dir = { (float)(bench_random() % 2001) - 1000.f, (float)(bench_random() % 2001) - 1000.f, (float)(bench_random() % 2001) - 1000.f };
+        input->ray_dirs[i] = tm_vec3_length(dir) > 0.f ? tm_vec3_normalize(dir) : (tm_vec3_t) { 1, 0, 0 };
+    }
+}
+
+static mag_region_tree_t *make_tree(const bench_tree_input_t *input)
+{
+    mag_region_tree_t *tree = tree_api.create(&bench_allocator, input->min, input->max);
+    tree_api.insert_batch(tree, input->regions, input->num_regions);
+    return tree;
+}
+
+static bool bench_count_hit(void *data, const mag_region_tree_ray_hit_t *hit)
+{
+    ++*(uint32_t *)data;
+    return false;
+}
+
+static void bench_tree(uint32_t num_regions)
+{
+    static bench_tree_input_t input;
+    make_tree_input(&input, num_regions);
+    const uint32_t n = input.num_regions;
+    const uint32_t repeats = tm_max(1, tm_min(BENCH_REPEATS, 1000000 / n));
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            mag_region_tree_t *tree = tree_api.create(&bench_allocator, input.min, input.max);
+            bench_start(&sample);
+            for (uint32_t i = 0; i < n; ++i)
+                tree_api.insert(tree, input.regions[i].pos, input.regions[i].cell_size, input.regions[i].key);
+            bench_stop(&sample);
+            tree_api.destroy(tree);
+        }
+        print_tree_record("insert", n, n, &sample);
+    }
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            mag_region_tree_t *tree = tree_api.create(&bench_allocator, input.min, input.max);
+            bench_start(&sample);
+            tree_api.insert_batch(tree, input.regions, n);
+            bench_stop(&sample);
+            tree_api.destroy(tree);
+        }
+        print_tree_record("insert_batch", n, n, &sample);
+    }
+
+    mag_region_tree_t *tree = make_tree(&input);
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tm_temp_allocator_i *ta = bench_temp_create(0);
+            bench_start(&sample);
+            for (uint32_t i = 0; i < BENCH_QUERIES; ++i)
+                tree_api.query(tree, input.query_mins[i], input.query_maxs[i], ta);
+            bench_stop(&sample);
+            bench_temp_destroy(ta);
+        }
+        print_tree_record("query", n, BENCH_QUERIES, &sample);
+    }
+
+    {
+        static uint64_t *keys[BENCH_QUERIES];
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tm_temp_allocator_i *ta = bench_temp_create(0);
+            bench_start(&sample);
+            tree_api.query_batch(tree, input.query_mins, input.query_maxs, BENCH_QUERIES, keys, ta);
+            bench_stop(&sample);
+            bench_temp_destroy(ta);
+        }
+        print_tree_record("query_batch", n, BENCH_QUERIES, &sample);
+    }
+
+    {
+        bench_sample_t sample = { 0 };
+        uint32_t hits = 0;
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tm_temp_allocator_i *ta = bench_temp_create(0);
+            bench_start(&sample);
+            for (uint32_t i = 0; i < BENCH_RAYS; ++i)
+                tree_api.raycast(tree, input.ray_origins[i], input.ray_dirs[i], 4.f * MAG_VOXEL_CHUNK_SIZE, bench_count_hit, &hits, ta);
+            bench_stop(&sample);
+            bench_temp_destroy(ta);
+        }
+        print_tree_record("raycast", n, BENCH_RAYS, &sample);
+    }
+
+    {
+        // Cost of publishing after a single change, which copies the whole tree.
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            const mag_region_tree_entry_t *region = input.regions + r % n;
+            tree_api.remove_by_key(tree, region->key);
+            tree_api.insert(tree, region->pos, region->cell_size, region->key);
+            bench_start(&sample);
+            tree_api.publish(tree);
+            bench_stop(&sample);
+        }
+        print_tree_record("publish", n, 1, &sample);
+    }
+
+    tree_api.destroy(tree);
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tree = make_tree(&input);
+            bench_start(&sample);
+            for (uint32_t i = 0; i < n; ++i)
+                tree_api.remove(tree, input.regions[i].pos, input.regions[i].cell_size, input.regions[i].key);
+            bench_stop(&sample);
+            tree_api.destroy(tree);
+        }
+        print_tree_record("remove", n, n, &sample);
+    }
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tree = make_tree(&input);
+            bench_start(&sample);
+            for (uint32_t i = 0; i < n; ++i)
+                tree_api.remove_by_key(tree, input.regions[i].key);
+            bench_stop(&sample);
+            tree_api.destroy(tree);
+        }
+        print_tree_record("remove_by_key", n, n, &sample);
+    }
+
+    {
+        bench_sample_t sample = { 0 };
+        for (uint32_t r = 0; r < repeats; ++r) {
+            tree = make_tree(&input);
+            bench_start(&sample);
+            tree_api.remove_batch(tree, input.regions, n);
+            bench_stop(&sample);
+            tree_api.destroy(tree);
+        }
+        print_tree_record("remove_batch", n, n, &sample);
+    }
+
+    free(input.regions);
+}
+
+// Mesher workloads.
+
+static void bench_vertex_placement(const mag_voxel_region_t *region, bench_sdf_t kind, mag_voxel_vertex_placement placement, const char *placement_name)
+{
+    const region_view_t view = region_view(REGION_LAYOUT_AOS, region);
+
+    contour_state_t state;
+    contour_count(&view, placement, false, 0, &state);
+    tm_vec3_t *vertices = malloc(state.num_vertices * sizeof(tm_vec3_t) + 1);
+    void *triangles = malloc(state.num_indices * mesh_index_stride(state.num_vertices) + 1);
+
+    bench_sample_t sample = { 0 };
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        bench_start(&sample);
+        contour_count(&view, placement, false, 0, &state);
+        contour_emit(&view, placement, &state, 0, (tm_vec3_t) { 0 }, 0, vertices, triangles, mesh_index_stride(state.num_vertices));
+        bench_stop(&sample);
+    }
+
+    // First-order distance of each vertex to the surface. It overestimates the error where the
+    // gradient vanishes, e.g. at the creases of the caves field.
+    double sum_error = 0.0, max_error = 0.0;
+    for (uint32_t v = 0; v < state.num_vertices; ++v) {
+        const tm_vec3_t p = tm_vec3_add(vertices[v], (tm_vec3_t) { MAG_VOXEL_MARGIN, MAG_VOXEL_MARGIN, MAG_VOXEL_MARGIN });
+        const double error = fabs(sdf(kind, p)) / fmax(tm_vec3_length(sdf_gradient(kind, p)), 1e-6);
+        sum_error += error;
+        max_error = error > max_error ? error : max_error;
+    }
+    const double mean_error = state.num_vertices ? sum_error / state.num_vertices : 0.0;
+
+    bench_begin_record();
+    printf("\"suite\": \"mesher\", \"workload\": \"contour\", \"sdf\": \"%s\", \"placement\": \"%s\", \"vertices\": %u, "
+           "\"indices\": %u, \"ns_per_op\": %.1f, \"ns_per_vertex\": %.1f, \"mean_error\": %.4f, \"max_error\": %.4f, "
+           "\"allocations\": %llu, \"temp_allocations\": %llu}",
+        bench_sdf_names[kind], placement_name, state.num_vertices, state.num_indices, sample.seconds * 1e9,
+        state.num_vertices ? sample.seconds * 1e9 / state.num_vertices : 0.0, mean_error, max_error,
+        (unsigned long long)sample.allocations, (unsigned long long)sample.temp_allocations);
+
+    free(vertices);
+    free(triangles);
+}
+
+// The whole `dual_contour_region()` call, including buffer creation and binding on the stub renderer.
+static void bench_dual_contour_region(const mag_voxel_region_t *region, bench_sdf_t kind)
+{
+    mag_voxel_mesh_t mesh = { 0 };
+    tm_shader_resource_binder_instance_t rbinder = { 0 };
+    tm_shader_constant_buffer_instance_t cbuffer = { 0 };
+
+    bench_sample_t sample = { 0 };
+    uint32_t num_buffers = 0;
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        bench_start(&sample);
+        mag_voxel_api.dual_contour_region(region, &bench_backend, 0, &mesh, &rbinder, &cbuffer);
+        bench_stop(&sample);
+        num_buffers = bench_num_buffers;
+        bench_renderer_reset();
+    }
+
+    bench_begin_record();
+    printf("\"suite\": \"mesher\", \"workload\": \"dual_contour_region\", \"sdf\": \"%s\", \"indices\": %u, "
+           "\"ns_per_op\": %.1f, \"buffers\": %u, \"allocations\": %llu, \"temp_allocations\": %llu}",
+        bench_sdf_names[kind], mesh.num_indices, sample.seconds * 1e9, num_buffers, (unsigned long long)sample.allocations,
+        (unsigned long long)sample.temp_allocations);
+}
+
+int main(int argc, char **argv)
+{
+    tm_temp_allocator_api = &bench_temp_allocator_api;
+    tm_renderer_api = &bench_renderer_api;
+    tm_shader_api = &bench_shader_api;
+
+    const uint32_t max_regions = argc > 1 ? (uint32_t)strtoul(argv[1], 0, 10) : 1000000;
+
+    printf("[");
+    for (uint32_t num_regions = 1000; num_regions <= max_regions; num_regions *= 10)
+        bench_tree(num_regions);
+
+    static mag_voxel_region_t region;
+    for (bench_sdf_t kind = 0; kind < BENCH_SDF_COUNT; ++kind) {
+        fill_region(&region, kind);
+        bench_vertex_placement(&region, kind, MAG_VOXEL_VERTEX_PLACEMENT_PARTICLE, "particle");
+        bench_vertex_placement(&region, kind, MAG_VOXEL_VERTEX_PLACEMENT_QEF, "qef");
+        bench_dual_contour_region(&region, kind);
+    }
+    printf("\n]\n");
+    return 0;
+}
@@ -225,3 +225,13 @@ project "mag_player_simulation"
     language "C++"
     sysincludedirs {".."}
     files {"mag_player_simulation/*.inl", "mag_player_simulation/*.h", "mag_player_simulation/*.c"}
+
+project "mag_voxel_benchmark"
+    location "build/mag_voxel_benchmark"
+    targetname "mag_voxel_benchmark"
+    kind "ConsoleApp"
+    language "C++"
+    sysincludedirs {".."}
+    files {"mag_voxel_benchmark/*.inl", "mag_voxel_benchmark/*.h", "mag_voxel_benchmark/*.c"}
+    filter {"platforms:Linux"}
+        links {"m"}